@@ -3,36 +3,67 @@
 #define __VIRTUALBOT_H__
 
 #include <linux/module.h>
+#include <linux/hrtimer.h>
+#include <linux/jump_label.h>
+#include <linux/list.h>
+#include <linux/kfifo.h>
+#include <linux/prandom.h>
+#include <linux/spinlock.h>
+#include <linux/tty.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/workqueue.h>
 
 #define VIRTUALBOT_DRIVER_NAME "emulatedport_tty"
 
 #define VIRTUALBOT_TTY_NAME "ttyEmulatedPort"
 
-#define VIRTUALBOT_TTY_MAJOR 200
+// 0 lets the kernel pick a free major at load time
+#define VIRTUALBOT_TTY_MAJOR 0
 
 #define VB_COMM_DRIVER_NAME "exogenous_tty"
 
 #define VB_COMM_TTY_NAME "ttyExogenous"
 
-#define VB_COMM_TTY_MAJOR (VIRTUALBOT_TTY_MAJOR + 1)
+#define VB_COMM_TTY_MAJOR 0
 
-// Set this to 1 for extra debugging messages
-#define VIRTUALBOT_DEBUG 1
+// Default number of port pairs, overridden by the 'pairs' module parameter
+#define VIRTUALBOT_DEFAULT_PAIRS VIRTUALBOT_NUMBER_OF_PORTS
 
-// Maximum numbers of Virtualbot devices
-#define VIRTUALBOT_MAX_TTY_MINORS VIRTUALBOT_NUMBER_OF_PORTS
+// Default for the 'max_pairs' module parameter, pairs created at runtime included
+#define VIRTUALBOT_DEFAULT_MAX_PAIRS 1024
+
+// Maximum number of port pairs a single module instance can handle
+#define VIRTUALBOT_MAX_PAIRS 16384
 
 // Maximum number of characters for a signal
 #define VIRTUALBOT_MAX_SIGNAL_LEN 262
 
+// Default atomic size, writes up to it reach the peer whole
+#define VIRTUALBOT_ATOMIC_DEFAULT VIRTUALBOT_MAX_SIGNAL_LEN
+
+// Largest atomic size, what the pacer and the framer can hold at once
+#define VIRTUALBOT_ATOMIC_MAX 4096
+
+// Range of the receive buffer depth of one direction of a pair
+#define VIRTUALBOT_DEPTH_MIN VIRTUALBOT_ATOMIC_MAX
+#define VIRTUALBOT_DEPTH_MAX (16 << 20)
+
 /*
-	Maximum number of signals that can be stored
+	Data written while the receiving port is closed, see virtualbot_store.c
 
 	Since the driver won't release its allocated memory when the tty port 
 	is closed it is important to have a safeguard against unlimited kernel
 	memory allocation to prevent system colapse
 */
-#define VIRTUALBOT_TOTAL_SIGNALS 10
+
+// Data bytes of one chunk, with its header a chunk takes 512 bytes
+#define VIRTUALBOT_STORE_CHUNK_SIZE 488
+
+// Default for the 'store_budget' module parameter, for all pairs together
+#define VIRTUALBOT_STORE_BUDGET (16 << 20)
+
+// Default limit of one direction of a pair
+#define VIRTUALBOT_STORE_DEFAULT_LIMIT (64 << 10)
 
 
 /**
@@ -40,6 +71,500 @@
 */
 #define IGNORE_CHAR_CBUFFER_SIZE 512
 
+// Bytes that can wait for paced delivery, per direction (power of 2)
+#define VIRTUALBOT_PACING_FIFO_SIZE 4096
+
+// Most EmulatedPorts that can listen to one Exogenous port, a write holds all their locks
+#define VIRTUALBOT_BUS_MAX_MEMBERS 128
+
+// Room reported by a bus master while no member is open
+#define VIRTUALBOT_BUS_IDLE_ROOM 65536
+
+// Default minimum interval between paced deliveries, in microseconds
+#define VIRTUALBOT_PACING_TICK_US 500
+
+// Longest frame held back by the framer, longer lines are cut
+#define VIRTUALBOT_FRAMING_BUFFER_SIZE 4096
+
+// Bytes of records waiting to be replayed, per replay (power of 2)
+#define VIRTUALBOT_REPLAY_FIFO_SIZE (256 << 10)
+
+// Most records delivered by one tick of a replay timer
+#define VIRTUALBOT_REPLAY_BATCH 64
+
+// Delay before retrying a record that didn't fit in the receiving port
+#define VIRTUALBOT_REPLAY_RETRY_US 1000
+
+/**
+ * Traffic counters of one direction of a pair, one copy per CPU
+ */
+struct virtualbot_stats {
+	u64_stats_t bytes;	/* delivered to the receiving flip buffer */
+	u64_stats_t writes;	/* write calls */
+	u64_stats_t pushes;	/* flip buffer pushes */
+	u64_stats_t overruns;	/* writes the receiver didn't take in full */
+	u64_stats_t dropped;	/* bytes it didn't take, left to the writer */
+	u64_stats_t parity_errors;	/* injected, see virtualbot_fault.c */
+	u64_stats_t frame_errors;
+	u64_stats_t overrun_errors;
+	u64_stats_t malformed_frames;	/* see virtualbot_framing.c */
+	struct u64_stats_sync syncp;
+};
+
+/* The same counters, added up over all CPUs */
+struct virtualbot_traffic {
+	u64 bytes;
+	u64 writes;
+	u64 pushes;
+	u64 overruns;
+	u64 dropped;
+	u64 parity_errors;
+	u64 frame_errors;
+	u64 overrun_errors;
+	u64 malformed_frames;
+};
+
+struct virtualbot_stats __percpu *virtualbot_stats_alloc(void);
+
+void virtualbot_stats_account(struct virtualbot_stats __percpu *stats,
+	unsigned int writes,
+	size_t bytes,
+	unsigned int pushes,
+	size_t dropped);
+
+void virtualbot_stats_account_errors(struct virtualbot_stats __percpu *stats,
+	unsigned int parity,
+	unsigned int frame,
+	unsigned int overrun);
+
+void virtualbot_stats_account_lost(struct virtualbot_stats __percpu *stats,
+	size_t lost);
+
+void virtualbot_stats_account_malformed(struct virtualbot_stats __percpu *stats,
+	unsigned int frames);
+
+void virtualbot_stats_read(struct virtualbot_stats __percpu *stats,
+	struct virtualbot_traffic *traffic);
+
+// Buckets of the latency histograms, bucket n counts from 2^n to 2^(n+1) ns
+#define VIRTUALBOT_LATENCY_BUCKETS 32
+
+/**
+ * Latency histograms of one direction of a pair, one copy per CPU
+ */
+struct virtualbot_latency_hist {
+	u64_stats_t latency[VIRTUALBOT_LATENCY_BUCKETS];	/* from the write call to the line discipline */
+	u64_stats_t residency[VIRTUALBOT_LATENCY_BUCKETS];	/* from the push to the line discipline */
+	struct u64_stats_sync syncp;
+};
+
+/**
+ * Times one chunk at a time through a link, see virtualbot_latency.c
+ */
+struct virtualbot_latency {
+
+	/* Protects everything below but 'pushed', nests in the link's lock */
+	spinlock_t lock;
+
+	/* Bytes pushed into the receiving flip buffer, protected by the link's lock */
+	u64 pushed;
+
+	/* Bytes the line discipline took from it */
+	u64 consumed;
+
+	/* VIRTUALBOT_SAMPLE_* of the chunk being timed */
+	unsigned int sample;
+
+	ktime_t written;
+	ktime_t pushed_at;
+
+	/* Value of 'consumed' once the chunk is read */
+	u64 end;
+
+	/* NULL until debugfs asks for them, set once */
+	struct virtualbot_latency_hist __percpu *hist;
+};
+
+struct virtualbot_link;
+struct dentry;
+
+void virtualbot_latency_init(struct virtualbot_latency *latency);
+
+void virtualbot_latency_destroy(struct virtualbot_latency *latency);
+
+size_t virtualbot_latency_size(void);
+
+void virtualbot_latency_start(struct virtualbot_link *link);
+
+void virtualbot_latency_push(struct virtualbot_link *link, size_t count);
+
+void virtualbot_latency_consume(struct virtualbot_link *link, size_t count);
+
+void virtualbot_latency_resync(struct virtualbot_link *link);
+
+struct dentry *virtualbot_latency_add_pair(unsigned int index,
+	struct virtualbot_link *to_exogenous,
+	struct virtualbot_link *to_emulated);
+
+void virtualbot_latency_debugfs_init(void);
+
+void virtualbot_latency_debugfs_exit(void);
+
+/**
+ * Baud rate emulation for one direction of a pair, see virtualbot_pacing.c
+ */
+struct virtualbot_pacer {
+
+	/* Protects everything below, taken from the timer's softirq */
+	spinlock_t lock;
+
+	struct hrtimer timer;
+
+	/* Data waiting to cross the wire */
+	DECLARE_KFIFO_PTR(fifo, unsigned char);
+
+	bool allocated;	/* fifo is allocated */
+
+	bool enabled;	/* new data goes through the fifo */
+
+	bool running;	/* timer armed, fifo not empty */
+
+	/* Time to transmit one frame, 0 means no delay */
+	u64 ns_per_char;
+
+	/* Wire time not used yet */
+	u64 credit_ns;
+
+	ktime_t last;
+};
+
+void virtualbot_pacer_init(struct virtualbot_pacer *pacer);
+
+void virtualbot_pacer_destroy(struct virtualbot_pacer *pacer);
+
+void virtualbot_pacer_set_termios(struct virtualbot_pacer *pacer,
+	const struct ktermios *termios);
+
+int virtualbot_pacer_enable(struct virtualbot_pacer *pacer, bool enable);
+
+bool virtualbot_pacer_active(struct virtualbot_pacer *pacer);
+
+size_t virtualbot_pacer_write(struct virtualbot_pacer *pacer,
+	const unsigned char *buffer,
+	size_t count);
+
+unsigned int virtualbot_pacer_room(struct virtualbot_pacer *pacer);
+
+/**
+ * Frames held back until they are complete, see virtualbot_framing.c
+ */
+struct virtualbot_framer {
+
+	/* Protects everything below, taken before the pacer's lock */
+	spinlock_t lock;
+
+	unsigned int mode;	/* SERIALEMU_FRAMING_* */
+
+	/* Written data not delivered yet, allocated when framing is first enabled */
+	unsigned char *buffer;
+	size_t start;
+	size_t length;
+
+	/* Length of the frame at 'start' once it is complete, and how much of it was delivered */
+	size_t frame;
+	size_t done;
+
+	bool resync;	/* the last frame was malformed */
+};
+
+void virtualbot_framer_init(struct virtualbot_framer *framer);
+
+void virtualbot_framer_destroy(struct virtualbot_framer *framer);
+
+bool virtualbot_framer_active(struct virtualbot_framer *framer);
+
+unsigned int virtualbot_framer_room(struct virtualbot_framer *framer);
+
+/**
+ * Data held while the receiving port is closed, see virtualbot_store.c
+ */
+struct virtualbot_store {
+
+	/* Protects everything below, taken before the framer's lock */
+	spinlock_t lock;
+
+	unsigned int policy;	/* SERIALEMU_STORE_* */
+
+	bool peer_open;	/* the receiving port is open */
+
+	/* Chunks of held data, oldest first */
+	struct list_head chunks;
+	size_t bytes;
+	size_t limit;
+};
+
+void virtualbot_store_init(struct virtualbot_store *store);
+
+void virtualbot_store_destroy(struct virtualbot_store *store);
+
+bool virtualbot_store_active(struct virtualbot_store *store);
+
+unsigned int virtualbot_store_room(struct virtualbot_store *store);
+
+int virtualbot_store_cache_init(void);
+
+void virtualbot_store_cache_exit(void);
+
+/**
+ * Faults injected in one direction of a pair, see virtualbot_fault.c
+ */
+struct virtualbot_fault {
+
+	struct rnd_state rnd;
+
+	/* Faults per SERIALEMU_FAULT_SCALE bytes */
+	u32 bitflip;
+	u32 drop;
+	u32 duplicate;
+	u32 parity;
+	u32 frame;
+	u32 overrun;
+};
+
+/**
+ * One direction of a pair, see virtualbot_link.c
+ */
+struct virtualbot_link {
+
+	unsigned int index;	/* of the pair */
+
+	bool emulated;	/* written on the EmulatedPort side */
+
+	/* Port that writes the data and port that receives it */
+	struct tty_port *writer;
+	struct tty_port *port;
+
+	/* Serializes the producers of the receiving flip buffer, nests in pacer.lock */
+	spinlock_t lock;
+
+	/* Counters of this direction */
+	struct virtualbot_stats __percpu *stats;
+
+	/* NULL unless faults are injected, protected by 'lock' */
+	struct virtualbot_fault *fault;
+
+	/* Writes up to this many bytes are taken whole or not at all */
+	unsigned int atomic;
+
+	/* Most bytes the receiving flip buffer held, protected by 'lock' */
+	unsigned int high_water;
+
+	/* Pushes go to the high priority workqueue, on 'cpu' unless unbound */
+	bool low_latency;
+	int cpu;
+	struct work_struct push_work;
+
+	struct virtualbot_latency latency;
+
+	struct virtualbot_pacer pacer;
+
+	struct virtualbot_framer framer;
+
+	struct virtualbot_store store;
+};
+
+/**
+ * True when a write of 'count' bytes must wait for 'room' to grow instead
+ * of being split
+ */
+static inline bool virtualbot_link_must_wait(struct virtualbot_link *link,
+	size_t count,
+	size_t room)
+{
+	return count > room && count <= READ_ONCE( link->atomic );
+}
+
+DECLARE_STATIC_KEY_FALSE(virtualbot_fault_key);
+
+/* Largest number of characters one byte can turn into: itself, a copy, an overrun */
+#define VIRTUALBOT_FAULT_MAX_CHARS 3
+
+/**
+ * True when the data of the link goes through the fault injector,
+ * must be called with the link's lock held
+ */
+static inline bool virtualbot_fault_active(struct virtualbot_link *link)
+{
+	return static_branch_unlikely( &virtualbot_fault_key ) && link->fault;
+}
+
+struct serialemu_faults;
+
+int virtualbot_fault_set(struct virtualbot_link *link,
+	const struct serialemu_faults *config);
+
+size_t virtualbot_fault_deliver(struct virtualbot_link *link,
+	const unsigned char *buffer,
+	size_t count,
+	size_t *inserted,
+	size_t *lost);
+
+void virtualbot_fault_destroy(struct virtualbot_link *link);
+
+int virtualbot_framer_set_mode(struct virtualbot_link *link, unsigned int mode);
+
+size_t virtualbot_framer_write(struct virtualbot_link *link,
+	const unsigned char *buffer,
+	size_t count);
+
+void virtualbot_framer_wakeup(struct virtualbot_link *link);
+
+int virtualbot_store_set(struct virtualbot_link *link, unsigned int policy, u64 limit);
+
+void virtualbot_store_peer(struct virtualbot_link *link, bool open);
+
+size_t virtualbot_store_write(struct virtualbot_link *link,
+	const unsigned char *buffer,
+	size_t count);
+
+void virtualbot_store_wakeup(struct virtualbot_link *link);
+
+void virtualbot_link_init(struct virtualbot_link *link,
+	bool emulated,
+	struct tty_port *writer,
+	struct tty_port *port);
+
+void virtualbot_link_destroy(struct virtualbot_link *link);
+
+int virtualbot_link_set_atomic(struct virtualbot_link *link, unsigned int size);
+
+int virtualbot_link_set_depth(struct virtualbot_link *link, unsigned int depth);
+
+unsigned int virtualbot_link_depth(struct virtualbot_link *link);
+
+unsigned int virtualbot_link_occupancy(struct virtualbot_link *link);
+
+unsigned int virtualbot_link_high_water(struct virtualbot_link *link, bool reset);
+
+int virtualbot_link_set_latency(struct virtualbot_link *link, bool low_latency, int cpu);
+
+void virtualbot_link_push(struct virtualbot_link *link, size_t count);
+
+int virtualbot_link_wq_init(void);
+
+void virtualbot_link_wq_exit(void);
+
+size_t virtualbot_link_transfer(struct virtualbot_link *link,
+	const unsigned char *buffer,
+	size_t count);
+
+size_t virtualbot_link_queue(struct virtualbot_link *link,
+	const unsigned char *buffer,
+	size_t count);
+
+unsigned int virtualbot_link_capacity(struct virtualbot_link *link);
+
+unsigned int virtualbot_link_whole_room(struct virtualbot_link *link);
+
+size_t virtualbot_link_deliver(struct virtualbot_link *link,
+	const unsigned char *buffer,
+	size_t count);
+
+unsigned int virtualbot_link_space(struct virtualbot_link *link);
+
+size_t virtualbot_link_forward(struct virtualbot_link *link,
+	const unsigned char *buffer,
+	size_t count);
+
+size_t virtualbot_link_write(struct virtualbot_link *link,
+	const unsigned char *buffer,
+	size_t count);
+
+unsigned int virtualbot_link_room(struct virtualbot_link *link);
+
+void virtualbot_link_wakeup(struct virtualbot_link *link);
+
+/* Pair management, see virtualbot_main.c */
+struct virtualbot_pair;
+
+int virtualbot_pair_add(int index);
+
+struct virtualbot_pair *virtualbot_pair_get(unsigned int index);
+
+void virtualbot_pair_put(struct virtualbot_pair *pair);
+
+struct virtualbot_link *virtualbot_pair_link(struct virtualbot_pair *pair,
+	unsigned int direction);
+
+bool virtualbot_pair_receiving(struct virtualbot_pair *pair, unsigned int direction);
+
+int virtualbot_pair_remove(unsigned int index);
+
+unsigned int virtualbot_pair_list(u32 *indexes, unsigned int max);
+
+unsigned int virtualbot_pair_capacity(void);
+
+int virtualbot_pair_set_pacing(unsigned int index, bool enable);
+
+int virtualbot_pair_set_faults(const struct serialemu_faults *faults);
+
+struct serialemu_framing;
+
+int virtualbot_pair_set_framing(const struct serialemu_framing *framing);
+
+struct serialemu_store;
+
+int virtualbot_pair_set_store(const struct serialemu_store *store);
+
+struct serialemu_loopback;
+
+int virtualbot_pair_set_loopback(const struct serialemu_loopback *loopback);
+
+struct serialemu_atomic;
+
+int virtualbot_pair_set_atomic(const struct serialemu_atomic *atomic);
+
+struct serialemu_depth;
+
+int virtualbot_pair_depth(struct serialemu_depth *depth);
+
+struct serialemu_latency;
+
+int virtualbot_pair_set_latency(const struct serialemu_latency *latency);
+
+int virtualbot_bus_attach(unsigned int master, unsigned int member);
+
+int virtualbot_bus_detach(unsigned int master, unsigned int member);
+
+/* Traffic capture, see virtualbot_capture.c */
+struct virtualbot_capture;
+
+void virtualbot_capture_record(struct virtualbot_capture *capture,
+	unsigned int direction,
+	unsigned int flags,
+	const unsigned char *buffer,
+	size_t count);
+
+int virtualbot_pair_capture_start(unsigned int index,
+	struct virtualbot_capture *capture,
+	struct virtualbot_pair **pair);
+
+void virtualbot_pair_capture_stop(struct virtualbot_pair *pair);
+
+int virtualbot_capture_init(void);
+
+void virtualbot_capture_exit(void);
+
+/* Traffic replay, see virtualbot_replay.c */
+int virtualbot_replay_init(void);
+
+void virtualbot_replay_exit(void);
+
+/* Control device, see virtualbot_ctl.c */
+int virtualbot_ctl_init(void);
+
+void virtualbot_ctl_exit(void);
+
 struct virtualbot_dev {
 	// struct scull_qset *data;  /* Pointer to first quantum set */
 	//int quantum;              /* the current quantum size */
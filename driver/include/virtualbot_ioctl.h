@@ -0,0 +1,239 @@
+#ifndef __VIRTUALBOT_IOCTL_H__
+
+#define __VIRTUALBOT_IOCTL_H__
+
+/*
+ * Interface between the driver and user space
+ *
+ * This header is included both by the module and by the user space tools,
+ * so it must only depend on the kernel UAPI headers
+ */
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+// Control device, created on /dev
+#define SERIALEMU_CTL_NAME "serialemu-ctl"
+
+#define SERIALEMU_IOC_MAGIC 'V'
+
+// Lets the driver pick the index of a new pair
+#define SERIALEMU_ANY_INDEX ((__u32)-1)
+
+// Length of the device names returned by SERIALEMU_IOC_CREATE
+#define SERIALEMU_NAME_LEN 32
+
+struct serialemu_pair_info {
+	__u32 index;		/* pair index, or SERIALEMU_ANY_INDEX on create */
+	__u32 reserved;
+	char emulated[SERIALEMU_NAME_LEN];	/* e.g. "ttyEmulatedPort0" */
+	char exogenous[SERIALEMU_NAME_LEN];	/* e.g. "ttyExogenous0" */
+};
+
+struct serialemu_pair_list {
+	__u32 count;		/* in: room in 'indexes', out: entries filled */
+	__u32 total;		/* out: number of pairs that exist */
+	__u64 indexes;		/* user pointer to an array of __u32 */
+};
+
+struct serialemu_pacing {
+	__u32 index;		/* pair index */
+	__u32 enable;		/* 1 delivers data at the termios baud rate */
+};
+
+// Fault rates are given in faults per million bytes
+#define SERIALEMU_FAULT_SCALE 1000000
+
+// Directions of a pair
+#define SERIALEMU_TO_EXOGENOUS	0	/* written on the EmulatedPort */
+#define SERIALEMU_TO_EMULATED	1	/* written on the Exogenous port */
+
+struct serialemu_faults {
+	__u32 index;		/* pair index */
+	__u32 direction;	/* SERIALEMU_TO_EXOGENOUS or SERIALEMU_TO_EMULATED */
+	__u64 seed;		/* of the PRNG that decides the faults */
+	__u32 bitflip;		/* one random bit of the byte is inverted */
+	__u32 drop;		/* the byte is lost */
+	__u32 duplicate;	/* the byte is received twice */
+	__u32 parity;		/* the byte is received with TTY_PARITY */
+	__u32 frame;		/* the byte is received with TTY_FRAME */
+	__u32 overrun;		/* a TTY_OVERRUN is received after the byte */
+};
+
+// Creates a pair, returns its index and device names
+#define SERIALEMU_IOC_CREATE	_IOWR(SERIALEMU_IOC_MAGIC, 0x01, struct serialemu_pair_info)
+
+// Destroys the pair with the given index, its open ports are hung up
+#define SERIALEMU_IOC_DESTROY	_IOW(SERIALEMU_IOC_MAGIC, 0x02, __u32)
+
+// Lists the indexes of the existing pairs
+#define SERIALEMU_IOC_LIST	_IOWR(SERIALEMU_IOC_MAGIC, 0x03, struct serialemu_pair_list)
+
+// Turns the baud rate emulation of a pair on or off
+#define SERIALEMU_IOC_SET_PACING	_IOW(SERIALEMU_IOC_MAGIC, 0x04, struct serialemu_pacing)
+
+// Framing modes, the data written on a side reaches the peer in whole frames
+#define SERIALEMU_FRAMING_NONE		0
+#define SERIALEMU_FRAMING_JAVINO	1	/* "fffe", two hex digits of length, payload */
+#define SERIALEMU_FRAMING_LINE		2	/* up to and including '\n' */
+
+struct serialemu_framing {
+	__u32 index;		/* pair index */
+	__u32 direction;	/* SERIALEMU_TO_EXOGENOUS or SERIALEMU_TO_EMULATED */
+	__u32 mode;		/* SERIALEMU_FRAMING_* */
+	__u32 reserved;
+};
+
+// What happens to data written while the receiving port is closed
+#define SERIALEMU_STORE_OFF		0	/* the write fails with ENODEV */
+#define SERIALEMU_STORE_DROP_OLDEST	1	/* held, older data is lost when full */
+#define SERIALEMU_STORE_DROP_NEWEST	2	/* held, newer data is lost when full */
+#define SERIALEMU_STORE_BLOCK		3	/* held, the writer waits when full */
+
+struct serialemu_store {
+	__u32 index;		/* pair index */
+	__u32 direction;	/* SERIALEMU_TO_EXOGENOUS or SERIALEMU_TO_EMULATED */
+	__u32 policy;		/* SERIALEMU_STORE_* */
+	__u32 reserved;
+	__u64 limit;		/* bytes held at most, 0 keeps the current limit */
+};
+
+struct serialemu_loopback {
+	__u32 index;		/* pair index */
+	__u32 direction;	/* SERIALEMU_TO_EXOGENOUS loops the EmulatedPort, SERIALEMU_TO_EMULATED the Exogenous port */
+	__u32 enable;		/* 0 wires the side to its peer again */
+	__u32 reserved;
+};
+
+struct serialemu_atomic {
+	__u32 index;		/* pair index */
+	__u32 direction;	/* SERIALEMU_TO_EXOGENOUS or SERIALEMU_TO_EMULATED */
+	__u32 size;		/* writes up to this many bytes reach the peer whole */
+	__u32 reserved;
+};
+
+struct serialemu_depth {
+	__u32 index;		/* pair index */
+	__u32 direction;	/* SERIALEMU_TO_EXOGENOUS or SERIALEMU_TO_EMULATED */
+	__u32 depth;		/* bytes the receiving port holds, 0 keeps the current depth */
+	__u32 flags;		/* SERIALEMU_DEPTH_* */
+	__u32 occupancy;	/* returned: bytes held now */
+	__u32 high_water;	/* returned: most bytes held */
+};
+
+#define SERIALEMU_DEPTH_RESET_HIGH_WATER	0x0001	/* after returning it */
+
+struct serialemu_latency {
+	__u32 index;		/* pair index */
+	__u32 direction;	/* SERIALEMU_TO_EXOGENOUS or SERIALEMU_TO_EMULATED */
+	__u32 enable;		/* same as ASYNC_LOW_LATENCY set with TIOCSSERIAL on the receiving port */
+	__s32 cpu;		/* CPU that flushes the receiving port, -1 for the one that pushed */
+};
+
+struct serialemu_bus {
+	__u32 master;		/* pair whose Exogenous port drives the bus */
+	__u32 member;		/* pair whose EmulatedPort listens to it */
+};
+
+// Capture device, created on /dev, see struct serialemu_capture_ring
+#define SERIALEMU_CAPTURE_NAME "serialemu-capture"
+
+#define SERIALEMU_CAPTURE_VERSION 1
+
+// Size of the data area of a capture ring, a power of 2
+#define SERIALEMU_CAPTURE_MIN_SIZE	(64 << 10)
+#define SERIALEMU_CAPTURE_MAX_SIZE	(64 << 20)
+
+// Records start on this boundary
+#define SERIALEMU_CAPTURE_ALIGN 8
+
+// Record flags
+#define SERIALEMU_CAPTURE_PAD		0x0001	/* no data, skip 'length' bytes */
+#define SERIALEMU_CAPTURE_TRUNCATED	0x0002	/* the write was longer than the record */
+#define SERIALEMU_CAPTURE_SHORT		0x0004	/* the port took fewer bytes than written */
+#define SERIALEMU_CAPTURE_BUS		0x0008	/* written on a bus, see SERIALEMU_IOC_BUS_ATTACH */
+#define SERIALEMU_CAPTURE_LOOP		0x0010	/* looped back to the writer, see SERIALEMU_IOC_SET_LOOPBACK */
+
+struct serialemu_capture {
+	__u32 index;		/* pair to capture */
+	__u32 reserved;
+	__u64 size;		/* of the data area */
+};
+
+/*
+ * First page of the mapping of /dev/serialemu-capture, the data area starts
+ * at 'data_offset'. Positions are byte counts since the capture started, the
+ * offset of a position in the data area is pos & (data_size - 1).
+ *
+ * The reader owns 'tail'. The record at 'tail' is complete once its 'pos'
+ * equals 'tail' (read it with acquire semantics), then 'tail' is advanced
+ * past it. When fewer than sizeof(struct serialemu_capture_record) bytes are
+ * left before the end of the data area, the next record starts at offset 0.
+ */
+struct serialemu_capture_ring {
+	__u32 version;		/* SERIALEMU_CAPTURE_VERSION */
+	__u32 data_offset;
+	__u64 data_size;
+	__u64 head;		/* end of the records reserved so far */
+	__u64 lost;		/* records dropped because the ring was full */
+	__u64 reserved[4];
+	__u64 tail;		/* written by the reader, on its own cache line */
+};
+
+struct serialemu_capture_record {
+	__u64 pos;		/* position of the record once it is complete */
+	__u64 timestamp;	/* CLOCK_MONOTONIC, in nanoseconds */
+	__u32 length;		/* of the data that follows, not aligned */
+	__u16 direction;	/* SERIALEMU_TO_EXOGENOUS or SERIALEMU_TO_EMULATED */
+	__u16 flags;
+};
+
+// Replay device, created on /dev, records are written to it as in a capture ring
+#define SERIALEMU_REPLAY_NAME "serialemu-replay"
+
+// Longest record that can be replayed
+#define SERIALEMU_REPLAY_MAX_LENGTH 4096
+
+// Replay speeds, in thousandths of the recorded pace
+#define SERIALEMU_REPLAY_ASAP		0	/* ignore the timestamps */
+#define SERIALEMU_REPLAY_REALTIME	1000
+
+struct serialemu_replay {
+	__u32 index;		/* pair to replay into */
+	__u32 speed;		/* 2000 replays twice as fast, 500 at half speed */
+};
+
+// Sets the faults injected in one direction of a pair, all rates at 0 turn them off
+#define SERIALEMU_IOC_SET_FAULTS	_IOW(SERIALEMU_IOC_MAGIC, 0x05, struct serialemu_faults)
+
+// Attaches the EmulatedPort of a pair to the bus driven by another Exogenous port
+#define SERIALEMU_IOC_BUS_ATTACH	_IOW(SERIALEMU_IOC_MAGIC, 0x06, struct serialemu_bus)
+
+// Detaches it, it talks to its own Exogenous port again
+#define SERIALEMU_IOC_BUS_DETACH	_IOW(SERIALEMU_IOC_MAGIC, 0x07, struct serialemu_bus)
+
+// Starts capturing a pair, on a file of the capture device
+#define SERIALEMU_IOC_CAPTURE_START	_IOW(SERIALEMU_IOC_MAGIC, 0x08, struct serialemu_capture)
+
+// Starts replaying into a pair, on a file of the replay device
+#define SERIALEMU_IOC_REPLAY_START	_IOW(SERIALEMU_IOC_MAGIC, 0x09, struct serialemu_replay)
+
+// Sets the framing of one direction of a pair
+#define SERIALEMU_IOC_SET_FRAMING	_IOW(SERIALEMU_IOC_MAGIC, 0x0a, struct serialemu_framing)
+
+// Sets how one direction of a pair holds data while its receiver is closed
+#define SERIALEMU_IOC_SET_STORE	_IOW(SERIALEMU_IOC_MAGIC, 0x0b, struct serialemu_store)
+
+// Sends the data written on one side of a pair back to it, like TIOCM_LOOP
+#define SERIALEMU_IOC_SET_LOOPBACK	_IOW(SERIALEMU_IOC_MAGIC, 0x0c, struct serialemu_loopback)
+
+// Sets the largest write of one direction of a pair that is never split
+#define SERIALEMU_IOC_SET_ATOMIC	_IOW(SERIALEMU_IOC_MAGIC, 0x0d, struct serialemu_atomic)
+
+// Sets the receive buffer depth of one direction of a pair, returns how full it is
+#define SERIALEMU_IOC_DEPTH	_IOWR(SERIALEMU_IOC_MAGIC, 0x0e, struct serialemu_depth)
+
+// Pushes one direction of a pair from the high priority workqueue, on a given CPU
+#define SERIALEMU_IOC_SET_LATENCY	_IOW(SERIALEMU_IOC_MAGIC, 0x0f, struct serialemu_latency)
+
+#endif
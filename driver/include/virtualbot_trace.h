@@ -0,0 +1,146 @@
+/*
+ * VirtualBot TTY driver - trace events
+ *
+ * Copyright (C) 2023 Bruno Policarpo (bruno.freitas@cefet-rj.br)
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, version 2 of the License.
+ *
+ * Enable them with perf or trace-cmd, for instance:
+ *
+ *	trace-cmd record -e virtualbot
+ *	perf record -e 'virtualbot:*' -a
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM virtualbot
+
+#if !defined(__VIRTUALBOT_TRACE_H__) || defined(TRACE_HEADER_MULTI_READ)
+
+#define __VIRTUALBOT_TRACE_H__
+
+#include <linux/tracepoint.h>
+
+#include <virtualbot.h>
+
+#define VIRTUALBOT_TRACE_NAME(emulated) \
+	((emulated) ? VIRTUALBOT_TTY_NAME : VB_COMM_TTY_NAME)
+
+DECLARE_EVENT_CLASS(virtualbot_port,
+
+	TP_PROTO(bool emulated, unsigned int index, int open_count),
+
+	TP_ARGS(emulated, index, open_count),
+
+	TP_STRUCT__entry(
+		__field(bool, emulated)
+		__field(unsigned int, index)
+		__field(int, open_count)
+	),
+
+	TP_fast_assign(
+		__entry->emulated = emulated;
+		__entry->index = index;
+		__entry->open_count = open_count;
+	),
+
+	TP_printk("%s%u open_count=%d",
+		VIRTUALBOT_TRACE_NAME(__entry->emulated),
+		__entry->index,
+		__entry->open_count)
+);
+
+DEFINE_EVENT(virtualbot_port, virtualbot_open,
+
+	TP_PROTO(bool emulated, unsigned int index, int open_count),
+
+	TP_ARGS(emulated, index, open_count)
+);
+
+DEFINE_EVENT(virtualbot_port, virtualbot_close,
+
+	TP_PROTO(bool emulated, unsigned int index, int open_count),
+
+	TP_ARGS(emulated, index, open_count)
+);
+
+/* A write call on one side, 'accepted' is its return value */
+TRACE_EVENT(virtualbot_write,
+
+	TP_PROTO(const struct virtualbot_link *link, size_t count, long accepted),
+
+	TP_ARGS(link, count, accepted),
+
+	TP_STRUCT__entry(
+		__field(bool, emulated)
+		__field(unsigned int, index)
+		__field(size_t, count)
+		__field(long, accepted)
+	),
+
+	TP_fast_assign(
+		__entry->emulated = link->emulated;
+		__entry->index = link->index;
+		__entry->count = count;
+		__entry->accepted = accepted;
+	),
+
+	TP_printk("%s%u -> %s%u count=%zu accepted=%ld",
+		VIRTUALBOT_TRACE_NAME(__entry->emulated),
+		__entry->index,
+		VIRTUALBOT_TRACE_NAME(!__entry->emulated),
+		__entry->index,
+		__entry->count,
+		__entry->accepted)
+);
+
+/* Bytes handed to the receiving port of a link, or refused by it */
+DECLARE_EVENT_CLASS(virtualbot_link_bytes,
+
+	TP_PROTO(const struct virtualbot_link *link, size_t bytes),
+
+	TP_ARGS(link, bytes),
+
+	TP_STRUCT__entry(
+		__field(bool, emulated)
+		__field(unsigned int, index)
+		__field(size_t, bytes)
+	),
+
+	TP_fast_assign(
+		__entry->emulated = link->emulated;
+		__entry->index = link->index;
+		__entry->bytes = bytes;
+	),
+
+	TP_printk("%s%u bytes=%zu",
+		VIRTUALBOT_TRACE_NAME(!__entry->emulated),
+		__entry->index,
+		__entry->bytes)
+);
+
+DEFINE_EVENT(virtualbot_link_bytes, virtualbot_push,
+
+	TP_PROTO(const struct virtualbot_link *link, size_t bytes),
+
+	TP_ARGS(link, bytes)
+);
+
+DEFINE_EVENT(virtualbot_link_bytes, virtualbot_drop,
+
+	TP_PROTO(const struct virtualbot_link *link, size_t bytes),
+
+	TP_ARGS(link, bytes)
+);
+
+#endif
+
+/* the module is built out of tree, this header is found through -I */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE virtualbot_trace
+
+#include <trace/define_trace.h>
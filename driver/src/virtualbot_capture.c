@@ -0,0 +1,292 @@
+/*
+ * VirtualBot TTY driver - traffic capture
+ *
+ * Copyright (C) 2023 Bruno Policarpo (bruno.freitas@cefet-rj.br)
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, version 2 of the License.
+ *
+ * Every open of /dev/serialemu-capture can record the traffic of one pair
+ * into a ring that user space maps and reads in place. The layout of the
+ * ring is described in virtualbot_ioctl.h.
+ *
+ * Writers reserve their record with a cmpxchg on the ring position and
+ * publish it by storing its position last, so they never wait for each
+ * other or for the reader: when the ring is full the record is dropped and
+ * counted in 'lost'.
+ */
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/module.h>
+#include <linux/atomic.h>
+#include <linux/fs.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+
+#include <virtualbot.h>
+#include <virtualbot_ioctl.h>
+
+struct virtualbot_capture {
+
+	/* Serializes start, mmap and release */
+	struct mutex lock;
+
+	/* Header page followed by the data, mapped by user space */
+	struct serialemu_capture_ring *ring;
+	unsigned char *data;
+
+	/* Kernel copies, the header can be written by user space */
+	u64 size;
+	u64 mask;
+
+	/* Next free position, ahead of the records still being written */
+	atomic64_t reserve;
+
+	atomic64_t lost;
+
+	wait_queue_head_t wait;
+
+	/* Pair being captured, referenced, NULL until started */
+	struct virtualbot_pair *pair;
+};
+
+/**
+ * Records a chunk of data written on one side of the pair
+ *
+ * Called from the write paths under rcu_read_lock(), must never block.
+ */
+void virtualbot_capture_record(struct virtualbot_capture *capture,
+	unsigned int direction,
+	unsigned int flags,
+	const unsigned char *buffer,
+	size_t count)
+{
+	struct serialemu_capture_record *record;
+	u64 offset, gap, need, tail;
+	s64 pos;
+
+	/* a record never takes more than a quarter of the ring */
+	if (count > capture->size / 4 - sizeof(*record)) {
+		count = capture->size / 4 - sizeof(*record);
+		flags |= SERIALEMU_CAPTURE_TRUNCATED;
+	}
+
+	need = ALIGN( sizeof(*record) + count, SERIALEMU_CAPTURE_ALIGN );
+
+	pos = atomic64_read( &capture->reserve );
+
+	do {
+		offset = pos & capture->mask;
+
+		/* records don't wrap, the end of the ring is skipped */
+		gap = offset + need > capture->size ? capture->size - offset : 0;
+
+		tail = READ_ONCE( capture->ring->tail );
+
+		/* a bogus tail from user space looks like a full ring */
+		if ((u64)pos + gap + need - tail > capture->size) {
+			WRITE_ONCE( capture->ring->lost, atomic64_inc_return( &capture->lost ) );
+			return;
+		}
+
+	} while (!atomic64_try_cmpxchg( &capture->reserve, &pos, pos + gap + need ));
+
+	if (gap >= sizeof(*record)) {
+
+		record = (struct serialemu_capture_record *)( capture->data + offset );
+
+		record->timestamp = 0;
+		record->length = gap - sizeof(*record);
+		record->direction = 0;
+		record->flags = SERIALEMU_CAPTURE_PAD;
+
+		smp_store_release( &record->pos, pos );
+	}
+
+	pos += gap;
+
+	record = (struct serialemu_capture_record *)( capture->data + ( pos & capture->mask ) );
+
+	record->timestamp = ktime_get_ns();
+	record->length = count;
+	record->direction = direction;
+	record->flags = flags;
+
+	memcpy( record + 1, buffer, count );
+
+	/* the record is complete once its position is visible */
+	smp_store_release( &record->pos, pos );
+
+	WRITE_ONCE( capture->ring->head, atomic64_read( &capture->reserve ) );
+
+	if (wq_has_sleeper( &capture->wait ))
+		wake_up_interruptible( &capture->wait );
+}
+
+static long virtualbot_capture_start(struct virtualbot_capture *capture,
+	struct serialemu_capture __user *argp)
+{
+	struct serialemu_capture request;
+	void *ring;
+	long retval;
+
+	if (copy_from_user(&request, argp, sizeof(request)))
+		return -EFAULT;
+
+	if (request.size < SERIALEMU_CAPTURE_MIN_SIZE ||
+	    request.size > SERIALEMU_CAPTURE_MAX_SIZE ||
+	    !is_power_of_2( request.size ))
+		return -EINVAL;
+
+	mutex_lock( &capture->lock );
+
+	if (capture->ring) {
+		retval = -EBUSY;
+		goto unlock;
+	}
+
+	ring = vmalloc_user( PAGE_SIZE + request.size );
+
+	if (!ring) {
+		retval = -ENOMEM;
+		goto unlock;
+	}
+
+	capture->ring = ring;
+	capture->data = ring + PAGE_SIZE;
+	capture->size = request.size;
+	capture->mask = request.size - 1;
+
+	/* no stale record can look valid at position 0 */
+	memset( capture->data, 0xff, capture->size );
+
+	capture->ring->version = SERIALEMU_CAPTURE_VERSION;
+	capture->ring->data_offset = PAGE_SIZE;
+	capture->ring->data_size = request.size;
+
+	retval = virtualbot_pair_capture_start( request.index, capture, &capture->pair );
+
+	if (retval) {
+		vfree( ring );
+		capture->ring = NULL;
+	}
+
+unlock:
+	mutex_unlock( &capture->lock );
+
+	return retval;
+}
+
+static long virtualbot_capture_ioctl(struct file *file, unsigned int cmd,
+	unsigned long arg)
+{
+	struct virtualbot_capture *capture = file->private_data;
+
+	switch (cmd) {
+	case SERIALEMU_IOC_CAPTURE_START:
+		return virtualbot_capture_start( capture, (void __user *)arg );
+	}
+
+	return -ENOTTY;
+}
+
+static int virtualbot_capture_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct virtualbot_capture *capture = file->private_data;
+	int retval = -EINVAL;
+
+	mutex_lock( &capture->lock );
+
+	if (capture->ring)
+		retval = remap_vmalloc_range( vma, capture->ring, vma->vm_pgoff );
+
+	mutex_unlock( &capture->lock );
+
+	return retval;
+}
+
+static __poll_t virtualbot_capture_poll(struct file *file, poll_table *wait)
+{
+	struct virtualbot_capture *capture = file->private_data;
+
+	if (!READ_ONCE( capture->ring ))
+		return 0;
+
+	poll_wait( file, &capture->wait, wait );
+
+	if ((u64)atomic64_read( &capture->reserve ) != READ_ONCE( capture->ring->tail ))
+		return EPOLLIN | EPOLLRDNORM;
+
+	return 0;
+}
+
+static int virtualbot_capture_open(struct inode *inode, struct file *file)
+{
+	struct virtualbot_capture *capture;
+
+	capture = kzalloc(sizeof(*capture), GFP_KERNEL);
+
+	if (!capture)
+		return -ENOMEM;
+
+	mutex_init( &capture->lock );
+	init_waitqueue_head( &capture->wait );
+
+	file->private_data = capture;
+
+	return 0;
+}
+
+/* Only called once the ring is not mapped anymore */
+static int virtualbot_capture_release(struct inode *inode, struct file *file)
+{
+	struct virtualbot_capture *capture = file->private_data;
+
+	if (capture->pair)
+		virtualbot_pair_capture_stop( capture->pair );
+
+	vfree( capture->ring );
+
+	mutex_destroy( &capture->lock );
+
+	kfree( capture );
+
+	return 0;
+}
+
+static const struct file_operations virtualbot_capture_fops = {
+	.owner = THIS_MODULE,
+	.open = virtualbot_capture_open,
+	.release = virtualbot_capture_release,
+	.unlocked_ioctl = virtualbot_capture_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
+	.mmap = virtualbot_capture_mmap,
+	.poll = virtualbot_capture_poll,
+	.llseek = noop_llseek,
+};
+
+static struct miscdevice virtualbot_capture_device = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = SERIALEMU_CAPTURE_NAME,
+	.fops = &virtualbot_capture_fops,
+	.mode = 0600,
+};
+
+int virtualbot_capture_init(void)
+{
+	return misc_register( &virtualbot_capture_device );
+}
+
+void virtualbot_capture_exit(void)
+{
+	misc_deregister( &virtualbot_capture_device );
+}
@@ -0,0 +1,255 @@
+/*
+ * VirtualBot TTY driver - control device
+ *
+ * Copyright (C) 2023 Bruno Policarpo (bruno.freitas@cefet-rj.br)
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, version 2 of the License.
+ *
+ * /dev/serialemu-ctl creates, destroys and lists port pairs at runtime,
+ * without reloading the module
+ */
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+
+#include <virtualbot.h>
+#include <virtualbot_ioctl.h>
+
+static long virtualbot_ctl_create(struct serialemu_pair_info __user *argp)
+{
+	struct serialemu_pair_info info;
+	int index;
+
+	if (copy_from_user(&info, argp, sizeof(info)))
+		return -EFAULT;
+
+	if (info.index != SERIALEMU_ANY_INDEX && info.index > INT_MAX)
+		return -EINVAL;
+
+	index = virtualbot_pair_add( info.index == SERIALEMU_ANY_INDEX ? -1 : info.index );
+
+	if (index < 0)
+		return index;
+
+	info.index = index;
+
+	snprintf(info.emulated, sizeof(info.emulated), "%s%d", VIRTUALBOT_TTY_NAME, index);
+	snprintf(info.exogenous, sizeof(info.exogenous), "%s%d", VB_COMM_TTY_NAME, index);
+
+	if (copy_to_user(argp, &info, sizeof(info))) {
+		virtualbot_pair_remove( index );
+		return -EFAULT;
+	}
+
+	return 0;
+}
+
+static long virtualbot_ctl_destroy(__u32 __user *argp)
+{
+	__u32 index;
+
+	if (get_user(index, argp))
+		return -EFAULT;
+
+	return virtualbot_pair_remove( index );
+}
+
+static long virtualbot_ctl_list(struct serialemu_pair_list __user *argp)
+{
+	struct serialemu_pair_list list;
+	u32 *indexes;
+	unsigned int room;
+	long retval = 0;
+
+	if (copy_from_user(&list, argp, sizeof(list)))
+		return -EFAULT;
+
+	room = min( list.count, virtualbot_pair_capacity() );
+
+	indexes = kvmalloc_array( max( room, 1U ), sizeof(*indexes), GFP_KERNEL );
+
+	if (!indexes)
+		return -ENOMEM;
+
+	list.total = virtualbot_pair_list( indexes, room );
+	list.count = min( list.total, room );
+
+	if (copy_to_user(u64_to_user_ptr(list.indexes), indexes,
+			list.count * sizeof(*indexes)) ||
+	    copy_to_user(argp, &list, sizeof(list)))
+		retval = -EFAULT;
+
+	kvfree( indexes );
+
+	return retval;
+}
+
+static long virtualbot_ctl_set_pacing(struct serialemu_pacing __user *argp)
+{
+	struct serialemu_pacing pacing;
+
+	if (copy_from_user(&pacing, argp, sizeof(pacing)))
+		return -EFAULT;
+
+	return virtualbot_pair_set_pacing( pacing.index, pacing.enable != 0 );
+}
+
+static long virtualbot_ctl_set_faults(struct serialemu_faults __user *argp)
+{
+	struct serialemu_faults faults;
+
+	if (copy_from_user(&faults, argp, sizeof(faults)))
+		return -EFAULT;
+
+	return virtualbot_pair_set_faults( &faults );
+}
+
+static long virtualbot_ctl_set_framing(struct serialemu_framing __user *argp)
+{
+	struct serialemu_framing framing;
+
+	if (copy_from_user(&framing, argp, sizeof(framing)))
+		return -EFAULT;
+
+	return virtualbot_pair_set_framing( &framing );
+}
+
+static long virtualbot_ctl_set_store(struct serialemu_store __user *argp)
+{
+	struct serialemu_store store;
+
+	if (copy_from_user(&store, argp, sizeof(store)))
+		return -EFAULT;
+
+	return virtualbot_pair_set_store( &store );
+}
+
+static long virtualbot_ctl_set_loopback(struct serialemu_loopback __user *argp)
+{
+	struct serialemu_loopback loopback;
+
+	if (copy_from_user(&loopback, argp, sizeof(loopback)))
+		return -EFAULT;
+
+	return virtualbot_pair_set_loopback( &loopback );
+}
+
+static long virtualbot_ctl_set_atomic(struct serialemu_atomic __user *argp)
+{
+	struct serialemu_atomic atomic;
+
+	if (copy_from_user(&atomic, argp, sizeof(atomic)))
+		return -EFAULT;
+
+	return virtualbot_pair_set_atomic( &atomic );
+}
+
+static long virtualbot_ctl_set_latency(struct serialemu_latency __user *argp)
+{
+	struct serialemu_latency latency;
+
+	if (copy_from_user(&latency, argp, sizeof(latency)))
+		return -EFAULT;
+
+	return virtualbot_pair_set_latency( &latency );
+}
+
+static long virtualbot_ctl_depth(struct serialemu_depth __user *argp)
+{
+	struct serialemu_depth depth;
+	long retval;
+
+	if (copy_from_user(&depth, argp, sizeof(depth)))
+		return -EFAULT;
+
+	retval = virtualbot_pair_depth( &depth );
+
+	if (retval)
+		return retval;
+
+	if (copy_to_user(argp, &depth, sizeof(depth)))
+		return -EFAULT;
+
+	return 0;
+}
+
+static long virtualbot_ctl_bus(unsigned int cmd, struct serialemu_bus __user *argp)
+{
+	struct serialemu_bus bus;
+
+	if (copy_from_user(&bus, argp, sizeof(bus)))
+		return -EFAULT;
+
+	if (cmd == SERIALEMU_IOC_BUS_ATTACH)
+		return virtualbot_bus_attach( bus.master, bus.member );
+
+	return virtualbot_bus_detach( bus.master, bus.member );
+}
+
+static long virtualbot_ctl_ioctl(struct file *file, unsigned int cmd,
+	unsigned long arg)
+{
+	void __user *argp = (void __user *)arg;
+
+	switch (cmd) {
+	case SERIALEMU_IOC_CREATE:
+		return virtualbot_ctl_create( argp );
+	case SERIALEMU_IOC_DESTROY:
+		return virtualbot_ctl_destroy( argp );
+	case SERIALEMU_IOC_LIST:
+		return virtualbot_ctl_list( argp );
+	case SERIALEMU_IOC_SET_PACING:
+		return virtualbot_ctl_set_pacing( argp );
+	case SERIALEMU_IOC_SET_FAULTS:
+		return virtualbot_ctl_set_faults( argp );
+	case SERIALEMU_IOC_SET_FRAMING:
+		return virtualbot_ctl_set_framing( argp );
+	case SERIALEMU_IOC_SET_STORE:
+		return virtualbot_ctl_set_store( argp );
+	case SERIALEMU_IOC_SET_LOOPBACK:
+		return virtualbot_ctl_set_loopback( argp );
+	case SERIALEMU_IOC_SET_ATOMIC:
+		return virtualbot_ctl_set_atomic( argp );
+	case SERIALEMU_IOC_DEPTH:
+		return virtualbot_ctl_depth( argp );
+	case SERIALEMU_IOC_SET_LATENCY:
+		return virtualbot_ctl_set_latency( argp );
+	case SERIALEMU_IOC_BUS_ATTACH:
+	case SERIALEMU_IOC_BUS_DETACH:
+		return virtualbot_ctl_bus( cmd, argp );
+	}
+
+	return -ENOTTY;
+}
+
+static const struct file_operations virtualbot_ctl_fops = {
+	.owner = THIS_MODULE,
+	.unlocked_ioctl = virtualbot_ctl_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
+	.llseek = noop_llseek,
+};
+
+static struct miscdevice virtualbot_ctl_device = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = SERIALEMU_CTL_NAME,
+	.fops = &virtualbot_ctl_fops,
+	.mode = 0600,
+};
+
+int virtualbot_ctl_init(void)
+{
+	return misc_register( &virtualbot_ctl_device );
+}
+
+void virtualbot_ctl_exit(void)
+{
+	misc_deregister( &virtualbot_ctl_device );
+}
@@ -0,0 +1,188 @@
+/*
+ * VirtualBot TTY driver - fault injection
+ *
+ * Copyright (C) 2023 Bruno Policarpo (bruno.freitas@cefet-rj.br)
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, version 2 of the License.
+ *
+ * Each direction of a pair can corrupt the data it carries: flip bits,
+ * drop or duplicate bytes, and mark them with parity, framing or overrun
+ * errors, like a noisy line or a slow UART would. The decisions come from a
+ * PRNG seeded by the user, so the same seed and the same traffic give the
+ * same faults.
+ *
+ * While no link injects faults the data path only pays for a static branch.
+ */
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/jump_label.h>
+#include <linux/mutex.h>
+#include <linux/prandom.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/tty.h>
+#include <linux/tty_flip.h>
+
+#include <virtualbot.h>
+#include <virtualbot_ioctl.h>
+
+/* Enabled while at least one link injects faults */
+DEFINE_STATIC_KEY_FALSE(virtualbot_fault_key);
+
+/* Keeps the static key in step with the links that have faults */
+static DEFINE_MUTEX(virtualbot_fault_lock);
+
+static bool virtualbot_fault_roll(struct virtualbot_fault *fault, u32 rate)
+{
+	/* a fault that is off doesn't consume random numbers */
+	if (!rate)
+		return false;
+
+	return prandom_u32_state( &fault->rnd ) % SERIALEMU_FAULT_SCALE < rate;
+}
+
+/**
+ * Replaces the faults of a link, all rates at 0 turn them off
+ *
+ * The PRNG restarts from the seed every time, so a run can be repeated by
+ * setting the same configuration again.
+ */
+int virtualbot_fault_set(struct virtualbot_link *link,
+	const struct serialemu_faults *config)
+{
+	struct virtualbot_fault *fault = NULL, *old;
+
+	if (config->bitflip > SERIALEMU_FAULT_SCALE ||
+	    config->drop > SERIALEMU_FAULT_SCALE ||
+	    config->duplicate > SERIALEMU_FAULT_SCALE ||
+	    config->parity > SERIALEMU_FAULT_SCALE ||
+	    config->frame > SERIALEMU_FAULT_SCALE ||
+	    config->overrun > SERIALEMU_FAULT_SCALE)
+		return -EINVAL;
+
+	if (config->bitflip || config->drop || config->duplicate ||
+	    config->parity || config->frame || config->overrun) {
+
+		fault = kzalloc(sizeof(*fault), GFP_KERNEL);
+
+		if (!fault)
+			return -ENOMEM;
+
+		prandom_seed_state( &fault->rnd, config->seed );
+
+		fault->bitflip = config->bitflip;
+		fault->drop = config->drop;
+		fault->duplicate = config->duplicate;
+		fault->parity = config->parity;
+		fault->frame = config->frame;
+		fault->overrun = config->overrun;
+	}
+
+	mutex_lock( &virtualbot_fault_lock );
+
+	spin_lock_bh( &link->lock );
+	old = link->fault;
+	link->fault = fault;
+	spin_unlock_bh( &link->lock );
+
+	if (fault && !old)
+		static_branch_inc( &virtualbot_fault_key );
+	else if (!fault && old)
+		static_branch_dec( &virtualbot_fault_key );
+
+	mutex_unlock( &virtualbot_fault_lock );
+
+	kfree( old );
+
+	pr_debug("virtualbot: pair %u %s faults %s", link->index,
+		link->emulated ? "EmulatedPort" : "Exogenous",
+		fault ? "on" : "off");
+
+	return 0;
+}
+
+/**
+ * Passes written data through the faults of the link into the flip buffer
+ *
+ * Called with the link's lock held, instead of the plain copy. Returns the
+ * number of bytes consumed; a dropped byte is consumed as well, the writer
+ * doesn't know the line lost it. '*inserted' is set to the characters put
+ * in the flip buffer, copies and overrun markers included, and '*lost' to
+ * the bytes dropped.
+ */
+size_t virtualbot_fault_deliver(struct virtualbot_link *link,
+	const unsigned char *buffer,
+	size_t count,
+	size_t *inserted,
+	size_t *lost)
+{
+	struct virtualbot_fault *fault = link->fault;
+	unsigned int parity = 0, frame = 0, overrun = 0;
+	unsigned char ch, flag;
+	size_t consumed;
+
+	*inserted = 0;
+	*lost = 0;
+
+	for (consumed = 0; consumed < count; consumed++) {
+
+		/* every outcome of this byte must fit */
+		if (tty_buffer_request_room( link->port, VIRTUALBOT_FAULT_MAX_CHARS ) <
+				VIRTUALBOT_FAULT_MAX_CHARS)
+			break;
+
+		if (virtualbot_fault_roll( fault, fault->drop )) {
+			(*lost)++;
+			continue;
+		}
+
+		ch = buffer[ consumed ];
+		flag = TTY_NORMAL;
+
+		if (virtualbot_fault_roll( fault, fault->bitflip ))
+			ch ^= 1 << ( prandom_u32_state( &fault->rnd ) % 8 );
+
+		if (virtualbot_fault_roll( fault, fault->parity )) {
+			flag = TTY_PARITY;
+			parity++;
+		} else if (virtualbot_fault_roll( fault, fault->frame )) {
+			flag = TTY_FRAME;
+			frame++;
+		}
+
+		*inserted += tty_insert_flip_char( link->port, ch, flag );
+
+		if (virtualbot_fault_roll( fault, fault->duplicate ))
+			*inserted += tty_insert_flip_char( link->port, ch, flag );
+
+		/* like serial_core, the overrun is reported after the character */
+		if (virtualbot_fault_roll( fault, fault->overrun )) {
+			*inserted += tty_insert_flip_char( link->port, 0, TTY_OVERRUN );
+			overrun++;
+		}
+	}
+
+	if (parity || frame || overrun)
+		virtualbot_stats_account_errors( link->stats, parity, frame, overrun );
+
+	return consumed;
+}
+
+/**
+ * Turns the faults of a link off, before it is freed
+ */
+void virtualbot_fault_destroy(struct virtualbot_link *link)
+{
+	if (!link->fault)
+		return;
+
+	kfree( link->fault );
+	link->fault = NULL;
+
+	mutex_lock( &virtualbot_fault_lock );
+	static_branch_dec( &virtualbot_fault_key );
+	mutex_unlock( &virtualbot_fault_lock );
+}
@@ -0,0 +1,320 @@
+/*
+ * VirtualBot TTY driver - framing-aware delivery
+ *
+ * Copyright (C) 2023 Bruno Policarpo (bruno.freitas@cefet-rj.br)
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, version 2 of the License.
+ *
+ * When framing is enabled, the data written on one side is held until it
+ * makes up a whole frame, which is then delivered to the peer with a single
+ * push: the reader wakes up once per message instead of once per fragment.
+ *
+ * Framing never changes the data, only where it is cut. Bytes that can't
+ * start a frame (garbage before a Javino header, a line longer than the
+ * buffer) are delivered as they are and counted as a malformed frame.
+ */
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/tty.h>
+
+#include <virtualbot.h>
+#include <virtualbot_ioctl.h>
+
+/* Serializes the allocation of the buffers */
+static DEFINE_MUTEX(virtualbot_framing_lock);
+
+static const unsigned char virtualbot_javino_header[] = { 'f', 'f', 'f', 'e' };
+
+/**
+ * Length of a run of bytes that can't start a Javino frame: up to the next
+ * 'f', which may begin a header
+ */
+static size_t virtualbot_javino_skip(const unsigned char *data, size_t length)
+{
+	const unsigned char *next = memchr( data + 1, 'f', length - 1 );
+
+	return next ? next - data : length;
+}
+
+/**
+ * Javino frame: "fffe", the payload length in two hex digits, the payload
+ */
+static size_t virtualbot_javino_parse(const unsigned char *data, size_t length,
+	bool *malformed)
+{
+	size_t header = min( length, sizeof(virtualbot_javino_header) );
+	int high, low;
+
+	if (memcmp( data, virtualbot_javino_header, header )) {
+		*malformed = true;
+		return virtualbot_javino_skip( data, length );
+	}
+
+	if (length < sizeof(virtualbot_javino_header) + 2)
+		return 0;
+
+	high = hex_to_bin( data[ 4 ] );
+	low = hex_to_bin( data[ 5 ] );
+
+	if (high < 0 || low < 0) {
+		*malformed = true;
+		return virtualbot_javino_skip( data, length );
+	}
+
+	length -= sizeof(virtualbot_javino_header) + 2;
+
+	if (length < high * 16 + low)
+		return 0;
+
+	return sizeof(virtualbot_javino_header) + 2 + high * 16 + low;
+}
+
+/**
+ * Length of the frame at the start of the buffer, 0 while it is incomplete
+ */
+static size_t virtualbot_framer_parse(struct virtualbot_framer *framer,
+	bool *malformed)
+{
+	const unsigned char *data = framer->buffer + framer->start;
+	const unsigned char *end;
+
+	*malformed = false;
+
+	if (!framer->length)
+		return 0;
+
+	switch (framer->mode) {
+	case SERIALEMU_FRAMING_JAVINO:
+		return virtualbot_javino_parse( data, framer->length, malformed );
+
+	case SERIALEMU_FRAMING_LINE:
+		end = memchr( data, '\n', framer->length );
+
+		if (end)
+			return end - data + 1;
+
+		/* a line that doesn't fit can't be held back */
+		if (framer->length < VIRTUALBOT_FRAMING_BUFFER_SIZE)
+			return 0;
+
+		*malformed = true;
+		return framer->length;
+	}
+
+	/* framing was turned off, what is left goes as it is */
+	return framer->length;
+}
+
+/**
+ * Delivers the complete frames held by the framer, each one only once the
+ * receiver has room for all of it
+ *
+ * Must be called with the framer's lock held. Returns false while a frame
+ * is waiting for room.
+ */
+static bool virtualbot_framer_flush(struct virtualbot_link *link)
+{
+	struct virtualbot_framer *framer = &link->framer;
+	bool malformed;
+	size_t frame;
+
+	for (;;) {
+
+		if (!framer->frame) {
+
+			frame = virtualbot_framer_parse( framer, &malformed );
+
+			if (!frame)
+				return true;
+
+			/* a run of garbage counts once, however it is cut */
+			if (malformed && !framer->resync)
+				virtualbot_stats_account_malformed( link->stats, 1 );
+
+			framer->resync = malformed;
+			framer->frame = frame;
+			framer->done = 0;
+		}
+
+		if (!framer->done && virtualbot_link_space( link ) < framer->frame)
+			return false;
+
+		/* another producer may have taken the room, the rest goes later */
+		framer->done += virtualbot_link_deliver( link,
+			framer->buffer + framer->start + framer->done,
+			framer->frame - framer->done );
+
+		if (framer->done < framer->frame)
+			return false;
+
+		framer->start += framer->frame;
+		framer->length -= framer->frame;
+		framer->frame = 0;
+
+		if (!framer->length)
+			framer->start = 0;
+	}
+}
+
+void virtualbot_framer_init(struct virtualbot_framer *framer)
+{
+	spin_lock_init( &framer->lock );
+}
+
+void virtualbot_framer_destroy(struct virtualbot_framer *framer)
+{
+	kfree( framer->buffer );
+}
+
+/**
+ * Sets the framing of the data written on one side, SERIALEMU_FRAMING_*
+ *
+ * Data already held is cut according to the new mode.
+ */
+int virtualbot_framer_set_mode(struct virtualbot_link *link, unsigned int mode)
+{
+	struct virtualbot_framer *framer = &link->framer;
+	int retval = 0;
+
+	if (mode != SERIALEMU_FRAMING_NONE &&
+	    mode != SERIALEMU_FRAMING_JAVINO &&
+	    mode != SERIALEMU_FRAMING_LINE)
+		return -EINVAL;
+
+	mutex_lock( &virtualbot_framing_lock );
+
+	if (mode != SERIALEMU_FRAMING_NONE && !framer->buffer) {
+
+		framer->buffer = kmalloc( VIRTUALBOT_FRAMING_BUFFER_SIZE, GFP_KERNEL );
+
+		if (!framer->buffer) {
+			retval = -ENOMEM;
+			goto exit;
+		}
+	}
+
+	spin_lock_bh( &framer->lock );
+
+	WRITE_ONCE( framer->mode, mode );
+
+	/* a frame being parsed is parsed again */
+	if (!framer->done)
+		framer->frame = 0;
+
+	virtualbot_framer_flush( link );
+
+	spin_unlock_bh( &framer->lock );
+
+exit:
+	mutex_unlock( &virtualbot_framing_lock );
+
+	pr_debug("virtualbot: pair %u framing mode %u", link->index, mode);
+
+	return retval;
+}
+
+/**
+ * True when written data must go through the framer
+ */
+bool virtualbot_framer_active(struct virtualbot_framer *framer)
+{
+	return READ_ONCE( framer->mode ) != SERIALEMU_FRAMING_NONE ||
+		READ_ONCE( framer->length );
+}
+
+/**
+ * Holds written data until it completes a frame, returns the number of
+ * bytes accepted
+ *
+ * Nothing is accepted while a complete frame waits for the receiver, so the
+ * writer sleeps until virtualbot_framer_wakeup().
+ */
+size_t virtualbot_framer_write(struct virtualbot_link *link,
+	const unsigned char *buffer,
+	size_t count)
+{
+	struct virtualbot_framer *framer = &link->framer;
+	size_t accepted = 0, room;
+
+	spin_lock_bh( &framer->lock );
+
+	/* a write up to the atomic size is held whole, or waits */
+	if (framer->buffer && framer->mode != SERIALEMU_FRAMING_NONE &&
+	    virtualbot_link_must_wait( link, count, VIRTUALBOT_FRAMING_BUFFER_SIZE - framer->length ))
+		goto flush;
+
+	/* nothing is taken while a frame is waiting */
+	while (accepted < count && virtualbot_framer_flush( link )) {
+
+		/* framing was turned off and nothing is held anymore */
+		if (!framer->buffer || (framer->mode == SERIALEMU_FRAMING_NONE && !framer->length)) {
+			accepted += virtualbot_link_deliver( link, buffer + accepted, count - accepted );
+			break;
+		}
+
+		if (framer->start) {
+			memmove( framer->buffer, framer->buffer + framer->start, framer->length );
+			framer->start = 0;
+		}
+
+		room = VIRTUALBOT_FRAMING_BUFFER_SIZE - framer->length;
+
+		if (!room)
+			break;
+
+		room = min( room, count - accepted );
+
+		memcpy( framer->buffer + framer->length, buffer + accepted, room );
+
+		framer->length += room;
+		accepted += room;
+	}
+
+flush:
+	/* the frames completed by this data */
+	virtualbot_framer_flush( link );
+
+	spin_unlock_bh( &framer->lock );
+
+	return accepted;
+}
+
+/**
+ * Room left for the writer in the framer's buffer
+ */
+unsigned int virtualbot_framer_room(struct virtualbot_framer *framer)
+{
+	unsigned int room = 0;
+
+	spin_lock_bh( &framer->lock );
+
+	if (!framer->frame)
+		room = VIRTUALBOT_FRAMING_BUFFER_SIZE - framer->length;
+
+	spin_unlock_bh( &framer->lock );
+
+	return room;
+}
+
+/**
+ * Called when the receiver made room, delivers the frames that were waiting
+ * for it
+ */
+void virtualbot_framer_wakeup(struct virtualbot_link *link)
+{
+	struct virtualbot_framer *framer = &link->framer;
+
+	if (!READ_ONCE( framer->length ))
+		return;
+
+	spin_lock_bh( &framer->lock );
+	virtualbot_framer_flush( link );
+	spin_unlock_bh( &framer->lock );
+}
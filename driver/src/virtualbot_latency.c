@@ -0,0 +1,360 @@
+/*
+ * VirtualBot TTY driver - latency histograms
+ *
+ * Copyright (C) 2023 Bruno Policarpo (bruno.freitas@cefet-rj.br)
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, version 2 of the License.
+ *
+ * Each direction of a pair times one chunk at a time: the first write after
+ * the previous chunk was read is stamped on entry, again when it is pushed
+ * into the receiving flip buffer, and once more when the line discipline
+ * has taken its last byte. Bytes are counted on both ends of the flip
+ * buffer to tell when that happens.
+ *
+ * The write to read time says how long the driver and the tty layer took
+ * together, the push to read time how much of it was spent waiting for the
+ * flip buffer work. Both are kept as log2 histograms, one copy per CPU, in
+ * debugfs under virtualbot/<pair>/to_exogenous and to_emulated.
+ *
+ * The histograms are allocated the first time one of those files is read or
+ * reset, and nothing is timed before that. Until then a direction only
+ * counts its bytes, and then only the chunk being timed reads the clock.
+ * Both ends count characters
+ * of the flip buffer: a push counts what was inserted, so a byte dropped by
+ * an injected fault is counted on neither end, and a duplicate or an
+ * overrun marker on both.
+ */
+
+#include <linux/kernel.h>
+#include <linux/debugfs.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/spinlock.h>
+#include <linux/u64_stats_sync.h>
+
+#include <virtualbot.h>
+
+enum {
+	VIRTUALBOT_SAMPLE_IDLE,
+	VIRTUALBOT_SAMPLE_WRITTEN,	/* waiting for its push */
+	VIRTUALBOT_SAMPLE_PUSHED,	/* waiting for the line discipline */
+};
+
+/* virtualbot/ in debugfs, an error pointer without debugfs */
+static struct dentry *virtualbot_latency_root;
+
+/* Serializes the allocation of the histograms */
+static DEFINE_MUTEX(virtualbot_latency_hist_lock);
+
+/**
+ * Sets up the tracking of a link, its histograms wait for debugfs
+ */
+void virtualbot_latency_init(struct virtualbot_latency *latency)
+{
+	spin_lock_init( &latency->lock );
+}
+
+/**
+ * Bytes taken by the histograms of one direction once they are allocated
+ */
+size_t virtualbot_latency_size(void)
+{
+	return sizeof(struct virtualbot_latency_hist) * num_possible_cpus();
+}
+
+/**
+ * Returns the histograms of a link, allocating them on first use, or NULL
+ * when they can't be
+ */
+static struct virtualbot_latency_hist __percpu *virtualbot_latency_hist(struct virtualbot_latency *latency)
+{
+	struct virtualbot_latency_hist __percpu *hist = smp_load_acquire( &latency->hist );
+	int cpu;
+
+	if (hist)
+		return hist;
+
+	mutex_lock( &virtualbot_latency_hist_lock );
+
+	hist = latency->hist;
+
+	if (hist)
+		goto unlock;
+
+	hist = alloc_percpu( struct virtualbot_latency_hist );
+
+	if (!hist)
+		goto unlock;
+
+	for_each_possible_cpu(cpu)
+		u64_stats_init( &per_cpu_ptr( hist, cpu )->syncp );
+
+	/* the writers start timing once they see it, see virtualbot_latency_start() */
+	smp_store_release( &latency->hist, hist );
+
+unlock:
+	mutex_unlock( &virtualbot_latency_hist_lock );
+
+	return hist;
+}
+
+void virtualbot_latency_destroy(struct virtualbot_latency *latency)
+{
+	free_percpu( latency->hist );
+}
+
+/**
+ * Stamps a write on entry, unless a chunk is already being timed or there
+ * are no histograms to record it in
+ */
+void virtualbot_latency_start(struct virtualbot_link *link)
+{
+	struct virtualbot_latency *latency = &link->latency;
+
+	if (READ_ONCE( latency->sample ) != VIRTUALBOT_SAMPLE_IDLE ||
+	    !smp_load_acquire( &latency->hist ))
+		return;
+
+	spin_lock_bh( &latency->lock );
+
+	if (latency->sample == VIRTUALBOT_SAMPLE_IDLE) {
+		latency->written = ktime_get();
+		latency->sample = VIRTUALBOT_SAMPLE_WRITTEN;
+	}
+
+	spin_unlock_bh( &latency->lock );
+}
+
+/**
+ * Counts 'count' bytes pushed into the receiving flip buffer, must be
+ * called with the link's lock held
+ *
+ * The first push after a stamped write carries its data, unless the pacer
+ * or the store still hold older bytes.
+ */
+void virtualbot_latency_push(struct virtualbot_link *link, size_t count)
+{
+	struct virtualbot_latency *latency = &link->latency;
+
+	latency->pushed += count;
+
+	if (READ_ONCE( latency->sample ) != VIRTUALBOT_SAMPLE_WRITTEN)
+		return;
+
+	spin_lock( &latency->lock );
+
+	if (latency->sample == VIRTUALBOT_SAMPLE_WRITTEN) {
+		latency->pushed_at = ktime_get();
+		latency->end = latency->pushed;
+		latency->sample = VIRTUALBOT_SAMPLE_PUSHED;
+	}
+
+	spin_unlock( &latency->lock );
+}
+
+static void virtualbot_latency_record(u64_stats_t *buckets, ktime_t delta)
+{
+	s64 ns = ktime_to_ns( delta );
+	unsigned int bucket = 0;
+
+	if (ns > 1)
+		bucket = min_t(unsigned int, ilog2( ns ), VIRTUALBOT_LATENCY_BUCKETS - 1);
+
+	u64_stats_inc( &buckets[ bucket ] );
+}
+
+/**
+ * Counts 'count' bytes taken by the line discipline, and records the chunk
+ * being timed once its last byte is among them
+ */
+void virtualbot_latency_consume(struct virtualbot_link *link, size_t count)
+{
+	struct virtualbot_latency *latency = &link->latency;
+	struct virtualbot_latency_hist *hist;
+	ktime_t now;
+
+	spin_lock_bh( &latency->lock );
+
+	latency->consumed += count;
+
+	if (latency->sample != VIRTUALBOT_SAMPLE_PUSHED || latency->consumed < latency->end)
+		goto unlock;
+
+	now = ktime_get();
+
+	/* the lock makes this the only writer of the copy, see virtualbot_latency_reset() */
+	hist = this_cpu_ptr( latency->hist );
+
+	u64_stats_update_begin( &hist->syncp );
+
+	virtualbot_latency_record( hist->latency, ktime_sub( now, latency->written ) );
+	virtualbot_latency_record( hist->residency, ktime_sub( now, latency->pushed_at ) );
+
+	u64_stats_update_end( &hist->syncp );
+
+	latency->sample = VIRTUALBOT_SAMPLE_IDLE;
+
+unlock:
+	spin_unlock_bh( &latency->lock );
+}
+
+/**
+ * Forgets the chunk being timed and what the flip buffer held, when the
+ * tty layer threw it away: the port was opened again or its input flushed
+ */
+void virtualbot_latency_resync(struct virtualbot_link *link)
+{
+	struct virtualbot_latency *latency = &link->latency;
+
+	spin_lock_bh( &link->lock );
+	spin_lock( &latency->lock );
+
+	latency->consumed = latency->pushed;
+	latency->sample = VIRTUALBOT_SAMPLE_IDLE;
+
+	spin_unlock( &latency->lock );
+	spin_unlock_bh( &link->lock );
+}
+
+/**
+ * Clears every copy of the histograms, allocating them cleared on first use
+ *
+ * Samples are only recorded under the lock, so holding it makes this the
+ * single writer of each copy, and the readers see the buckets cleared
+ * through the same sequence count as an update.
+ */
+static int virtualbot_latency_reset(struct virtualbot_latency *latency)
+{
+	struct virtualbot_latency_hist __percpu *hists = virtualbot_latency_hist( latency );
+	struct virtualbot_latency_hist *hist;
+	unsigned int i;
+	int cpu;
+
+	if (!hists)
+		return -ENOMEM;
+
+	spin_lock_bh( &latency->lock );
+
+	for_each_possible_cpu(cpu) {
+
+		hist = per_cpu_ptr( hists, cpu );
+
+		u64_stats_update_begin( &hist->syncp );
+
+		for (i = 0; i < VIRTUALBOT_LATENCY_BUCKETS; i++) {
+			u64_stats_set( &hist->latency[ i ], 0 );
+			u64_stats_set( &hist->residency[ i ], 0 );
+		}
+
+		u64_stats_update_end( &hist->syncp );
+	}
+
+	spin_unlock_bh( &latency->lock );
+
+	return 0;
+}
+
+/**
+ * One line per bucket: its lower bound in ns, then the chunks that took
+ * that long from the write call and from the push
+ */
+static int virtualbot_latency_show(struct seq_file *m, void *v)
+{
+	struct virtualbot_link *link = m->private;
+	struct virtualbot_latency_hist __percpu *hists = virtualbot_latency_hist( &link->latency );
+	struct virtualbot_latency_hist *hist;
+	u64 latency[VIRTUALBOT_LATENCY_BUCKETS] = { 0 };
+	u64 residency[VIRTUALBOT_LATENCY_BUCKETS] = { 0 };
+	u64 cpu_latency[VIRTUALBOT_LATENCY_BUCKETS];
+	u64 cpu_residency[VIRTUALBOT_LATENCY_BUCKETS];
+	unsigned int start, i;
+	int cpu;
+
+	if (!hists)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+
+		hist = per_cpu_ptr( hists, cpu );
+
+		do {
+			start = u64_stats_fetch_begin( &hist->syncp );
+
+			for (i = 0; i < VIRTUALBOT_LATENCY_BUCKETS; i++) {
+				cpu_latency[ i ] = u64_stats_read( &hist->latency[ i ] );
+				cpu_residency[ i ] = u64_stats_read( &hist->residency[ i ] );
+			}
+
+		} while (u64_stats_fetch_retry( &hist->syncp, start ));
+
+		for (i = 0; i < VIRTUALBOT_LATENCY_BUCKETS; i++) {
+			latency[ i ] += cpu_latency[ i ];
+			residency[ i ] += cpu_residency[ i ];
+		}
+	}
+
+	seq_puts( m, "# ns latency residency\n" );
+
+	for (i = 0; i < VIRTUALBOT_LATENCY_BUCKETS; i++)
+		seq_printf( m, "%llu %llu %llu\n", i ? 1ULL << i : 0ULL,
+			latency[ i ], residency[ i ] );
+
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(virtualbot_latency);
+
+static int virtualbot_latency_reset_set(void *data, u64 value)
+{
+	struct virtualbot_link *link = data;
+
+	return virtualbot_latency_reset( &link->latency );
+}
+
+DEFINE_DEBUGFS_ATTRIBUTE(virtualbot_latency_reset_fops, NULL, virtualbot_latency_reset_set, "%llu\n");
+
+static void virtualbot_latency_add_link(struct dentry *parent,
+	const char *name,
+	struct virtualbot_link *link)
+{
+	struct dentry *dir = debugfs_create_dir( name, parent );
+
+	debugfs_create_file( "histogram", 0444, dir, link, &virtualbot_latency_fops );
+	debugfs_create_file_unsafe( "reset", 0200, dir, link, &virtualbot_latency_reset_fops );
+}
+
+/**
+ * Publishes the histograms of a pair, the directory is removed with
+ * debugfs_remove() before the links go away
+ */
+struct dentry *virtualbot_latency_add_pair(unsigned int index,
+	struct virtualbot_link *to_exogenous,
+	struct virtualbot_link *to_emulated)
+{
+	struct dentry *dir;
+	char name[16];
+
+	snprintf( name, sizeof(name), "%u", index );
+
+	dir = debugfs_create_dir( name, virtualbot_latency_root );
+
+	virtualbot_latency_add_link( dir, "to_exogenous", to_exogenous );
+	virtualbot_latency_add_link( dir, "to_emulated", to_emulated );
+
+	return dir;
+}
+
+void virtualbot_latency_debugfs_init(void)
+{
+	virtualbot_latency_root = debugfs_create_dir( "virtualbot", NULL );
+}
+
+void virtualbot_latency_debugfs_exit(void)
+{
+	debugfs_remove( virtualbot_latency_root );
+}
@@ -0,0 +1,426 @@
+/*
+ * VirtualBot TTY driver - data path
+ *
+ * Copyright (C) 2023 Bruno Policarpo (bruno.freitas@cefet-rj.br)
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, version 2 of the License.
+ *
+ * A link is one direction of a pair: the data written on one side and
+ * received by the other one. Everything that puts data into the flip buffer
+ * of the receiving port goes through its lock.
+ */
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/percpu.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/tty.h>
+#include <linux/tty_flip.h>
+#include <linux/version.h>
+#include <linux/workqueue.h>
+
+#include <virtualbot.h>
+#include <virtualbot_trace.h>
+
+/* Pushes the flip buffers of the low latency links, see virtualbot_link_push() */
+static struct workqueue_struct *virtualbot_link_wq;
+
+static void virtualbot_link_push_work(struct work_struct *work)
+{
+	struct virtualbot_link *link = container_of(work, struct virtualbot_link, push_work);
+
+	/* a producer may be filling the tail of the flip buffer */
+	spin_lock_bh( &link->lock );
+
+	tty_flip_buffer_push( link->port );
+
+	spin_unlock_bh( &link->lock );
+}
+
+/**
+ * Sets up a link from 'writer' to 'port'
+ *
+ * It can always be destroyed afterwards. The counters are allocated here,
+ * 'stats' or 'latency.hist' is left NULL when that fails.
+ */
+void virtualbot_link_init(struct virtualbot_link *link,
+	bool emulated,
+	struct tty_port *writer,
+	struct tty_port *port)
+{
+	link->emulated = emulated;
+	link->writer = writer;
+	link->port = port;
+	link->atomic = VIRTUALBOT_ATOMIC_DEFAULT;
+	link->cpu = WORK_CPU_UNBOUND;
+
+	spin_lock_init( &link->lock );
+
+	INIT_WORK( &link->push_work, virtualbot_link_push_work );
+
+	virtualbot_pacer_init( &link->pacer );
+
+	virtualbot_framer_init( &link->framer );
+
+	virtualbot_store_init( &link->store );
+
+	virtualbot_latency_init( &link->latency );
+
+	link->stats = virtualbot_stats_alloc();
+}
+
+void virtualbot_link_destroy(struct virtualbot_link *link)
+{
+	cancel_work_sync( &link->push_work );
+
+	virtualbot_pacer_destroy( &link->pacer );
+
+	virtualbot_framer_destroy( &link->framer );
+
+	virtualbot_store_destroy( &link->store );
+
+	virtualbot_fault_destroy( link );
+
+	virtualbot_latency_destroy( &link->latency );
+
+	free_percpu( link->stats );
+}
+
+/**
+ * Sets the atomic size of the link: a write up to 'size' bytes reaches the
+ * receiving port contiguously, the writer waits until there is room for all
+ * of it
+ */
+int virtualbot_link_set_atomic(struct virtualbot_link *link, unsigned int size)
+{
+	if (size < VIRTUALBOT_MAX_SIGNAL_LEN || size > VIRTUALBOT_ATOMIC_MAX)
+		return -EINVAL;
+
+	WRITE_ONCE( link->atomic, size );
+
+	pr_debug("virtualbot: pair %u atomic size %u", link->index, size);
+
+	/* a smaller size may let a waiting writer go on */
+	tty_port_tty_wakeup( link->writer );
+
+	return 0;
+}
+
+/**
+ * Sets how many bytes the flip buffer of the receiving port may hold
+ *
+ * A small depth pushes back on the writer early, a large one absorbs bursts.
+ * The line discipline holds up to 4 KiB more once the reader is behind.
+ */
+int virtualbot_link_set_depth(struct virtualbot_link *link, unsigned int depth)
+{
+	int retval;
+
+	if (depth < VIRTUALBOT_DEPTH_MIN || depth > VIRTUALBOT_DEPTH_MAX)
+		return -EINVAL;
+
+	retval = tty_buffer_set_limit( link->port, depth );
+
+	if (retval)
+		return retval;
+
+	pr_debug("virtualbot: pair %u depth %u", link->index, depth);
+
+	/* a deeper buffer lets a waiting writer go on */
+	virtualbot_link_wakeup( link );
+
+	return 0;
+}
+
+/**
+ * Moves the pushes into the receiving port to the high priority workqueue,
+ * on 'cpu' or WORK_CPU_UNBOUND for the CPU that wrote
+ */
+int virtualbot_link_set_latency(struct virtualbot_link *link, bool low_latency, int cpu)
+{
+	if (cpu != WORK_CPU_UNBOUND && (cpu < 0 || cpu >= nr_cpu_ids || !cpu_online( cpu )))
+		return -EINVAL;
+
+	WRITE_ONCE( link->cpu, cpu );
+	WRITE_ONCE( link->low_latency, low_latency );
+
+	pr_debug("virtualbot: pair %u low latency %d cpu %d", link->index, low_latency, cpu);
+
+	return 0;
+}
+
+unsigned int virtualbot_link_depth(struct virtualbot_link *link)
+{
+	return READ_ONCE( link->port->buf.mem_limit );
+}
+
+/**
+ * Bytes held by the flip buffer of the receiving port, counted in whole
+ * buffers like the tty layer does
+ */
+unsigned int virtualbot_link_occupancy(struct virtualbot_link *link)
+{
+	return virtualbot_link_depth( link ) - tty_buffer_space_avail( link->port );
+}
+
+/**
+ * Most bytes held since the link was created, or since the last reset
+ */
+unsigned int virtualbot_link_high_water(struct virtualbot_link *link, bool reset)
+{
+	unsigned int high_water;
+
+	spin_lock_bh( &link->lock );
+
+	high_water = link->high_water;
+
+	if (reset)
+		link->high_water = virtualbot_link_occupancy( link );
+
+	spin_unlock_bh( &link->lock );
+
+	return high_water;
+}
+
+/**
+ * Hands the 'count' bytes just added to the flip buffer of the receiving
+ * port to the line discipline, must be called with the link's lock held
+ *
+ * A low latency link leaves the push to its own work on the high priority
+ * workqueue, on the CPU it was given, so a writer on a busy host doesn't
+ * wait for it. The flush the push queues then starts from that CPU. The
+ * flush work of the tty core itself is never touched.
+ */
+void virtualbot_link_push(struct virtualbot_link *link, size_t count)
+{
+	unsigned int occupancy;
+	int cpu;
+
+	if (READ_ONCE( link->low_latency )) {
+		cpu = READ_ONCE( link->cpu );
+
+		/* the CPU may have gone offline since it was set */
+		if (cpu != WORK_CPU_UNBOUND && !cpu_online( cpu ))
+			cpu = WORK_CPU_UNBOUND;
+
+		queue_work_on( cpu, virtualbot_link_wq, &link->push_work );
+	} else {
+		tty_flip_buffer_push( link->port );
+	}
+
+	virtualbot_latency_push( link, count );
+
+	occupancy = virtualbot_link_occupancy( link );
+
+	if (occupancy > link->high_water)
+		link->high_water = occupancy;
+}
+
+/**
+ * Moves a chunk of written data into the flip buffer of the receiving port,
+ * must be called with the link's lock held
+ *
+ * Space is reserved with tty_prepare_flip_string() and filled with one
+ * memcpy() per flip buffer segment, instead of one call per byte. The flip
+ * buffer may accept less than requested when it reaches its memory limit,
+ * so the number of bytes actually queued is returned to the caller.
+ *
+ * With faults injected, the bytes taken and the characters received
+ * differ: the counters and the push get what was received.
+ */
+size_t virtualbot_link_queue(struct virtualbot_link *link,
+	const unsigned char *buffer,
+	size_t count)
+{
+	unsigned char *chunk;
+	size_t space, queued = 0, inserted, lost = 0;
+
+	if (virtualbot_fault_active( link )) {
+		queued = virtualbot_fault_deliver( link, buffer, count, &inserted, &lost );
+	} else {
+		while (queued < count) {
+
+			space = tty_prepare_flip_string( link->port, &chunk, count - queued );
+
+			if (!space)
+				break;
+
+			memcpy( chunk, buffer + queued, space );
+
+			queued += space;
+		}
+
+		inserted = queued;
+	}
+
+	if (inserted) {
+		virtualbot_link_push( link, inserted );
+
+		trace_virtualbot_push( link, inserted );
+	}
+
+	/* data refused by a full flip buffer counts as an overrun */
+	if (queued < count)
+		trace_virtualbot_drop( link, count - queued );
+
+	virtualbot_stats_account( link->stats, 1, inserted, inserted ? 1 : 0, count - queued );
+
+	if (lost)
+		virtualbot_stats_account_lost( link->stats, lost );
+
+	return queued;
+}
+
+/**
+ * Moves a chunk of written data into the flip buffer of the receiving port
+ *
+ * This skips the pacer, the loopback and bus members call it directly.
+ * Every producer of the port takes its lock, so a chunk up to the atomic
+ * size is checked against the room and queued as a whole.
+ */
+size_t virtualbot_link_transfer(struct virtualbot_link *link,
+	const unsigned char *buffer,
+	size_t count)
+{
+	size_t queued = 0;
+
+	spin_lock_bh( &link->lock );
+
+	/* nothing is refused for good, the writer comes back with all of it */
+	if (!virtualbot_link_must_wait( link, count, tty_buffer_space_avail( link->port ) ))
+		queued = virtualbot_link_queue( link, buffer, count );
+
+	spin_unlock_bh( &link->lock );
+
+	return queued;
+}
+
+/**
+ * Room for a chunk that must be queued whole, must be called with the
+ * link's lock held: injected faults may turn each byte into
+ * VIRTUALBOT_FAULT_MAX_CHARS characters
+ */
+unsigned int virtualbot_link_capacity(struct virtualbot_link *link)
+{
+	unsigned int room = tty_buffer_space_avail( link->port );
+
+	if (virtualbot_fault_active( link ))
+		room /= VIRTUALBOT_FAULT_MAX_CHARS;
+
+	return room;
+}
+
+/**
+ * Room for a chunk that must be queued whole, see virtualbot_link_capacity()
+ */
+unsigned int virtualbot_link_whole_room(struct virtualbot_link *link)
+{
+	unsigned int room;
+
+	spin_lock_bh( &link->lock );
+
+	room = virtualbot_link_capacity( link );
+
+	spin_unlock_bh( &link->lock );
+
+	return room;
+}
+
+/**
+ * Sends data to the receiving port, through the pacer while the baud rate
+ * is emulated. Returns the number of bytes accepted.
+ */
+size_t virtualbot_link_deliver(struct virtualbot_link *link,
+	const unsigned char *buffer,
+	size_t count)
+{
+	if (virtualbot_pacer_active( &link->pacer ))
+		return virtualbot_pacer_write( &link->pacer, buffer, count );
+
+	return virtualbot_link_transfer( link, buffer, count );
+}
+
+/**
+ * Room for virtualbot_link_deliver(): in the receiving flip buffer, or in
+ * the pacer
+ */
+unsigned int virtualbot_link_space(struct virtualbot_link *link)
+{
+	if (virtualbot_pacer_active( &link->pacer ))
+		return virtualbot_pacer_room( &link->pacer );
+
+	return tty_buffer_space_avail( link->port );
+}
+
+/**
+ * Sends data to the receiving port, whole frames at a time when framing is
+ * enabled. Returns the number of bytes accepted.
+ */
+size_t virtualbot_link_forward(struct virtualbot_link *link,
+	const unsigned char *buffer,
+	size_t count)
+{
+	if (virtualbot_framer_active( &link->framer ))
+		return virtualbot_framer_write( link, buffer, count );
+
+	return virtualbot_link_deliver( link, buffer, count );
+}
+
+/**
+ * Sends written data to the receiving port, or holds it while that port is
+ * closed. Returns the number of bytes accepted.
+ */
+size_t virtualbot_link_write(struct virtualbot_link *link,
+	const unsigned char *buffer,
+	size_t count)
+{
+	if (virtualbot_store_active( &link->store ))
+		return virtualbot_store_write( link, buffer, count );
+
+	return virtualbot_link_forward( link, buffer, count );
+}
+
+/**
+ * Room left for the writer
+ */
+unsigned int virtualbot_link_room(struct virtualbot_link *link)
+{
+	if (virtualbot_store_active( &link->store ))
+		return virtualbot_store_room( &link->store );
+
+	if (virtualbot_framer_active( &link->framer ))
+		return virtualbot_framer_room( &link->framer );
+
+	return virtualbot_link_space( link );
+}
+
+/**
+ * Called when the receiver of the link made room: data held back is
+ * delivered and the writer is woken up
+ */
+void virtualbot_link_wakeup(struct virtualbot_link *link)
+{
+	virtualbot_store_wakeup( link );
+
+	virtualbot_framer_wakeup( link );
+
+	tty_port_tty_wakeup( link->writer );
+}
+
+int virtualbot_link_wq_init(void)
+{
+	virtualbot_link_wq = alloc_workqueue( "virtualbot_rx", WQ_HIGHPRI, 0 );
+
+	if (!virtualbot_link_wq)
+		return -ENOMEM;
+
+	return 0;
+}
+
+void virtualbot_link_wq_exit(void)
+{
+	destroy_workqueue( virtualbot_link_wq );
+}
@@ -12,15 +12,27 @@
  */
 
 #include <linux/kernel.h>
+#include <linux/debugfs.h>
 #include <linux/errno.h>
 #include <linux/init.h>
 #include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/overflow.h>
+#include <linux/ktime.h>
+#include <linux/workqueue.h>
+#include <linux/kref.h>
+#include <linux/percpu.h>
+#include <linux/rcupdate.h>
+#include <linux/spinlock.h>
 #include <linux/wait.h>
 #include <linux/tty.h>
 #include <linux/tty_driver.h>
 #include <linux/tty_flip.h>
 #include <linux/serial.h>
+#include <linux/device.h>
+#include <linux/kdev_t.h>
 #include <linux/sched.h>
 #include <linux/sched/signal.h>
 #include <linux/seq_file.h>
@@ -31,252 +43,1707 @@
 #include <linux/string.h>
 
 #include <virtualbot.h>
+#include <virtualbot_ioctl.h>
+
+#define CREATE_TRACE_POINTS
+#include <virtualbot_trace.h>
 
 #define DRIVER_VERSION "v1.2.2"
 #define DRIVER_AUTHOR "Bruno Policarpo <bruno.freitas@cefet-rj.br>"
 #define DRIVER_DESC "VirtualBot TTY Driver"
 
-/* Module information */
-MODULE_AUTHOR(DRIVER_AUTHOR);
-MODULE_DESCRIPTION(DRIVER_DESC);
-MODULE_LICENSE("GPL");
+/* Module information */
+MODULE_AUTHOR(DRIVER_AUTHOR);
+MODULE_DESCRIPTION(DRIVER_DESC);
+MODULE_LICENSE("GPL");
+
+/* Our fake UART values */
+#define MCR_DTR		0x01
+#define MCR_RTS		0x02
+#define MCR_LOOP	0x04
+#define MSR_CTS		0x08
+#define MSR_CD		0x10
+#define MSR_RI		0x20
+#define MSR_DSR		0x40
+
+struct virtualbot_serial {
+	struct tty_struct	*tty;		/* pointer to the tty for this device */
+
+	unsigned long index;
+
+	/* Circular buffer to discard the return chars on writes */
+	struct circ_buf recv_buffer;
+};
+
+
+/**
+ *  Struct to represent the VirtualBot Commander
+ */
+struct vb_comm_serial {
+
+	struct tty_struct	*tty;		/* pointer to the tty for this device */
+
+	int created; 
+};
+
+/**
+ * Per-pair state: one EmulatedPort and its Exogenous counterpart
+ *
+ * Allocated when the pair is created, so the memory used by the driver is
+ * proportional to the number of pairs in use. Every installed tty holds a
+ * reference, so a removed pair lives until its last port is released.
+ *
+ * Locking: each side's mutex only covers its own open/close and state, and
+ * is never taken while holding the other one. A writer doesn't lock the peer
+ * at all: the receiving tty_port is part of the pair, which the writer's tty
+ * keeps alive, and the peer's state is published with RCU. The only lock on
+ * the data path is the spinlock of the receiving flip buffer, a leaf lock.
+ */
+struct virtualbot_pair {
+
+	unsigned int index;
+
+	struct kref kref;
+
+	/* set when the pair is removed, no new opens are accepted */
+	bool dead;
+
+	/* Protects the modem lines and their counters on both sides */
+	spinlock_t modem_lock;
+
+	/* EmulatedPorts that hear the Exogenous port instead of ours, see virtualbot_bus_attach() */
+	struct virtualbot_bus __rcu *bus;
+
+	/* Exogenous port the EmulatedPort talks to instead of ours */
+	struct virtualbot_pair __rcu *bus_master;
+
+	/* Recorder of the data written on both sides, see virtualbot_capture.c */
+	struct virtualbot_capture __rcu *capture;
+
+	/* Latency histograms of both directions, see virtualbot_latency.c */
+	struct dentry *debugfs;
+
+	/* EmulatedPort side */
+	struct tty_port virtualbot_port;
+
+	/* This mutex locks the virtualbot_serial structure */
+	struct mutex virtualbot_lock;
+
+	struct virtualbot_serial __rcu *virtualbot;	/* NULL while not open */
+
+	/* Published in 'virtualbot' while open, the peer only tests the pointer */
+	struct virtualbot_serial virtualbot_state;
+
+	/* MCR_DTR and MCR_RTS driven by the EmulatedPort, kept across opens */
+	unsigned int virtualbot_mcr;
+
+	/* Modem line changes seen by the EmulatedPort */
+	struct async_icount virtualbot_icount;
+
+	/* Data written on the EmulatedPort, received by the Exogenous port */
+	struct virtualbot_link virtualbot_link;
+
+	/* Exogenous side (VirtualBot Commander) */
+	struct tty_port vb_comm_port;
+
+	/* This mutex locks the vb_comm_serial structure */
+	struct mutex vb_comm_lock;
+
+	struct vb_comm_serial __rcu *vb_comm;	/* NULL while not open */
+
+	/* Published in 'vb_comm' while open */
+	struct vb_comm_serial vb_comm_state;
+
+	/* MCR_DTR and MCR_RTS driven by the Exogenous port, kept across opens */
+	unsigned int vb_comm_mcr;
+
+	/* Modem line changes seen by the Exogenous port */
+	struct async_icount vb_comm_icount;
+
+	/* Data written on the Exogenous port, received by the EmulatedPort */
+	struct virtualbot_link vb_comm_link;
+};
+
+/**
+ * Members of a multi-drop bus, one RS-485 master and its slaves
+ *
+ * Slots are cleared in place when a member leaves, so removing a pair never
+ * allocates. The array is only replaced, under RCU, when it has to grow.
+ */
+struct virtualbot_bus {
+	struct rcu_head rcu;
+
+	/* Taken by the writer, and to change a slot in place */
+	spinlock_t lock;
+
+	unsigned int slots;
+
+	/* Each member is referenced, NULL for a free slot */
+	struct virtualbot_pair __rcu *members[];
+};
+
+/* Serializes the changes of every bus */
+static DEFINE_MUTEX(virtualbot_bus_lock);
+
+/* Number of port pairs, set at load time */
+static unsigned int virtualbot_num_pairs = VIRTUALBOT_DEFAULT_PAIRS;
+
+module_param_named(pairs, virtualbot_num_pairs, uint, 0444);
+MODULE_PARM_DESC(pairs, "Number of EmulatedPort/Exogenous pairs to create");
+
+/* Maximum number of pairs, including the ones created at runtime */
+static unsigned int virtualbot_max_pairs = VIRTUALBOT_DEFAULT_MAX_PAIRS;
+
+module_param_named(max_pairs, virtualbot_max_pairs, uint, 0444);
+MODULE_PARM_DESC(max_pairs, "Maximum number of pairs, including the ones created through " SERIALEMU_CTL_NAME);
+
+/* Pacing setting of new pairs */
+static bool virtualbot_pacing;
+
+module_param_named(pacing, virtualbot_pacing, bool, 0644);
+MODULE_PARM_DESC(pacing, "Deliver data at the baud rate set on the writing port (default: off)");
+
+/* Store policy of new pairs, see virtualbot_store.c */
+static unsigned int virtualbot_store_policy = SERIALEMU_STORE_OFF;
+
+module_param_named(store, virtualbot_store_policy, uint, 0644);
+MODULE_PARM_DESC(store, "Data written while the peer is closed: 0 fails (default), 1 drop oldest, 2 drop newest, 3 block");
+
+/* Table of pairs, indexed by tty minor. Entries are NULL while free */
+static struct virtualbot_pair **virtualbot_pairs;
+
+/* This mutex locks the table of pairs */
+static DEFINE_MUTEX(virtualbot_pairs_lock);
+
+static bool virtualbot_unloading;
+
+static ktime_t virtualbot_load_start;
+
+static void virtualbot_register_pairs(struct work_struct *work);
+
+static DECLARE_WORK(virtualbot_register_work, virtualbot_register_pairs);
+
+static void virtualbot_bus_leave(struct virtualbot_pair *pair);
+
+static void virtualbot_modem_update(struct virtualbot_pair *pair,
+	unsigned int *mcr,
+	struct async_icount *peer_icount,
+	struct tty_port *peer_port,
+	unsigned int set,
+	unsigned int clear);
+
+static struct tty_driver *virtualbot_tty_driver;
+
+static struct tty_driver *vb_comm_tty_driver;
+
+/* Pair of an installed tty, one macro for each side */
+#define virtualbot_pair_of(tty) \
+	container_of((tty)->port, struct virtualbot_pair, virtualbot_port)
+
+#define vb_comm_pair_of(tty) \
+	container_of((tty)->port, struct virtualbot_pair, vb_comm_port)
+
+/* Flip buffer clients of each side, set up in virtualbot_init() */
+static struct tty_port_client_operations virtualbot_client_ops;
+
+static struct tty_port_client_operations vb_comm_client_ops;
+
+/* Lifecycle of each side, the tty_port core counts the opens */
+static const struct tty_port_operations virtualbot_port_ops;
+
+static const struct tty_port_operations vb_comm_port_ops;
+
+/**
+ * Hands the data received on the EmulatedPort to its line discipline
+ *
+ * The flip buffer this data leaves is the room the Exogenous writer waits
+ * for, so that writer is woken up as soon as some of it was consumed.
+ */
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0))
+static size_t virtualbot_receive_buf(struct tty_port *port,
+	const u8 *chars,
+	const u8 *flags,
+	size_t count)
+#else
+static int virtualbot_receive_buf(struct tty_port *port,
+	const unsigned char *chars,
+	const unsigned char *flags,
+	size_t count)
+#endif
+{
+	struct virtualbot_pair *pair = container_of(port, struct virtualbot_pair, virtualbot_port);
+	struct virtualbot_pair *master;
+	size_t received;
+
+	received = tty_port_default_client_ops.receive_buf( port, chars, flags, count );
+
+	if (!received)
+		return received;
+
+	virtualbot_latency_consume( &pair->vb_comm_link, received );
+
+	virtualbot_link_wakeup( &pair->vb_comm_link );
+
+	/* in loopback, the writer is the reader */
+	if (READ_ONCE( pair->virtualbot_mcr ) & MCR_LOOP)
+		tty_port_tty_wakeup( port );
+
+	/* on a bus, the writer is its master */
+	rcu_read_lock();
+
+	master = rcu_dereference( pair->bus_master );
+
+	if (master)
+		tty_port_tty_wakeup( &master->vb_comm_port );
+
+	rcu_read_unlock();
+
+	return received;
+}
+
+/**
+ * Same for the Exogenous side, wakes the EmulatedPort writer
+ */
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0))
+static size_t vb_comm_receive_buf(struct tty_port *port,
+	const u8 *chars,
+	const u8 *flags,
+	size_t count)
+#else
+static int vb_comm_receive_buf(struct tty_port *port,
+	const unsigned char *chars,
+	const unsigned char *flags,
+	size_t count)
+#endif
+{
+	struct virtualbot_pair *pair = container_of(port, struct virtualbot_pair, vb_comm_port);
+	struct virtualbot_pair *member;
+	struct virtualbot_bus *bus;
+	unsigned int i;
+	size_t received;
+
+	received = tty_port_default_client_ops.receive_buf( port, chars, flags, count );
+
+	if (!received)
+		return received;
+
+	virtualbot_latency_consume( &pair->virtualbot_link, received );
+
+	virtualbot_link_wakeup( &pair->virtualbot_link );
+
+	if (READ_ONCE( pair->vb_comm_mcr ) & MCR_LOOP)
+		tty_port_tty_wakeup( port );
+
+	/* on a bus, any member may be waiting for the master to read */
+	rcu_read_lock();
+
+	bus = rcu_dereference( pair->bus );
+
+	for (i = 0; bus && i < bus->slots; i++) {
+
+		member = rcu_dereference( bus->members[ i ] );
+
+		if (member)
+			tty_port_tty_wakeup( &member->virtualbot_port );
+	}
+
+	rcu_read_unlock();
+
+	return received;
+}
+
+/**
+ * Traffic counters in sysfs, under stats/ in the device of each port
+ *
+ * tx_* count what the port sends, rx_* what it receives. Reading them only
+ * adds up per-CPU counters, no lock of the pair is taken.
+ */
+struct virtualbot_stats_attribute {
+	struct device_attribute dev_attr;
+	bool rx;
+	size_t offset;		/* of the counter in struct virtualbot_traffic */
+};
+
+static ssize_t virtualbot_stats_show(struct device *dev,
+	struct device_attribute *attr,
+	char *buf)
+{
+	struct virtualbot_stats_attribute *stats_attr =
+		container_of(attr, struct virtualbot_stats_attribute, dev_attr);
+	struct virtualbot_pair *pair = dev_get_drvdata( dev );
+	struct virtualbot_traffic traffic;
+	bool emulated = MAJOR( dev->devt ) == virtualbot_tty_driver->major;
+
+	/* what the EmulatedPort sends is what the Exogenous port receives */
+	if (emulated != stats_attr->rx)
+		virtualbot_stats_read( pair->virtualbot_link.stats, &traffic );
+	else
+		virtualbot_stats_read( pair->vb_comm_link.stats, &traffic );
+
+	return sysfs_emit( buf, "%llu\n",
+		*(u64 *)( (char *)&traffic + stats_attr->offset ) );
+}
+
+#define VIRTUALBOT_STATS_ATTR(_dir, _rx, _field)				\
+	static struct virtualbot_stats_attribute virtualbot_stats_##_dir##_##_field = {	\
+		.dev_attr = __ATTR(_dir##_##_field, 0444, virtualbot_stats_show, NULL),	\
+		.rx = _rx,							\
+		.offset = offsetof(struct virtualbot_traffic, _field),		\
+	}
+
+VIRTUALBOT_STATS_ATTR(tx, false, bytes);
+VIRTUALBOT_STATS_ATTR(tx, false, writes);
+VIRTUALBOT_STATS_ATTR(tx, false, pushes);
+VIRTUALBOT_STATS_ATTR(tx, false, overruns);
+VIRTUALBOT_STATS_ATTR(tx, false, dropped);
+VIRTUALBOT_STATS_ATTR(tx, false, parity_errors);
+VIRTUALBOT_STATS_ATTR(tx, false, frame_errors);
+VIRTUALBOT_STATS_ATTR(tx, false, overrun_errors);
+VIRTUALBOT_STATS_ATTR(tx, false, malformed_frames);
+VIRTUALBOT_STATS_ATTR(rx, true, bytes);
+VIRTUALBOT_STATS_ATTR(rx, true, writes);
+VIRTUALBOT_STATS_ATTR(rx, true, pushes);
+VIRTUALBOT_STATS_ATTR(rx, true, overruns);
+VIRTUALBOT_STATS_ATTR(rx, true, dropped);
+VIRTUALBOT_STATS_ATTR(rx, true, parity_errors);
+VIRTUALBOT_STATS_ATTR(rx, true, frame_errors);
+VIRTUALBOT_STATS_ATTR(rx, true, overrun_errors);
+VIRTUALBOT_STATS_ATTR(rx, true, malformed_frames);
+
+static struct attribute *virtualbot_stats_attrs[] = {
+	&virtualbot_stats_tx_bytes.dev_attr.attr,
+	&virtualbot_stats_tx_writes.dev_attr.attr,
+	&virtualbot_stats_tx_pushes.dev_attr.attr,
+	&virtualbot_stats_tx_overruns.dev_attr.attr,
+	&virtualbot_stats_tx_dropped.dev_attr.attr,
+	&virtualbot_stats_tx_parity_errors.dev_attr.attr,
+	&virtualbot_stats_tx_frame_errors.dev_attr.attr,
+	&virtualbot_stats_tx_overrun_errors.dev_attr.attr,
+	&virtualbot_stats_tx_malformed_frames.dev_attr.attr,
+	&virtualbot_stats_rx_bytes.dev_attr.attr,
+	&virtualbot_stats_rx_writes.dev_attr.attr,
+	&virtualbot_stats_rx_pushes.dev_attr.attr,
+	&virtualbot_stats_rx_overruns.dev_attr.attr,
+	&virtualbot_stats_rx_dropped.dev_attr.attr,
+	&virtualbot_stats_rx_parity_errors.dev_attr.attr,
+	&virtualbot_stats_rx_frame_errors.dev_attr.attr,
+	&virtualbot_stats_rx_overrun_errors.dev_attr.attr,
+	&virtualbot_stats_rx_malformed_frames.dev_attr.attr,
+	NULL
+};
+
+static const struct attribute_group virtualbot_stats_group = {
+	.name = "stats",
+	.attrs = virtualbot_stats_attrs,
+};
+
+/**
+ * Receive buffer of each port in sysfs, under buffer/ in its device
+ *
+ * 'depth' can be written like SERIALEMU_IOC_DEPTH does, writing anything
+ * to 'high_water' resets it.
+ */
+static struct virtualbot_link *virtualbot_rx_link(struct device *dev)
+{
+	struct virtualbot_pair *pair = dev_get_drvdata( dev );
+
+	/* the EmulatedPort receives what the Exogenous port sends */
+	if (MAJOR( dev->devt ) == virtualbot_tty_driver->major)
+		return &pair->vb_comm_link;
+
+	return &pair->virtualbot_link;
+}
+
+static ssize_t depth_show(struct device *dev,
+	struct device_attribute *attr,
+	char *buf)
+{
+	return sysfs_emit( buf, "%u\n", virtualbot_link_depth( virtualbot_rx_link( dev ) ) );
+}
+
+static ssize_t depth_store(struct device *dev,
+	struct device_attribute *attr,
+	const char *buf,
+	size_t count)
+{
+	unsigned int depth;
+	int retval;
+
+	retval = kstrtouint( buf, 0, &depth );
+
+	if (!retval)
+		retval = virtualbot_link_set_depth( virtualbot_rx_link( dev ), depth );
+
+	return retval ? retval : count;
+}
+
+static ssize_t occupancy_show(struct device *dev,
+	struct device_attribute *attr,
+	char *buf)
+{
+	return sysfs_emit( buf, "%u\n", virtualbot_link_occupancy( virtualbot_rx_link( dev ) ) );
+}
+
+static ssize_t high_water_show(struct device *dev,
+	struct device_attribute *attr,
+	char *buf)
+{
+	return sysfs_emit( buf, "%u\n",
+		virtualbot_link_high_water( virtualbot_rx_link( dev ), false ) );
+}
+
+static ssize_t high_water_store(struct device *dev,
+	struct device_attribute *attr,
+	const char *buf,
+	size_t count)
+{
+	virtualbot_link_high_water( virtualbot_rx_link( dev ), true );
+
+	return count;
+}
+
+static DEVICE_ATTR_RW(depth);
+static DEVICE_ATTR_RO(occupancy);
+static DEVICE_ATTR_RW(high_water);
+
+static struct attribute *virtualbot_buffer_attrs[] = {
+	&dev_attr_depth.attr,
+	&dev_attr_occupancy.attr,
+	&dev_attr_high_water.attr,
+	NULL
+};
+
+static const struct attribute_group virtualbot_buffer_group = {
+	.name = "buffer",
+	.attrs = virtualbot_buffer_attrs,
+};
+
+static const struct attribute_group *virtualbot_stats_groups[] = {
+	&virtualbot_stats_group,
+	&virtualbot_buffer_group,
+	NULL
+};
+
+/**
+ * Frees a pair once it was removed and its last tty was released
+ */
+static void virtualbot_pair_release(struct kref *kref)
+{
+	struct virtualbot_pair *pair = container_of(kref, struct virtualbot_pair, kref);
+
+	debugfs_remove( pair->debugfs );
+
+	/* only now the index can be reused */
+	mutex_lock( &virtualbot_pairs_lock );
+	virtualbot_pairs[ pair->index ] = NULL;
+	mutex_unlock( &virtualbot_pairs_lock );
+
+	pr_debug("virtualbot: pair %u released", pair->index);
+
+	virtualbot_link_destroy( &pair->virtualbot_link );
+	virtualbot_link_destroy( &pair->vb_comm_link );
+
+	tty_port_destroy( &pair->virtualbot_port );
+	tty_port_destroy( &pair->vb_comm_port );
+
+	mutex_destroy( &pair->virtualbot_lock );
+	mutex_destroy( &pair->vb_comm_lock );
+
+	kfree( pair );
+}
+
+void virtualbot_pair_put(struct virtualbot_pair *pair)
+{
+	kref_put( &pair->kref, virtualbot_pair_release );
+}
+
+/**
+ * Looks up a live pair by index and takes a reference on it
+ */
+struct virtualbot_pair *virtualbot_pair_get(unsigned int index)
+{
+	struct virtualbot_pair *pair = NULL;
+
+	mutex_lock( &virtualbot_pairs_lock );
+
+	if (index < virtualbot_max_pairs) {
+
+		pair = virtualbot_pairs[ index ];
+
+		if (pair && !pair->dead)
+			kref_get( &pair->kref );
+		else
+			pair = NULL;
+	}
+
+	mutex_unlock( &virtualbot_pairs_lock );
+
+	return pair;
+}
+
+/**
+ * Creates a pair and registers its EmulatedPort and Exogenous devices
+ *
+ * A negative index picks the lowest free one. Returns the index of the new
+ * pair or a negative error code.
+ */
+int virtualbot_pair_add(int index)
+{
+	struct virtualbot_pair *pair;
+	struct device *dev;
+	int retval;
+
+	pair = kzalloc(sizeof(*pair), GFP_KERNEL);
+
+	if (!pair)
+		return -ENOMEM;
+
+	kref_init( &pair->kref );
+	spin_lock_init( &pair->modem_lock );
+
+	tty_port_init( &pair->virtualbot_port );
+	pair->virtualbot_port.ops = &virtualbot_port_ops;
+	pair->virtualbot_port.client_ops = &virtualbot_client_ops;
+	mutex_init( &pair->virtualbot_lock );
+
+	tty_port_init( &pair->vb_comm_port );
+	pair->vb_comm_port.ops = &vb_comm_port_ops;
+	pair->vb_comm_port.client_ops = &vb_comm_client_ops;
+	mutex_init( &pair->vb_comm_lock );
+
+	virtualbot_link_init( &pair->virtualbot_link, true,
+		&pair->virtualbot_port,
+		&pair->vb_comm_port );
+
+	virtualbot_link_init( &pair->vb_comm_link, false,
+		&pair->vb_comm_port,
+		&pair->virtualbot_port );
+
+	if (!pair->virtualbot_link.stats || !pair->vb_comm_link.stats) {
+		retval = -ENOMEM;
+		goto free_pair;
+	}
+
+	if (READ_ONCE( virtualbot_pacing ) &&
+	    ( virtualbot_pacer_enable( &pair->virtualbot_link.pacer, true ) ||
+	      virtualbot_pacer_enable( &pair->vb_comm_link.pacer, true ) )) {
+		retval = -ENOMEM;
+		goto free_pair;
+	}
+
+	if (READ_ONCE( virtualbot_store_policy ) != SERIALEMU_STORE_OFF &&
+	    ( virtualbot_store_set( &pair->virtualbot_link, virtualbot_store_policy, 0 ) ||
+	      virtualbot_store_set( &pair->vb_comm_link, virtualbot_store_policy, 0 ) )) {
+		retval = -EINVAL;
+		goto free_pair;
+	}
+
+	mutex_lock( &virtualbot_pairs_lock );
+
+	if (index < 0) {
+		for (index = 0; index < virtualbot_max_pairs; index++)
+			if (!virtualbot_pairs[ index ])
+				break;
+
+		if (index == virtualbot_max_pairs) {
+			retval = -ENOSPC;
+			goto unlock;
+		}
+
+	} else if (index >= virtualbot_max_pairs) {
+		retval = -EINVAL;
+		goto unlock;
+
+	} else if (virtualbot_pairs[ index ]) {
+		/* in use, or still held by a tty of a removed pair */
+		retval = -EBUSY;
+		goto unlock;
+	}
+
+	pair->index = index;
+	pair->virtualbot_link.index = index;
+	pair->vb_comm_link.index = index;
+
+	/* the pair must be reachable before its devices can be opened */
+	virtualbot_pairs[ index ] = pair;
+
+	mutex_unlock( &virtualbot_pairs_lock );
+
+	dev = tty_register_device_attr( virtualbot_tty_driver, index, NULL,
+		pair, virtualbot_stats_groups );
+
+	if (IS_ERR(dev)) {
+		retval = PTR_ERR(dev);
+		goto remove_pair;
+	}
+
+	dev = tty_register_device_attr( vb_comm_tty_driver, index, NULL,
+		pair, virtualbot_stats_groups );
+
+	if (IS_ERR(dev)) {
+		retval = PTR_ERR(dev);
+		goto unregister_virtualbot;
+	}
+
+	pair->debugfs = virtualbot_latency_add_pair( index,
+		&pair->virtualbot_link, &pair->vb_comm_link );
+
+	pr_debug("virtualbot: pair %d linked", index);
+
+	return index;
+
+unregister_virtualbot:
+	tty_unregister_device( virtualbot_tty_driver, index );
+
+remove_pair:
+	pair->dead = true;
+	virtualbot_pair_put( pair );
+
+	return retval;
+
+unlock:
+	mutex_unlock( &virtualbot_pairs_lock );
+
+free_pair:
+	virtualbot_link_destroy( &pair->vb_comm_link );
+	virtualbot_link_destroy( &pair->virtualbot_link );
+
+	tty_port_destroy( &pair->vb_comm_port );
+	tty_port_destroy( &pair->virtualbot_port );
+
+	mutex_destroy( &pair->vb_comm_lock );
+	mutex_destroy( &pair->virtualbot_lock );
+
+	kfree( pair );
+
+	return retval;
+}
+
+/**
+ * Removes a pair: its devices are unregistered and open ports are hung up
+ *
+ * The pair itself is freed when the last tty using it is released
+ */
+int virtualbot_pair_remove(unsigned int index)
+{
+	struct virtualbot_pair *pair;
+
+	mutex_lock( &virtualbot_pairs_lock );
+
+	pair = index < virtualbot_max_pairs ? virtualbot_pairs[ index ] : NULL;
+
+	if (!pair || pair->dead) {
+		mutex_unlock( &virtualbot_pairs_lock );
+		return -ENODEV;
+	}
+
+	pair->dead = true;
+
+	mutex_unlock( &virtualbot_pairs_lock );
+
+	virtualbot_bus_leave( pair );
+
+	/* TIOCMIWAIT sleepers give up */
+	wake_up_interruptible( &pair->virtualbot_port.delta_msr_wait );
+	wake_up_interruptible( &pair->vb_comm_port.delta_msr_wait );
+
+	/* wait for activations in progress, they either see 'dead' or are hung up below */
+	mutex_lock( &pair->virtualbot_lock );
+	mutex_unlock( &pair->virtualbot_lock );
+
+	mutex_lock( &pair->vb_comm_lock );
+	mutex_unlock( &pair->vb_comm_lock );
+
+	tty_port_tty_hangup( &pair->virtualbot_port, false );
+	tty_port_tty_hangup( &pair->vb_comm_port, false );
+
+	tty_unregister_device( virtualbot_tty_driver, index );
+	tty_unregister_device( vb_comm_tty_driver, index );
+
+	pr_debug("virtualbot: pair %u unregistered", index);
+
+	virtualbot_pair_put( pair );
+
+	return 0;
+}
+
+/**
+ * Fills 'indexes' with up to 'max' live pairs, returns how many there are
+ */
+unsigned int virtualbot_pair_list(u32 *indexes, unsigned int max)
+{
+	struct virtualbot_pair *pair;
+	unsigned int i, count = 0;
+
+	mutex_lock( &virtualbot_pairs_lock );
+
+	for (i = 0; i < virtualbot_max_pairs; i++) {
+
+		pair = virtualbot_pairs[ i ];
+
+		if (!pair || pair->dead)
+			continue;
+
+		if (count < max)
+			indexes[ count ] = i;
+
+		count++;
+	}
+
+	mutex_unlock( &virtualbot_pairs_lock );
+
+	return count;
+}
+
+unsigned int virtualbot_pair_capacity(void)
+{
+	return virtualbot_max_pairs;
+}
+
+/**
+ * Turns the baud rate emulation of both directions of a pair on or off
+ */
+int virtualbot_pair_set_pacing(unsigned int index, bool enable)
+{
+	struct virtualbot_pair *pair;
+	int retval;
+
+	pair = virtualbot_pair_get( index );
+
+	if (!pair)
+		return -ENODEV;
+
+	retval = virtualbot_pacer_enable( &pair->virtualbot_link.pacer, enable );
+
+	if (!retval)
+		retval = virtualbot_pacer_enable( &pair->vb_comm_link.pacer, enable );
+
+	virtualbot_pair_put( pair );
+
+	return retval;
+}
+
+/**
+ * Sets the faults injected in one direction of a pair
+ */
+int virtualbot_pair_set_faults(const struct serialemu_faults *faults)
+{
+	struct virtualbot_pair *pair;
+	int retval;
+
+	if (faults->direction != SERIALEMU_TO_EXOGENOUS &&
+	    faults->direction != SERIALEMU_TO_EMULATED)
+		return -EINVAL;
+
+	pair = virtualbot_pair_get( faults->index );
+
+	if (!pair)
+		return -ENODEV;
+
+	if (faults->direction == SERIALEMU_TO_EXOGENOUS)
+		retval = virtualbot_fault_set( &pair->virtualbot_link, faults );
+	else
+		retval = virtualbot_fault_set( &pair->vb_comm_link, faults );
+
+	virtualbot_pair_put( pair );
+
+	return retval;
+}
+
+/**
+ * Sets the framing of the data written on one side of a pair
+ */
+int virtualbot_pair_set_framing(const struct serialemu_framing *framing)
+{
+	struct virtualbot_pair *pair;
+	int retval;
+
+	if (framing->direction != SERIALEMU_TO_EXOGENOUS &&
+	    framing->direction != SERIALEMU_TO_EMULATED)
+		return -EINVAL;
+
+	pair = virtualbot_pair_get( framing->index );
+
+	if (!pair)
+		return -ENODEV;
+
+	retval = virtualbot_framer_set_mode( virtualbot_pair_link( pair, framing->direction ),
+		framing->mode );
+
+	virtualbot_pair_put( pair );
+
+	return retval;
+}
+
+/**
+ * Sets how one direction of a pair holds data while its receiver is closed
+ */
+int virtualbot_pair_set_store(const struct serialemu_store *store)
+{
+	struct virtualbot_pair *pair;
+	int retval;
+
+	if (store->direction != SERIALEMU_TO_EXOGENOUS &&
+	    store->direction != SERIALEMU_TO_EMULATED)
+		return -EINVAL;
+
+	pair = virtualbot_pair_get( store->index );
+
+	if (!pair)
+		return -ENODEV;
+
+	retval = virtualbot_store_set( virtualbot_pair_link( pair, store->direction ),
+		store->policy, store->limit );
+
+	virtualbot_pair_put( pair );
+
+	return retval;
+}
+
+/**
+ * Sets the atomic size of one direction of a pair
+ */
+int virtualbot_pair_set_atomic(const struct serialemu_atomic *atomic)
+{
+	struct virtualbot_pair *pair;
+	int retval;
+
+	if (atomic->direction != SERIALEMU_TO_EXOGENOUS &&
+	    atomic->direction != SERIALEMU_TO_EMULATED)
+		return -EINVAL;
+
+	pair = virtualbot_pair_get( atomic->index );
+
+	if (!pair)
+		return -ENODEV;
+
+	retval = virtualbot_link_set_atomic( virtualbot_pair_link( pair, atomic->direction ),
+		atomic->size );
+
+	virtualbot_pair_put( pair );
+
+	return retval;
+}
+
+/**
+ * Sets the receive buffer depth of one direction of a pair, and reports
+ * how full that buffer is
+ */
+int virtualbot_pair_depth(struct serialemu_depth *depth)
+{
+	struct virtualbot_pair *pair;
+	struct virtualbot_link *link;
+	int retval = 0;
+
+	if (depth->direction != SERIALEMU_TO_EXOGENOUS &&
+	    depth->direction != SERIALEMU_TO_EMULATED)
+		return -EINVAL;
+
+	pair = virtualbot_pair_get( depth->index );
+
+	if (!pair)
+		return -ENODEV;
+
+	link = virtualbot_pair_link( pair, depth->direction );
+
+	if (depth->depth)
+		retval = virtualbot_link_set_depth( link, depth->depth );
+
+	if (!retval) {
+		depth->depth = virtualbot_link_depth( link );
+		depth->occupancy = virtualbot_link_occupancy( link );
+		depth->high_water = virtualbot_link_high_water( link,
+			depth->flags & SERIALEMU_DEPTH_RESET_HIGH_WATER );
+	}
+
+	virtualbot_pair_put( pair );
+
+	return retval;
+}
+
+/**
+ * Sets the low latency delivery of one direction of a pair
+ */
+int virtualbot_pair_set_latency(const struct serialemu_latency *latency)
+{
+	struct virtualbot_pair *pair;
+	int retval;
+
+	if (latency->direction != SERIALEMU_TO_EXOGENOUS &&
+	    latency->direction != SERIALEMU_TO_EMULATED)
+		return -EINVAL;
+
+	pair = virtualbot_pair_get( latency->index );
+
+	if (!pair)
+		return -ENODEV;
+
+	retval = virtualbot_link_set_latency( virtualbot_pair_link( pair, latency->direction ),
+		latency->enable, latency->cpu < 0 ? WORK_CPU_UNBOUND : latency->cpu );
+
+	virtualbot_pair_put( pair );
+
+	return retval;
+}
+
+/**
+ * Loops one side of a pair back on itself, as TIOCM_LOOP does from the port
+ */
+int virtualbot_pair_set_loopback(const struct serialemu_loopback *loopback)
+{
+	struct virtualbot_pair *pair;
+	unsigned int set, clear;
+
+	if (loopback->direction != SERIALEMU_TO_EXOGENOUS &&
+	    loopback->direction != SERIALEMU_TO_EMULATED)
+		return -EINVAL;
+
+	pair = virtualbot_pair_get( loopback->index );
+
+	if (!pair)
+		return -ENODEV;
+
+	set = loopback->enable ? MCR_LOOP : 0;
+	clear = loopback->enable ? 0 : MCR_LOOP;
+
+	if (loopback->direction == SERIALEMU_TO_EXOGENOUS) {
+		virtualbot_modem_update( pair, &pair->virtualbot_mcr,
+			&pair->vb_comm_icount, &pair->vb_comm_port, set, clear );
+
+		/* a blocked writer has another buffer to wait for */
+		tty_port_tty_wakeup( &pair->virtualbot_port );
+	} else {
+		virtualbot_modem_update( pair, &pair->vb_comm_mcr,
+			&pair->virtualbot_icount, &pair->virtualbot_port, set, clear );
+
+		tty_port_tty_wakeup( &pair->vb_comm_port );
+	}
+
+	virtualbot_pair_put( pair );
+
+	return 0;
+}
+
+/**
+ * Attaches the EmulatedPort of 'member' to the bus driven by the Exogenous
+ * port of 'master'
+ *
+ * From then on every write on the master reaches all of its members, and
+ * what a member writes is received by the master. An EmulatedPort is on one
+ * bus at most, the master may be a member of its own bus.
+ */
+int virtualbot_bus_attach(unsigned int master_index, unsigned int member_index)
+{
+	struct virtualbot_pair *master, *member;
+	struct virtualbot_bus *bus, *old;
+	unsigned int i, slots = 0;
+	int retval = 0;
+
+	master = virtualbot_pair_get( master_index );
+
+	if (!master)
+		return -ENODEV;
+
+	member = virtualbot_pair_get( member_index );
+
+	if (!member) {
+		virtualbot_pair_put( master );
+		return -ENODEV;
+	}
+
+	mutex_lock( &virtualbot_bus_lock );
+
+	/* a removed pair leaves its bus under this lock, after 'dead' is set */
+	if (READ_ONCE( master->dead ) || READ_ONCE( member->dead )) {
+		retval = -ENODEV;
+		goto unlock;
+	}
+
+	if (rcu_access_pointer( member->bus_master )) {
+		retval = -EBUSY;
+		goto unlock;
+	}
+
+	old = rcu_dereference_protected( master->bus,
+		lockdep_is_held( &virtualbot_bus_lock ) );
+
+	if (old) {
+		slots = old->slots;
+
+		for (i = 0; i < slots; i++) {
+			if (!rcu_access_pointer( old->members[ i ] )) {
+				/* the member's reference moves to the bus */
+				spin_lock_bh( &old->lock );
+				rcu_assign_pointer( old->members[ i ], member );
+				spin_unlock_bh( &old->lock );
+				goto attached;
+			}
+		}
+	}
+
+	if (slots == VIRTUALBOT_BUS_MAX_MEMBERS) {
+		retval = -ENOSPC;
+		goto unlock;
+	}
+
+	slots = clamp( slots * 2, 4U, (unsigned int)VIRTUALBOT_BUS_MAX_MEMBERS );
+
+	bus = kzalloc( struct_size( bus, members, slots ), GFP_KERNEL );
+
+	if (!bus) {
+		retval = -ENOMEM;
+		goto unlock;
+	}
+
+	spin_lock_init( &bus->lock );
+	bus->slots = slots;
+
+	for (i = 0; old && i < old->slots; i++)
+		RCU_INIT_POINTER( bus->members[ i ],
+			rcu_dereference_protected( old->members[ i ],
+				lockdep_is_held( &virtualbot_bus_lock ) ) );
+
+	RCU_INIT_POINTER( bus->members[ i ], member );
+
+	rcu_assign_pointer( master->bus, bus );
+
+	if (old)
+		kfree_rcu( old, rcu );
+
+attached:
+	rcu_assign_pointer( member->bus_master, master );
+
+	mutex_unlock( &virtualbot_bus_lock );
+
+	virtualbot_pair_put( master );
+
+	pr_debug("virtualbot: pair %u listens to the bus of pair %u",
+		member_index, master_index);
+
+	return 0;
+
+unlock:
+	mutex_unlock( &virtualbot_bus_lock );
+
+	virtualbot_pair_put( member );
+	virtualbot_pair_put( master );
+
+	return retval;
+}
+
+/**
+ * Clears the slot of 'member' on the bus it is attached to
+ *
+ * Called with virtualbot_bus_lock held. The caller drops the reference of
+ * the bus on the member after a grace period.
+ */
+static void virtualbot_bus_clear(struct virtualbot_pair *member)
+{
+	struct virtualbot_pair *master;
+	struct virtualbot_bus *bus;
+	unsigned int i;
+
+	master = rcu_dereference_protected( member->bus_master,
+		lockdep_is_held( &virtualbot_bus_lock ) );
+
+	bus = rcu_dereference_protected( master->bus,
+		lockdep_is_held( &virtualbot_bus_lock ) );
+
+	spin_lock_bh( &bus->lock );
+
+	for (i = 0; i < bus->slots; i++) {
+		if (rcu_access_pointer( bus->members[ i ] ) == member)
+			RCU_INIT_POINTER( bus->members[ i ], NULL );
+	}
+
+	spin_unlock_bh( &bus->lock );
+
+	RCU_INIT_POINTER( member->bus_master, NULL );
+}
+
+int virtualbot_bus_detach(unsigned int master_index, unsigned int member_index)
+{
+	struct virtualbot_pair *master, *member;
+	bool attached = false;
+
+	master = virtualbot_pair_get( master_index );
+
+	if (!master)
+		return -ENODEV;
+
+	member = virtualbot_pair_get( member_index );
+
+	if (!member) {
+		virtualbot_pair_put( master );
+		return -ENODEV;
+	}
+
+	mutex_lock( &virtualbot_bus_lock );
+
+	if (rcu_access_pointer( member->bus_master ) == master) {
+		virtualbot_bus_clear( member );
+		attached = true;
+	}
+
+	mutex_unlock( &virtualbot_bus_lock );
+
+	if (attached) {
+		/* writers on the bus may still be using the member */
+		synchronize_rcu();
+
+		/* the reference held by the bus */
+		virtualbot_pair_put( member );
+	}
+
+	virtualbot_pair_put( member );
+	virtualbot_pair_put( master );
+
+	return attached ? 0 : -ENOENT;
+}
+
+/**
+ * Takes a removed pair off any bus: its members go back to their own
+ * Exogenous ports, and it stops listening to its master
+ */
+static void virtualbot_bus_leave(struct virtualbot_pair *pair)
+{
+	struct virtualbot_pair *member, *left = NULL;
+	struct virtualbot_bus *bus;
+	unsigned int i;
+
+	mutex_lock( &virtualbot_bus_lock );
 
-#define DELAY_TIME		(HZ * 2)	/* 2 seconds per character */
-#define TINY_DATA_CHARACTER	't'
+	bus = rcu_dereference_protected( pair->bus,
+		lockdep_is_held( &virtualbot_bus_lock ) );
 
-struct virtualbot_serial {
-	struct tty_struct	*tty;		/* pointer to the tty for this device */
+	RCU_INIT_POINTER( pair->bus, NULL );
 
-	unsigned long index;
+	for (i = 0; bus && i < bus->slots; i++) {
 
-	int	open_count;	/* number of times this port has been opened */
+		member = rcu_dereference_protected( bus->members[ i ],
+			lockdep_is_held( &virtualbot_bus_lock ) );
 
-	struct timer_list timer;
+		if (member)
+			RCU_INIT_POINTER( member->bus_master, NULL );
+	}
 
-	/* for tiocmget and tiocmset functions */
-	int			msr;		/* MSR shadow */
-	int			mcr;		/* MCR shadow */
+	if (rcu_access_pointer( pair->bus_master )) {
+		virtualbot_bus_clear( pair );
+		left = pair;
+	}
 
-	/* for ioctl fun */
-	struct serial_struct	serial;
+	mutex_unlock( &virtualbot_bus_lock );
 
-	wait_queue_head_t	wait;
-	
-	struct async_icount	icount;
+	if (!bus && !left)
+		return;
 
-	/* Circular buffer to discard the return chars on writes */
-	struct circ_buf recv_buffer;
-	
-};
+	synchronize_rcu();
+
+	for (i = 0; bus && i < bus->slots; i++) {
 
+		member = rcu_dereference_protected( bus->members[ i ], 1 );
+
+		if (member)
+			virtualbot_pair_put( member );
+	}
+
+	kfree( bus );
+
+	if (left)
+		virtualbot_pair_put( left );
+}
 
 /**
- *  Struct to represent the VirtualBot Commander
+ * Room on a bus: it moves as fast as its fullest open member, counting the
+ * characters its injected faults may add
  */
-struct vb_comm_serial {
+static unsigned int virtualbot_bus_room(struct virtualbot_bus *bus)
+{
+	struct virtualbot_pair *member;
+	unsigned int i, room = VIRTUALBOT_BUS_IDLE_ROOM;
 
-	struct tty_struct	*tty;		/* pointer to the tty for this device */
-	int			open_count;	/* number of times this port has been opened */
+	for (i = 0; i < bus->slots; i++) {
 
-	/* Used to simulate serial port data rate */
-	struct timer_list timer;
+		member = rcu_dereference( bus->members[ i ] );
 
-	int created; 
+		if (member && rcu_dereference( member->virtualbot ))
+			room = min( room, virtualbot_link_whole_room( &member->vb_comm_link ) );
+	}
+
+	return room;
+}
+
+/**
+ * Fans a write on the master out to every open member of its bus
+ *
+ * All members receive the same bytes, straight from the writer's buffer:
+ * nothing is copied except into each member's flip buffer. 'link' is the
+ * direction written by the master, for its atomic size. Called under
+ * rcu_read_lock(), returns the number of bytes accepted.
+ *
+ * The chunk reaches every open member or none of them: the lock of each
+ * member is held, in slot order, from the room check to the copy, so no
+ * other producer of a member can take the room in between. The slots
+ * don't change while the bus lock is held, so the same members are
+ * unlocked. A bus has few enough members to keep them all locked.
+ */
+static size_t virtualbot_bus_write(struct virtualbot_bus *bus,
+	struct virtualbot_link *link,
+	const unsigned char *buffer,
+	size_t count)
+{
+	struct virtualbot_link *member_link;
+	struct virtualbot_pair *member;
+	unsigned int i, room = VIRTUALBOT_BUS_IDLE_ROOM;
 
-	/* for tiocmget and tiocmset functions */
-	int			msr;		/* MSR shadow */
-	int			mcr;		/* MCR shadow */
+	spin_lock_bh( &bus->lock );
 
-	/* for ioctl fun */
-	struct serial_struct	serial;
+	for (i = 0; i < bus->slots; i++) {
 
-	wait_queue_head_t	wait;
-	
-	struct async_icount	icount;	
+		member = rcu_dereference( bus->members[ i ] );
 
-};
+		if (!member)
+			continue;
 
-/** 
- * This mutex locks the vb_comm_serial structure
-*/
-static struct mutex virtualbot_lock[ VIRTUALBOT_MAX_TTY_MINORS ];
+		member_link = &member->vb_comm_link;
 
-static struct virtualbot_serial *virtualbot_table[ VIRTUALBOT_MAX_TTY_MINORS ];	/* initially all NULL */
+		spin_lock_nest_lock( &member_link->lock, &bus->lock );
 
-static struct tty_port virtualbot_tty_port[ 2 * VIRTUALBOT_MAX_TTY_MINORS ];
+		/* a member that is not open is a node that is powered off */
+		if (rcu_dereference( member->virtualbot ))
+			room = min( room, virtualbot_link_capacity( member_link ) );
+	}
 
-/** 
- * The VirtualBot Commander structures
-*/
-static struct mutex vb_comm_lock[ VIRTUALBOT_MAX_TTY_MINORS ];
+	/* the members get a write up to the atomic size whole, or it waits */
+	if (virtualbot_link_must_wait( link, count, room ))
+		count = 0;
 
-static struct vb_comm_serial *vb_comm_table[ VIRTUALBOT_MAX_TTY_MINORS ];	/* initially all NULL */
+	count = min_t(size_t, count, room);
 
-static struct tty_port vb_comm_tty_port[ VIRTUALBOT_MAX_TTY_MINORS ];
+	for (i = 0; i < bus->slots; i++) {
 
-#ifdef TIMER_NOT_YET
-static void virtualbot_timer(struct timer_list *t)
-{
-	unsigned long virtualbot_index;
+		member = rcu_dereference( bus->members[ i ] );
 
-	struct virtualbot_serial *virtualbot_dev;
+		if (!member)
+			continue;
 
-	struct tty_struct *virtualbot_tty;
+		member_link = &member->vb_comm_link;
 
-	struct vb_comm_serial *vb_comm_dev;
+		/* one opened since its room was measured gets nothing it can't take */
+		if (count && rcu_dereference( member->virtualbot ) &&
+		    virtualbot_link_capacity( member_link ) >= count) {
+			virtualbot_latency_start( member_link );
+			virtualbot_link_queue( member_link, buffer, count );
+		}
 
-	virtualbot_dev = container_of(t, struct virtualbot_serial, timer);	
+		spin_unlock( &member_link->lock );
+	}
 
-	virtualbot_tty = virtualbot_dev->tty;	
+	spin_unlock_bh( &bus->lock );
 
-	if (virtualbot_tty != NULL){
-		// virtualbot is allocated
-		virtualbot_index = virtualbot_dev->index;
+	return count;
+}
 
-		pr_debug("virtualbot: timer index = %lu", 
-			virtualbot_index);
+/**
+ * Starts recording the traffic of a pair, one capture at a time
+ *
+ * The capture keeps a reference on the pair in '*pairp' until it is stopped.
+ */
+int virtualbot_pair_capture_start(unsigned int index,
+	struct virtualbot_capture *capture,
+	struct virtualbot_pair **pairp)
+{
+	struct virtualbot_pair *pair;
+	int retval = 0;
 
-		vb_comm_dev = vb_comm_table[ virtualbot_index ];
+	mutex_lock( &virtualbot_pairs_lock );
 
-		if (vb_comm_dev != NULL){
-			// vb_comm_dev is ready	
-			
-		} else {
-			pr_warn( "virtualbot: vb_comm device for tty %lu not set!", 
-				virtualbot_index );
-		}
+	pair = index < virtualbot_max_pairs ? virtualbot_pairs[ index ] : NULL;
 
+	if (!pair || pair->dead) {
+		retval = -ENODEV;
+	} else if (rcu_access_pointer( pair->capture )) {
+		retval = -EBUSY;
 	} else {
-		pr_err("virtualbot: virtualbot_tty not set!");
+		kref_get( &pair->kref );
+		rcu_assign_pointer( pair->capture, capture );
+		*pairp = pair;
 	}
 
-	/* resubmit the timer again */		
-	timer_setup(t, virtualbot_timer, 0);
+	mutex_unlock( &virtualbot_pairs_lock );
+
+	return retval;
+}
 
-	t->expires = jiffies + DELAY_TIME;
+void virtualbot_pair_capture_stop(struct virtualbot_pair *pair)
+{
+	mutex_lock( &virtualbot_pairs_lock );
+	RCU_INIT_POINTER( pair->capture, NULL );
+	mutex_unlock( &virtualbot_pairs_lock );
 
-	add_timer(t);
+	/* writers may still be recording */
+	synchronize_rcu();
 
-	//mod_timer(&tiny->timer, jiffies + msecs_to_jiffies(2000));
+	virtualbot_pair_put( pair );
 }
-#endif
 
-static int virtualbot_open(struct tty_struct *tty, struct file *file)
+/**
+ * Records what a write accepted, called under rcu_read_lock()
+ */
+static void virtualbot_pair_capture(struct virtualbot_pair *pair,
+	unsigned int direction,
+	unsigned int flags,
+	const unsigned char *buffer,
+	size_t count,
+	long accepted)
 {
-	struct virtualbot_serial *virtualbot;
-	int index;
+	struct virtualbot_capture *capture = rcu_dereference( pair->capture );
+
+	if (!capture || accepted <= 0)
+		return;
 
-	/* initialize the pointer in case something fails */
-	tty->driver_data = NULL;
+	if (accepted < count)
+		flags |= SERIALEMU_CAPTURE_SHORT;
+
+	virtualbot_capture_record( capture, direction, flags, buffer, accepted );
+}
 
-	/* get the serial object associated with this tty pointer */
-	index = tty->index;
-	virtualbot = virtualbot_table[index];
+/**
+ * Link that carries a direction of a pair, SERIALEMU_TO_EXOGENOUS or
+ * SERIALEMU_TO_EMULATED
+ */
+struct virtualbot_link *virtualbot_pair_link(struct virtualbot_pair *pair,
+	unsigned int direction)
+{
+	if (direction == SERIALEMU_TO_EXOGENOUS)
+		return &pair->virtualbot_link;
 
-	pr_info("virtualbot: openning port %d ...", index);
+	return &pair->vb_comm_link;
+}
 
-	mutex_lock( &virtualbot_lock[ index ] );
+/**
+ * True while the port that receives a direction of a pair is open and the
+ * pair wasn't removed, must be called under rcu_read_lock()
+ */
+bool virtualbot_pair_receiving(struct virtualbot_pair *pair, unsigned int direction)
+{
+	if (READ_ONCE( pair->dead ))
+		return false;
 
-	if (virtualbot == NULL) {
-		/* first time accessing this device, let's create it */
-		virtualbot = kmalloc(sizeof(*virtualbot), GFP_KERNEL);
+	if (direction == SERIALEMU_TO_EXOGENOUS)
+		return rcu_dereference( pair->vb_comm );
 
-		if (!virtualbot)
-			return -ENOMEM;
+	return rcu_dereference( pair->virtualbot );
+}
 
-		virtualbot->index = index;
-			
-		virtualbot->open_count = 0;
+/**
+ * Link that carries the data written on a tty
+ */
+static struct virtualbot_link *virtualbot_tty_link(struct tty_struct *tty)
+{
+	if (tty->driver == virtualbot_tty_driver)
+		return &virtualbot_pair_of(tty)->virtualbot_link;
 
-		virtualbot_table[index] = virtualbot;
+	return &vb_comm_pair_of(tty)->vb_comm_link;
+}
+
+/**
+ * Link that delivers the data read on a tty
+ */
+static struct virtualbot_link *virtualbot_tty_rx_link(struct tty_struct *tty)
+{
+	if (tty->driver == virtualbot_tty_driver)
+		return &virtualbot_pair_of(tty)->vb_comm_link;
 
-#ifdef __MEM_LEAK_HERE__
-		/**
-		 *  Allocating receive buffer , 4 KiB default size
-		 * */
-		virtualbot_table[index]->recv_buffer.head = 0;
-		virtualbot_table[index]->recv_buffer.tail = 0;
+	return &vb_comm_pair_of(tty)->virtualbot_link;
+}
 
-		virtualbot_table[index]->recv_buffer.buf = kmalloc( 
-			sizeof(char) * 4096,
-			GFP_KERNEL );
-#endif		
+/**
+ * Binds a new tty to its pair, the reference is dropped in cleanup
+ */
+static int virtualbot_install(struct tty_driver *driver, struct tty_struct *tty)
+{
+	struct virtualbot_pair *pair;
+	struct tty_port *port;
+	int retval;
 
-		// pointer to the tty struct
-		virtualbot_table[index]->tty = tty;
+	pair = virtualbot_pair_get( tty->index );
 
-#ifdef NO_TIMER_YET
-		/* create our timer and submit it */
-		timer_setup(&virtualbot->timer, virtualbot_timer, 0);		
+	if (!pair)
+		return -ENODEV;
 
-		virtualbot->timer.expires = jiffies + DELAY_TIME;
+	if (driver == virtualbot_tty_driver)
+		port = &pair->virtualbot_port;
+	else
+		port = &pair->vb_comm_port;
 
-		add_timer(&virtualbot->timer);
-#endif		
+	retval = tty_port_install( port, driver, tty );
 
-	} else {
-		// Already set		
+	if (retval) {
+		virtualbot_pair_put( pair );
+		return retval;
 	}
 
-	/* save our structure within the tty structure */
-	tty->driver_data = virtualbot;
-	virtualbot->tty = tty;
+	/* up to 64 KiB per call, so a write up to the atomic size is never cut */
+	set_bit( TTY_NO_WRITE_SPLIT, &tty->flags );
+
+	return 0;
+}
+
+static void virtualbot_cleanup(struct tty_struct *tty)
+{
+	if (tty->driver == virtualbot_tty_driver)
+		virtualbot_pair_put( virtualbot_pair_of(tty) );
+	else
+		virtualbot_pair_put( vb_comm_pair_of(tty) );
+}
+
+
+/**
+ * Drives the DTR and RTS lines of one side
+ *
+ * The pair is wired like a null-modem cable: DTR shows up as DSR and DCD on
+ * the peer, RTS as CTS. Every change is counted in the peer's icount and
+ * wakes its TIOCMIWAIT sleepers.
+ *
+ * When DTR drops the peer loses its carrier and is hung up, unless it set
+ * CLOCAL; when DTR rises the peer's blocking opens go on.
+ */
+static void virtualbot_modem_update(struct virtualbot_pair *pair,
+	unsigned int *mcr,
+	struct async_icount *peer_icount,
+	struct tty_port *peer_port,
+	unsigned int set,
+	unsigned int clear)
+{
+	unsigned int changed, carrier;
+
+	spin_lock( &pair->modem_lock );
 
-	++virtualbot->open_count;
-	if (virtualbot->open_count == 1 ) {
-		/* this is the first time this port is opened */
-		/* do any hardware initialization needed here */
+	changed = *mcr;
+	*mcr = ( *mcr & ~clear ) | set;
+	changed ^= *mcr;
+	carrier = *mcr & MCR_DTR;
+
+	if (changed & MCR_DTR) {
+		peer_icount->dsr++;
+		peer_icount->dcd++;
 	}
 
-	mutex_unlock( &virtualbot_lock[ index ] );	
+	if (changed & MCR_RTS)
+		peer_icount->cts++;
 
-	pr_info("virtualbot: port %d openned", index);
+	spin_unlock( &pair->modem_lock );
 
-	return 0;
+	if (changed & (MCR_DTR | MCR_RTS))
+		wake_up_interruptible( &peer_port->delta_msr_wait );
+
+	if (!(changed & MCR_DTR))
+		return;
+
+	if (carrier)
+		wake_up_interruptible( &peer_port->open_wait );
+	else
+		tty_port_tty_hangup( peer_port, true );
 }
 
-static void do_close(struct virtualbot_serial *virtualbot)
+/**
+ * Same, for the side of 'tty'
+ */
+static void virtualbot_tty_modem_update(struct tty_struct *tty,
+	unsigned int set,
+	unsigned int clear)
 {
-	int index = virtualbot->tty->index;
+	struct virtualbot_pair *pair;
 
-	mutex_lock( &virtualbot_lock[ index ] );
+	if (tty->driver == virtualbot_tty_driver) {
+		pair = virtualbot_pair_of(tty);
 
-	if (!virtualbot->open_count) {
-		/* port was never opened */
-		goto exit;
+		virtualbot_modem_update( pair, &pair->virtualbot_mcr,
+			&pair->vb_comm_icount, &pair->vb_comm_port, set, clear );
+	} else {
+		pair = vb_comm_pair_of(tty);
+
+		virtualbot_modem_update( pair, &pair->vb_comm_mcr,
+			&pair->virtualbot_icount, &pair->virtualbot_port, set, clear );
 	}
+}
+
+/**
+ * MSR seen by a side, from the lines driven by its peer
+ */
+static unsigned int virtualbot_modem_status(unsigned int peer_mcr)
+{
+	return ((peer_mcr & MCR_DTR) ? MSR_DSR | MSR_CD : 0) |
+		((peer_mcr & MCR_RTS) ? MSR_CTS : 0);
+}
 
-	--virtualbot->open_count;
-	if (virtualbot->open_count <= 0) {
+static bool virtualbot_modem_changed(struct virtualbot_pair *pair,
+	const struct async_icount *icount,
+	const struct async_icount *prev,
+	unsigned long arg)
+{
+	bool changed;
+
+	spin_lock( &pair->modem_lock );
+
+	changed = ((arg & TIOCM_RNG) && (icount->rng != prev->rng)) ||
+		((arg & TIOCM_DSR) && (icount->dsr != prev->dsr)) ||
+		((arg & TIOCM_CD)  && (icount->dcd != prev->dcd)) ||
+		((arg & TIOCM_CTS) && (icount->cts != prev->cts));
+
+	spin_unlock( &pair->modem_lock );
+
+	return changed;
+}
+
+/**
+ * TIOCMIWAIT: sleeps until one of the 'arg' lines seen by a side changes
+ *
+ * Returns -EIO when the pair is removed meanwhile.
+ */
+static int virtualbot_modem_wait(struct tty_struct *tty,
+	struct virtualbot_pair *pair,
+	const struct async_icount *icount,
+	unsigned long arg)
+{
+	struct async_icount prev;
+	int retval;
+
+	spin_lock( &pair->modem_lock );
+	prev = *icount;
+	spin_unlock( &pair->modem_lock );
+
+	retval = wait_event_interruptible( tty->port->delta_msr_wait,
+		READ_ONCE( pair->dead ) ||
+		virtualbot_modem_changed( pair, icount, &prev, arg ) );
 
-		pr_debug("virtualbot: last open port %d closed, freeing resources", index);
-		/* The port is being closed by the last user. */
-		/* Do any hardware specific stuff here */
+	if (retval)
+		return retval;
+
+	return READ_ONCE( pair->dead ) ? -EIO : 0;
+}
 
-		kfree( virtualbot_table[index] ) ;
+/**
+ * Called by tty_port_open() on the first open of the EmulatedPort
+ */
+static int virtualbot_port_activate(struct tty_port *port, struct tty_struct *tty)
+{
+	struct virtualbot_pair *pair = container_of(port, struct virtualbot_pair, virtualbot_port);
+	struct virtualbot_serial *virtualbot = &pair->virtualbot_state;
+	int retval = 0;
 
-		virtualbot->open_count = 0;
+	mutex_lock( &pair->virtualbot_lock );
 
-		virtualbot_table[index] = NULL;
+	if (pair->dead) {
+		retval = -ENODEV;
+		goto exit;
 	}
+
+	/* allocated with the pair, opening a port never allocates */
+	virtualbot->index = tty->index;
+	virtualbot->tty = tty;
+
+	virtualbot_pacer_set_termios( &pair->virtualbot_link.pacer, &tty->termios );
+
+	/* the flip buffer was flushed on the last close */
+	virtualbot_latency_resync( &pair->vb_comm_link );
+
+	/* from here on the Exogenous side can write to us */
+	rcu_assign_pointer( pair->virtualbot, virtualbot );
+
+	/* what the Exogenous side wrote in the meantime */
+	virtualbot_store_peer( &pair->vb_comm_link, true );
+
 exit:
-	// pr_debug("virtualbot: do_close port %d finished", index);
-	mutex_unlock( &( virtualbot_lock[ index ] ) );
+	mutex_unlock( &pair->virtualbot_lock );
+
+	return retval;
+}
+
+/**
+ * Called by tty_port_close() on the last close, or on a hangup
+ *
+ * DTR and RTS were already lowered under HUPCL, which hung up the
+ * Exogenous side if it doesn't ignore the carrier.
+ */
+static void virtualbot_port_shutdown(struct tty_port *port)
+{
+	struct virtualbot_pair *pair = container_of(port, struct virtualbot_pair, virtualbot_port);
+
+	mutex_lock( &pair->virtualbot_lock );
+
+	virtualbot_store_peer( &pair->vb_comm_link, false );
+
+	RCU_INIT_POINTER( pair->virtualbot, NULL );
+
+	mutex_unlock( &pair->virtualbot_lock );
+}
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(6, 2, 0))
+static int virtualbot_port_carrier_raised(struct tty_port *port)
+#else
+static bool virtualbot_port_carrier_raised(struct tty_port *port)
+#endif
+{
+	struct virtualbot_pair *pair = container_of(port, struct virtualbot_pair, virtualbot_port);
+
+	return READ_ONCE( pair->vb_comm_mcr ) & MCR_DTR;
+}
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(6, 2, 0))
+static void virtualbot_port_dtr_rts(struct tty_port *port, int active)
+#else
+static void virtualbot_port_dtr_rts(struct tty_port *port, bool active)
+#endif
+{
+	struct virtualbot_pair *pair = container_of(port, struct virtualbot_pair, virtualbot_port);
+
+	/* the Exogenous side sees DSR, DCD and CTS follow */
+	virtualbot_modem_update( pair, &pair->virtualbot_mcr,
+		&pair->vb_comm_icount, &pair->vb_comm_port,
+		active ? MCR_DTR | MCR_RTS : 0,
+		active ? 0 : MCR_DTR | MCR_RTS );
+}
+
+static const struct tty_port_operations virtualbot_port_ops = {
+	.activate = virtualbot_port_activate,
+	.shutdown = virtualbot_port_shutdown,
+	.carrier_raised = virtualbot_port_carrier_raised,
+	.dtr_rts = virtualbot_port_dtr_rts,
+};
+
+static int virtualbot_open(struct tty_struct *tty, struct file *file)
+{
+	struct virtualbot_pair *pair = virtualbot_pair_of(tty);
+	int retval;
+
+	/* save our structure within the tty structure */
+	tty->driver_data = &pair->virtualbot_state;
+
+	/* activates the port on the first open, waits for DCD without CLOCAL */
+	retval = tty_port_open( &pair->virtualbot_port, tty, file );
+
+	trace_virtualbot_open( true, tty->index, pair->virtualbot_port.count );
+
+	return retval;
 }
 
 static void virtualbot_close(struct tty_struct *tty, struct file *file)
 {
-	struct virtualbot_serial *virtualbot = tty->driver_data;
+	struct virtualbot_pair *pair = virtualbot_pair_of(tty);
 
-	pr_debug("virtualbot: closing port %d ...", tty->index);
+	tty_port_close( &pair->virtualbot_port, tty, file );
 
-	if (virtualbot){
-		pr_debug("virtualbot: do_close port %d", tty->index);
-		do_close(virtualbot);
-		pr_debug("virtualbot: do_close port %d finished", tty->index);
-	}
+	trace_virtualbot_close( true, tty->index, pair->virtualbot_port.count );
+}
 
-	pr_debug("virtualbot: close port %d finished", tty->index);
+/**
+ * Hangup of either side: shuts the port down, whatever its open count
+ */
+static void virtualbot_hangup(struct tty_struct *tty)
+{
+	tty_port_hangup( tty->port );
 }
 
 
@@ -299,93 +1766,55 @@ static int virtualbot_write(struct tty_struct *tty,
 	int count)
 	
 #endif
-{	
-
-#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)) 
-	size_t i;
-#else
-	int i;
-#endif
-
-	int index;
-	
+{
+	struct virtualbot_pair *pair = virtualbot_pair_of(tty);
+	struct virtualbot_pair *master;
+	unsigned int flags = 0;
+	int index = tty->index;
 	int retval;
 
-	struct vb_comm_serial *vb_comm;
-	struct tty_struct *vb_comm_tty;
-	struct tty_port *vb_comm_port;
-	struct virtualbot_serial *virtualbot;	
-
-	virtualbot = tty->driver_data;
-
-	retval = -EINVAL;
-
-	index = tty->index;
-
-	//struct MAS_signal *new_MAS_signal;
-
-	mutex_lock(&virtualbot_lock[ index ]);
-
-	if (!virtualbot){
+	if (!tty->driver_data) {
 		pr_warn("virtualbot: %s driver data %d not set!", __func__, index);
-		retval = -ENODEV;
-		goto cleanup_virtualbot;
+		return -ENODEV;
 	}
 
-	if ( virtualbot->open_count == 0 ){
-		/* port was not opened */
-		pr_warn("virtualbot: %s - port %d not open!", __func__, index);
-		retval = -ENODEV;
-		goto cleanup_virtualbot;
-	}	
-
-	mutex_lock(&vb_comm_lock[ index ]);
-		
-	vb_comm = vb_comm_table[ index ];
-	if (vb_comm == NULL){
-		pr_warn("virtualbot: %s - vb_comm %d not set!", __func__, index);
-		retval = -ENODEV;
-		goto cleanup_vb_comm;
-	}
-
-	vb_comm_tty = vb_comm->tty;
-	if (vb_comm_tty == NULL ){
-		pr_warn("virtualbot: %s - vb_comm %d tty not set!", __func__, index);
-		retval = -ENODEV;
-		goto cleanup_vb_comm;
-	}
+	/* the Exogenous side is not locked, only looked at */
+	rcu_read_lock();
 
-	vb_comm_port = vb_comm_tty->port;
-	if (vb_comm_port == NULL){
-		pr_warn("virtualbot: %s - vb_comm %d port not set!", __func__, index);
-		retval = -ENODEV;
-		goto cleanup_vb_comm;
-	}
+	master = rcu_dereference( pair->bus_master );
 
-#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)) 
-	pr_debug("virtualbot: %s - writing %lu length of data", __func__, (long unsigned)count);
-#else
-	pr_debug("virtualbot: %s - writing %d length of data", __func__, count);
-#endif
+	if (READ_ONCE( pair->virtualbot_mcr ) & MCR_LOOP) {
+		/* straight into our own flip buffer, the Exogenous side sees nothing */
+		flags = SERIALEMU_CAPTURE_LOOP;
+		virtualbot_latency_start( &pair->vb_comm_link );
+		retval = virtualbot_link_transfer( &pair->vb_comm_link, buffer, count );
 
-	for ( i = 0; i < count; i++ ){
-		pr_debug("%02x ", buffer[i]);
+	} else if (master) {
+		/* a bus member answers to the master */
+		flags = SERIALEMU_CAPTURE_BUS;
 
-		tty_insert_flip_char( vb_comm_port, 
-			buffer[i],
-			TTY_NORMAL);
+		if (!rcu_dereference( master->vb_comm )) {
+			retval = -ENODEV;
+		} else {
+			virtualbot_latency_start( &master->virtualbot_link );
+			retval = virtualbot_link_transfer( &master->virtualbot_link, buffer, count );
+		}
 
+	} else if (!rcu_dereference( pair->vb_comm ) &&
+		   !virtualbot_store_active( &pair->virtualbot_link.store )) {
+		retval = -ENODEV;
+	} else {
+		/* held while the Exogenous port is closed, with a store policy */
+		virtualbot_latency_start( &pair->virtualbot_link );
+		retval = virtualbot_link_write( &pair->virtualbot_link, buffer, count );
 	}
 
-	tty_flip_buffer_push(vb_comm_port);
+	virtualbot_pair_capture( pair, SERIALEMU_TO_EXOGENOUS,
+		flags, buffer, count, retval );
 
-	retval = count;
+	rcu_read_unlock();
 
-cleanup_vb_comm:
-	mutex_unlock( &vb_comm_lock[ index ] );
-
-cleanup_virtualbot:
-	mutex_unlock(&virtualbot_lock[ index ]);			
+	trace_virtualbot_write( &pair->virtualbot_link, count, retval );
 
 	return retval;
 }
@@ -397,30 +1826,26 @@ static unsigned int virtualbot_write_room(struct tty_struct *tty)
 #endif
 {
 	struct virtualbot_serial *virtualbot = tty->driver_data;
-	unsigned int room = -EINVAL, 
-		index = tty->index;
-
-	pr_debug("virtualbot: %s", __func__);
+	struct virtualbot_pair *pair = virtualbot_pair_of(tty);
+	struct virtualbot_pair *master;
+	unsigned int room;
 
 	if (!virtualbot)
 		return -ENODEV;	
 
-	mutex_lock( &virtualbot_lock[ index ] );
-
-	if (!virtualbot->open_count) {
-		/* port was not opened */
-		goto exit;
-	}
+	rcu_read_lock();
 
-	/* calculate how much room is left in the device */
-	// room = 255;
+	master = rcu_dereference( pair->bus_master );
 
-	room = tty_buffer_space_avail( tty->port );
-
-exit:
-	mutex_unlock(&virtualbot_lock[ index ]);
+	/* what the link the write goes through would take */
+	if (READ_ONCE( pair->virtualbot_mcr ) & MCR_LOOP)
+		room = virtualbot_link_whole_room( &pair->vb_comm_link );
+	else if (master)
+		room = virtualbot_link_whole_room( &master->virtualbot_link );
+	else
+		room = virtualbot_link_room( &pair->virtualbot_link );
 
-	pr_debug("virtualbot: room = %u", room );
+	rcu_read_unlock();
 
 	return room;
 }
@@ -445,6 +1870,15 @@ static void virtualbot_set_termios(struct tty_struct *tty,
 
 	cflag = tty->termios.c_cflag;
 
+	/* the wire speed of this side follows its termios */
+	virtualbot_pacer_set_termios( &virtualbot_tty_link(tty)->pacer, &tty->termios );
+
+	/* like a UART, B0 hangs up the modem lines and leaving it raises them */
+	if (old_termios && (old_termios->c_cflag & CBAUD) && !C_BAUD(tty))
+		virtualbot_tty_modem_update( tty, 0, MCR_DTR | MCR_RTS );
+	else if (old_termios && !(old_termios->c_cflag & CBAUD) && C_BAUD(tty))
+		virtualbot_tty_modem_update( tty, MCR_DTR | MCR_RTS, 0 );
+
 	/* check that they really want us to change something */
 	if (old_termios) {
 		if ((cflag == old_termios->c_cflag) &&
@@ -519,22 +1953,18 @@ static void virtualbot_set_termios(struct tty_struct *tty,
 	pr_debug(" - baud rate = %d", tty_get_baud_rate(tty));
 }
 
-/* Our fake UART values */
-#define MCR_DTR		0x01
-#define MCR_RTS		0x02
-#define MCR_LOOP	0x04
-#define MSR_CTS		0x08
-#define MSR_CD		0x10
-#define MSR_RI		0x20
-#define MSR_DSR		0x40
-
 static int virtualbot_tiocmget(struct tty_struct *tty)
 {
-	struct virtualbot_serial *virtualbot = tty->driver_data;
+	struct virtualbot_pair *pair = virtualbot_pair_of(tty);
 
 	unsigned int result = 0;
-	unsigned int msr = virtualbot->msr;
-	unsigned int mcr = virtualbot->mcr;
+	unsigned int msr;
+	unsigned int mcr;
+
+	spin_lock( &pair->modem_lock );
+	mcr = pair->virtualbot_mcr;
+	msr = virtualbot_modem_status( (mcr & MCR_LOOP) ? mcr : pair->vb_comm_mcr );
+	spin_unlock( &pair->modem_lock );
 
 	result = ((mcr & MCR_DTR)  ? TIOCM_DTR  : 0) |	/* DTR is set */
 		((mcr & MCR_RTS)  ? TIOCM_RTS  : 0) |	/* RTS is set */
@@ -550,184 +1980,210 @@ static int virtualbot_tiocmget(struct tty_struct *tty)
 static int virtualbot_tiocmset(struct tty_struct *tty, unsigned int set,
 			 unsigned int clear)
 {
-	struct virtualbot_serial *virtualbot = tty->driver_data;
-	unsigned int mcr = virtualbot->mcr;
+	unsigned int mcr_set = 0;
+	unsigned int mcr_clear = 0;
 
 	if (set & TIOCM_RTS)
-		mcr |= MCR_RTS;
+		mcr_set |= MCR_RTS;
 	if (set & TIOCM_DTR)
-		mcr |= MCR_RTS;
+		mcr_set |= MCR_DTR;
+	if (set & TIOCM_LOOP)
+		mcr_set |= MCR_LOOP;
 
 	if (clear & TIOCM_RTS)
-		mcr &= ~MCR_RTS;
+		mcr_clear |= MCR_RTS;
 	if (clear & TIOCM_DTR)
-		mcr &= ~MCR_RTS;
+		mcr_clear |= MCR_DTR;
+	if (clear & TIOCM_LOOP)
+		mcr_clear |= MCR_LOOP;
+
+	/* set the new MCR value in the device, the peer sees it */
+	virtualbot_tty_modem_update( tty, mcr_set, mcr_clear );
+
+	/* a blocked writer has another buffer to wait for */
+	if ((mcr_set | mcr_clear) & MCR_LOOP)
+		tty_wakeup( tty );
 
-	/* set the new MCR value in the device */
-	virtualbot->mcr = mcr;
 	return 0;
 }
 
 static int virtualbot_proc_show(struct seq_file *m, void *v)
 {
+	struct virtualbot_pair *pair;
 	struct virtualbot_serial *virtualbot;
 	struct vb_comm_serial *vb_comm;
-	int i;
+	unsigned int i;
 
 	int emulated_port_open_count, vb_comm_open_count;
 
 	seq_printf(m, "VirtualBot Driver %s\n", DRIVER_VERSION);
+
+	mutex_lock( &virtualbot_pairs_lock );
 		
-	for (i = 0; i < VIRTUALBOT_MAX_TTY_MINORS; ++i) {
+	for (i = 0; i < virtualbot_max_pairs; ++i) {
+
+		pair = virtualbot_pairs[ i ];
+		if (pair == NULL)
+			continue;
 
-		mutex_lock( &virtualbot_lock[ i ] ) ;
+		mutex_lock( &pair->virtualbot_lock ) ;
 
-		virtualbot = virtualbot_table[i];
+		virtualbot = rcu_dereference_protected( pair->virtualbot,
+			lockdep_is_held( &pair->virtualbot_lock ) );
 		if (virtualbot == NULL){
 
-			mutex_unlock( &virtualbot_lock[ i ] ) ;
+			mutex_unlock( &pair->virtualbot_lock ) ;
 			continue;
 			
 		}
 
-		emulated_port_open_count = virtualbot->open_count;
+		emulated_port_open_count = pair->virtualbot_port.count;
 
-		mutex_unlock( &virtualbot_lock[ i ] ) ;
+		mutex_unlock( &pair->virtualbot_lock ) ;
 
-		seq_printf(m, "%s %d open (count = %d)\n",
+		seq_printf(m, "%s %u open (count = %d)\n",
 			VIRTUALBOT_TTY_NAME,
 			i, 
 			emulated_port_open_count);
 	}
 
-	for (i = 0; i < VIRTUALBOT_MAX_TTY_MINORS; ++i) {
+	for (i = 0; i < virtualbot_max_pairs; ++i) {
 
-		mutex_lock( &vb_comm_lock[ i ] ) ;
+		pair = virtualbot_pairs[ i ];
+		if (pair == NULL)
+			continue;
+
+		mutex_lock( &pair->vb_comm_lock ) ;
 
-		vb_comm = vb_comm_table[i];
+		vb_comm = rcu_dereference_protected( pair->vb_comm,
+			lockdep_is_held( &pair->vb_comm_lock ) );
 		if (vb_comm == NULL){
-			mutex_unlock( &vb_comm_lock[ i ] ) ;
+			mutex_unlock( &pair->vb_comm_lock ) ;
 			continue;
 		}
 
-		vb_comm_open_count = vb_comm->open_count;
+		vb_comm_open_count = pair->vb_comm_port.count;
 
-		mutex_unlock( &vb_comm_lock[ i ] ) ;
+		mutex_unlock( &pair->vb_comm_lock ) ;
 
-		seq_printf(m, "%s %d open (count = %d)\n", 
+		seq_printf(m, "%s %u open (count = %d)\n", 
 			VB_COMM_TTY_NAME,
 			i, 
 			vb_comm_open_count);
 	}
 
+	mutex_unlock( &virtualbot_pairs_lock );
+
 	return 0;
 }
 
-#define virtualbot_ioctl virtualbot_ioctl_tiocgserial
-
+#define virtualbot_ioctl virtualbot_ioctl_tiocmiwait
 static int virtualbot_ioctl(struct tty_struct *tty, unsigned int cmd,
 		      unsigned long arg)
 {
-	struct virtualbot_serial *virtualbot = tty->driver_data;
+	struct virtualbot_pair *pair = virtualbot_pair_of(tty);
+
+	if (cmd == TIOCMIWAIT)
+		return virtualbot_modem_wait( tty, pair, &pair->virtualbot_icount, arg );
 
-	if (cmd == TIOCGSERIAL) {
-		struct serial_struct tmp;
-
-		if (!arg)
-			return -EFAULT;
-
-		memset(&tmp, 0, sizeof(tmp));
-
-		tmp.type		= virtualbot->serial.type;
-		tmp.line		= virtualbot->serial.line;
-		tmp.port		= virtualbot->serial.port;
-		tmp.irq			= virtualbot->serial.irq;
-		tmp.flags		= ASYNC_SKIP_TEST | ASYNC_AUTO_IRQ;
-		tmp.xmit_fifo_size	= virtualbot->serial.xmit_fifo_size;
-		tmp.baud_base		= virtualbot->serial.baud_base;
-		tmp.close_delay		= 5*HZ;
-		tmp.closing_wait	= 30*HZ;
-		tmp.custom_divisor	= virtualbot->serial.custom_divisor;
-		tmp.hub6		= virtualbot->serial.hub6;
-		tmp.io_type		= virtualbot->serial.io_type;
-
-		if (copy_to_user((void __user *)arg, &tmp, sizeof(struct serial_struct)))
-			return -EFAULT;
-		return 0;
-	}
 	return -ENOIOCTLCMD;
 }
 #undef virtualbot_ioctl
 
-#define virtualbot_ioctl virtualbot_ioctl_tiocmiwait
-static int virtualbot_ioctl(struct tty_struct *tty, unsigned int cmd,
-		      unsigned long arg)
+/**
+ * TIOCGICOUNT for both sides: modem line changes and the traffic counters
+ *
+ * 'overrun' is the number of bytes this port refused to its peer, and
+ * 'buf_overrun' the number of writes it cut short.
+ */
+static int virtualbot_get_icount(struct tty_struct *tty,
+	struct serial_icounter_struct *icount)
 {
-	struct virtualbot_serial *virtualbot = tty->driver_data;
+	struct virtualbot_pair *pair;
+	struct async_icount *lines;
+	struct virtualbot_traffic sent, received;
 
-	if (cmd == TIOCMIWAIT) {
-		DECLARE_WAITQUEUE(wait, current);
-		struct async_icount cnow;
-		struct async_icount cprev;
-
-		cprev = virtualbot->icount;
-		while (1) {
-			add_wait_queue(&virtualbot->wait, &wait);
-			set_current_state(TASK_INTERRUPTIBLE);
-			schedule();
-			remove_wait_queue(&virtualbot->wait, &wait);
-
-			/* see if a signal woke us up */
-			if (signal_pending(current))
-				return -ERESTARTSYS;
-
-			cnow = virtualbot->icount;
-			if (cnow.rng == cprev.rng && cnow.dsr == cprev.dsr &&
-			    cnow.dcd == cprev.dcd && cnow.cts == cprev.cts)
-				return -EIO; /* no change => error */
-			if (((arg & TIOCM_RNG) && (cnow.rng != cprev.rng)) ||
-			    ((arg & TIOCM_DSR) && (cnow.dsr != cprev.dsr)) ||
-			    ((arg & TIOCM_CD)  && (cnow.dcd != cprev.dcd)) ||
-			    ((arg & TIOCM_CTS) && (cnow.cts != cprev.cts))) {
-				return 0;
-			}
-			cprev = cnow;
-		}
+	if (tty->driver == virtualbot_tty_driver) {
+		pair = virtualbot_pair_of(tty);
+		lines = &pair->virtualbot_icount;
+
+		virtualbot_stats_read( pair->virtualbot_link.stats, &sent );
+		virtualbot_stats_read( pair->vb_comm_link.stats, &received );
+	} else {
+		pair = vb_comm_pair_of(tty);
+		lines = &pair->vb_comm_icount;
 
+		virtualbot_stats_read( pair->vb_comm_link.stats, &sent );
+		virtualbot_stats_read( pair->virtualbot_link.stats, &received );
 	}
-	return -ENOIOCTLCMD;
+
+	spin_lock( &pair->modem_lock );
+
+	icount->cts = lines->cts;
+	icount->dsr = lines->dsr;
+	icount->rng = lines->rng;
+	icount->dcd = lines->dcd;
+
+	spin_unlock( &pair->modem_lock );
+
+	icount->rx = received.bytes;
+	icount->tx = sent.bytes;
+	icount->overrun = received.dropped + received.overrun_errors;
+	icount->buf_overrun = received.overruns;
+	icount->parity = received.parity_errors;
+	icount->frame = received.frame_errors;
+
+	return 0;
 }
-#undef virtualbot_ioctl
 
-#define virtualbot_ioctl virtualbot_ioctl_tiocgicount
-static int virtualbot_ioctl(struct tty_struct *tty, unsigned int cmd,
-		      unsigned long arg)
+/**
+ * TIOCGSERIAL for both sides
+ *
+ * There is no UART behind the ports, ASYNC_LOW_LATENCY is the only flag
+ * that changes anything. It is kept by the link that delivers to the port,
+ * so it holds across opens.
+ */
+static int virtualbot_get_serial(struct tty_struct *tty, struct serial_struct *ss)
 {
-	struct virtualbot_serial *virtualbot = tty->driver_data;
+	struct virtualbot_link *link = virtualbot_tty_rx_link( tty );
 
-	if (cmd == TIOCGICOUNT) {
-		struct async_icount cnow = virtualbot->icount;
-		struct serial_icounter_struct icount;
-
-		icount.cts	= cnow.cts;
-		icount.dsr	= cnow.dsr;
-		icount.rng	= cnow.rng;
-		icount.dcd	= cnow.dcd;
-		icount.rx	= cnow.rx;
-		icount.tx	= cnow.tx;
-		icount.frame	= cnow.frame;
-		icount.overrun	= cnow.overrun;
-		icount.parity	= cnow.parity;
-		icount.brk	= cnow.brk;
-		icount.buf_overrun = cnow.buf_overrun;
-
-		if (copy_to_user((void __user *)arg, &icount, sizeof(icount)))
-			return -EFAULT;
-		return 0;
-	}
+	ss->line = tty->index;
+	ss->flags = ASYNC_SKIP_TEST | ASYNC_AUTO_IRQ;
+	ss->xmit_fifo_size = READ_ONCE( link->atomic );
+	ss->close_delay = 5*HZ;
+	ss->closing_wait = 30*HZ;
+
+	if (READ_ONCE( link->low_latency ))
+		ss->flags |= ASYNC_LOW_LATENCY;
+
+	return 0;
+}
+
+/**
+ * TIOCSSERIAL for both sides, only the flags a user may change are taken
+ */
+static int virtualbot_set_serial(struct tty_struct *tty, struct serial_struct *ss)
+{
+	struct virtualbot_link *link = virtualbot_tty_rx_link( tty );
+
+	return virtualbot_link_set_latency( link, ss->flags & ASYNC_LOW_LATENCY,
+		READ_ONCE( link->cpu ) );
+}
+
+/**
+ * TCFLSH for both sides
+ *
+ * The tty layer already threw the received data away, the line discipline
+ * will never read it.
+ */
+static int virtualbot_ioctl_tcflsh(struct tty_struct *tty, unsigned long arg)
+{
+	if (arg == TCIFLUSH || arg == TCIOFLUSH)
+		virtualbot_latency_resync( virtualbot_tty_rx_link( tty ) );
+
+	/* the line discipline flushes its own buffer next */
 	return -ENOIOCTLCMD;
 }
-#undef virtualbot_ioctl
 
 /* the real virtualbot_ioctl function.  The above is done to get the small functions in the book */
 static int virtualbot_ioctl(struct tty_struct *tty, 
@@ -735,12 +2191,10 @@ static int virtualbot_ioctl(struct tty_struct *tty,
 	unsigned long arg)
 {
 	switch (cmd) {
-	case TIOCGSERIAL:
-		return virtualbot_ioctl_tiocgserial(tty, cmd, arg);
 	case TIOCMIWAIT:
 		return virtualbot_ioctl_tiocmiwait(tty, cmd, arg);
-	case TIOCGICOUNT:
-		return virtualbot_ioctl_tiocgicount(tty, cmd, arg);
+	case TCFLSH:
+		return virtualbot_ioctl_tcflsh(tty, arg);
 	}
 
 	return -ENOIOCTLCMD;
@@ -748,8 +2202,11 @@ static int virtualbot_ioctl(struct tty_struct *tty,
 
 
 static const struct tty_operations virtualbot_serial_ops = {
+	.install = virtualbot_install,
+	.cleanup = virtualbot_cleanup,
 	.open = virtualbot_open,
 	.close = virtualbot_close,
+	.hangup = virtualbot_hangup,
 	.write = virtualbot_write,
 	.write_room = virtualbot_write_room,
 	.set_termios = virtualbot_set_termios,
@@ -757,103 +2214,120 @@ static const struct tty_operations virtualbot_serial_ops = {
 	.tiocmget = virtualbot_tiocmget,
 	.tiocmset = virtualbot_tiocmset,
 	.ioctl = virtualbot_ioctl,
+	.get_icount = virtualbot_get_icount,
+	.get_serial = virtualbot_get_serial,
+	.set_serial = virtualbot_set_serial,
 };
 
 
-static int vb_comm_open(struct tty_struct *tty, struct file *file)
+/**
+ * Called by tty_port_open() on the first open of the Exogenous port
+ */
+static int vb_comm_port_activate(struct tty_port *port, struct tty_struct *tty)
 {
-	struct vb_comm_serial *vb_comm;
-	int index;
-
-	/* initialize the pointer in case something fails */
-	tty->driver_data = NULL;
+	struct virtualbot_pair *pair = container_of(port, struct virtualbot_pair, vb_comm_port);
+	struct vb_comm_serial *vb_comm = &pair->vb_comm_state;
+	int retval = 0;
 
-	/* get the serial object associated with this tty pointer */
-	index = tty->index;
-	vb_comm = vb_comm_table[ index ];
+	mutex_lock( &pair->vb_comm_lock );
 
-	pr_info("vb_comm: openning port %d ...", index );
+	if (pair->dead) {
+		retval = -ENODEV;
+		goto exit;
+	}
 
-	mutex_lock(&vb_comm_lock[ index ]);
+	/* allocated with the pair, opening a port never allocates */
+	vb_comm->tty = tty;
 
-	if (vb_comm == NULL) {
-		/* first time accessing this device, let's create it */
-		vb_comm = kmalloc(sizeof(*vb_comm), GFP_KERNEL);
+	virtualbot_pacer_set_termios( &pair->vb_comm_link.pacer, &tty->termios );
 
-		if (!vb_comm)
-			return -ENOMEM;
+	/* the flip buffer was flushed on the last close */
+	virtualbot_latency_resync( &pair->virtualbot_link );
 
-		// mutex_init(&vm_comm->mutex);
-		vb_comm->open_count = 0;
+	/* from here on the EmulatedPort side can write to us */
+	rcu_assign_pointer( pair->vb_comm, vb_comm );
 
-		vb_comm_table[index] = vb_comm;
+	/* what the EmulatedPort side wrote in the meantime */
+	virtualbot_store_peer( &pair->virtualbot_link, true );
 
-	} else {
-		// Port is already open
+exit:
+	mutex_unlock( &pair->vb_comm_lock );
 
-		//mutex_lock(&virtualbot_global_port_lock[ index ]);
-	}	
+	return retval;
+}
 
-	/* save our structure within the tty structure */
-	tty->driver_data = vb_comm;
-	vb_comm->tty = tty;
+/**
+ * Called by tty_port_close() on the last close, or on a hangup
+ */
+static void vb_comm_port_shutdown(struct tty_port *port)
+{
+	struct virtualbot_pair *pair = container_of(port, struct virtualbot_pair, vb_comm_port);
 
-	++vb_comm->open_count;
-	if (vb_comm->open_count == 1 ) {
-		/* this is the first time this port is opened */
-		/* do any hardware initialization needed here */
-	}
+	mutex_lock( &pair->vb_comm_lock );
 
-	mutex_unlock(&vb_comm_lock[ index ]);
+	virtualbot_store_peer( &pair->virtualbot_link, false );
 
-	pr_info("vb-comm: open port %d finished", index);
+	RCU_INIT_POINTER( pair->vb_comm, NULL );
 
-	return 0;
+	mutex_unlock( &pair->vb_comm_lock );
 }
 
-static void vb_comm_do_close(struct vb_comm_serial *vb_comm)
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(6, 2, 0))
+static int vb_comm_port_carrier_raised(struct tty_port *port)
+#else
+static bool vb_comm_port_carrier_raised(struct tty_port *port)
+#endif
 {
-	int index = vb_comm->tty->index;
+	struct virtualbot_pair *pair = container_of(port, struct virtualbot_pair, vb_comm_port);
 
-	mutex_lock( &vb_comm_lock[ index ] );
+	return READ_ONCE( pair->virtualbot_mcr ) & MCR_DTR;
+}
 
-	if ( vb_comm->open_count == 0) {
-		/* port was never opened */
-		goto exit;
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(6, 2, 0))
+static void vb_comm_port_dtr_rts(struct tty_port *port, int active)
+#else
+static void vb_comm_port_dtr_rts(struct tty_port *port, bool active)
+#endif
+{
+	struct virtualbot_pair *pair = container_of(port, struct virtualbot_pair, vb_comm_port);
 
-	}
+	/* the EmulatedPort side sees DSR, DCD and CTS follow */
+	virtualbot_modem_update( pair, &pair->vb_comm_mcr,
+		&pair->virtualbot_icount, &pair->virtualbot_port,
+		active ? MCR_DTR | MCR_RTS : 0,
+		active ? 0 : MCR_DTR | MCR_RTS );
+}
 
-	--vb_comm->open_count;
-	if (vb_comm->open_count <= 0) {
+static const struct tty_port_operations vb_comm_port_ops = {
+	.activate = vb_comm_port_activate,
+	.shutdown = vb_comm_port_shutdown,
+	.carrier_raised = vb_comm_port_carrier_raised,
+	.dtr_rts = vb_comm_port_dtr_rts,
+};
+
+static int vb_comm_open(struct tty_struct *tty, struct file *file)
+{
+	struct virtualbot_pair *pair = vb_comm_pair_of(tty);
+	int retval;
 
-		pr_debug("vb_comm: last open port %d closed, freeing resources", index);
-		/* The port is being closed by the last user. */
-		/* Do any hardware specific stuff here */
+	/* save our structure within the tty structure */
+	tty->driver_data = &pair->vb_comm_state;
 
-		kfree( vb_comm_table[index] ) ;
+	/* activates the port on the first open, waits for DCD without CLOCAL */
+	retval = tty_port_open( &pair->vb_comm_port, tty, file );
 
-		vb_comm_table[index] = NULL;
+	trace_virtualbot_open( false, tty->index, pair->vb_comm_port.count );
 
-		/* shut down our timer */
-		// del_timer(&virtualbot->timer);
-	}
-exit:
-	mutex_unlock( &vb_comm_lock[ index ] );
+	return retval;
 }
 
 static void vb_comm_close(struct tty_struct *tty, struct file *file)
 {
-	struct vb_comm_serial *vb_comm = tty->driver_data;
-
-	pr_info("vb_comm: closing port %d ...", tty->index);
+	struct virtualbot_pair *pair = vb_comm_pair_of(tty);
 
-	if (vb_comm){
-		pr_debug("vb_comm: do_close port %d", tty->index);
-		vb_comm_do_close(vb_comm);
-		pr_debug("vb_comm: do_close port %d finished", tty->index);
-	}
+	tty_port_close( &pair->vb_comm_port, tty, file );
 
-	pr_debug("vb_comm: close port %d finished", tty->index);
+	trace_virtualbot_close( false, tty->index, pair->vb_comm_port.count );
 }
 
 
@@ -866,9 +2340,8 @@ static unsigned int vb_comm_write_room(struct tty_struct *tty)
 	unsigned int room;
 
 	struct tty_port *port;
+	struct virtualbot_bus *bus;
 
-	pr_debug("vb_comm: %s", __func__ );	
-	
 	room = -ENODEV;
 
 	port = tty->port;
@@ -877,12 +2350,21 @@ static unsigned int vb_comm_write_room(struct tty_struct *tty)
 		goto exit;
 	}
 
-	room = tty_buffer_space_avail( tty->port );
+	rcu_read_lock();
 
-exit:
+	bus = rcu_dereference( vb_comm_pair_of(tty)->bus );
+
+	/* what the link the write goes through would take */
+	if (READ_ONCE( vb_comm_pair_of(tty)->vb_comm_mcr ) & MCR_LOOP)
+		room = virtualbot_link_whole_room( &vb_comm_pair_of(tty)->virtualbot_link );
+	else if (bus)
+		room = virtualbot_bus_room( bus );
+	else
+		room = virtualbot_link_room( &vb_comm_pair_of(tty)->vb_comm_link );
 
-	pr_debug("vb_comm: room = %u", room );
+	rcu_read_unlock();
 
+exit:
 	return room;
 
 }
@@ -907,133 +2389,207 @@ static int vb_comm_write(struct tty_struct *tty,
 	int count)
 	
 #endif
-{	
-
-#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)) 
-	size_t i;
-#else
-	int i;
-#endif
-
-	int index;
-	
+{
+	struct virtualbot_pair *pair = vb_comm_pair_of(tty);
+	struct virtualbot_bus *bus;
+	unsigned int flags = 0;
+	int index = tty->index;
 	int retval;
 
-	struct vb_comm_serial *vb_comm;
-	struct virtualbot_serial *virtualbot;
-	struct tty_struct *virtualbot_tty;
-	struct tty_port *virtualbot_port;
-
-	pr_debug("vb_comm: %s", __func__ );	
-
-	index = tty->index;
-	retval = -EINVAL;
-
-	mutex_lock( &vb_comm_lock[ index ] );
-
-	vb_comm = tty->driver_data;
-
-	if (!vb_comm){
+	if (!tty->driver_data) {
 		pr_warn("vb_comm: %s - virtualbot %d driver data not set!", __func__, index);		
-		retval = -ENODEV;
-		goto cleanup_vb_comm;
+		return -ENODEV;
 	}
 
-	if (vb_comm->open_count <= 0){
-		/* port was not opened */
-		pr_warn("vb_comm: %s - virtualbot %d not open!", __func__, index);		
+	/* the EmulatedPort side is not locked, only looked at */
+	rcu_read_lock();
+
+	bus = rcu_dereference( pair->bus );
+
+	if (READ_ONCE( pair->vb_comm_mcr ) & MCR_LOOP) {
+		/* straight into our own flip buffer, the EmulatedPort sees nothing */
+		flags = SERIALEMU_CAPTURE_LOOP;
+		virtualbot_latency_start( &pair->virtualbot_link );
+		retval = virtualbot_link_transfer( &pair->virtualbot_link, buffer, count );
+	} else if (bus) {
+		flags = SERIALEMU_CAPTURE_BUS;
+		retval = virtualbot_bus_write( bus, &pair->vb_comm_link, buffer, count );
+	} else if (!rcu_dereference( pair->virtualbot ) &&
+		   !virtualbot_store_active( &pair->vb_comm_link.store )) {
 		retval = -ENODEV;
-		goto cleanup_vb_comm;
+	} else {
+		virtualbot_latency_start( &pair->vb_comm_link );
+		retval = virtualbot_link_write( &pair->vb_comm_link, buffer, count );
 	}
 
-	mutex_lock( &virtualbot_lock[ index ] );
+	virtualbot_pair_capture( pair, SERIALEMU_TO_EMULATED,
+		flags, buffer, count, retval );
 
-	virtualbot = virtualbot_table[ index ];
-	if (virtualbot == NULL){
-		pr_warn("vb_comm: %s - virtualbot %d not set!", __func__, index);
-		retval = -ENODEV;
-		goto cleanup_virtualbot;
-	}
+	rcu_read_unlock();
 
-	virtualbot_tty = virtualbot->tty;
-	if (virtualbot_tty == NULL){
-		pr_warn("vb_comm: %s - virtualbot %d tty not set!", __func__, index);
-		retval = -ENODEV;
-		goto cleanup_virtualbot;
-	}
+	trace_virtualbot_write( &pair->vb_comm_link, count, retval );
 
-	virtualbot_port = virtualbot_tty->port;
-	if (virtualbot_port == NULL){
-		pr_warn("vb_comm: %s - virtualbot %d port not set!", __func__, index);
-		retval = -ENODEV;
-		goto cleanup_virtualbot;
-	}
+	return retval;
+}
 
-#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)) 
-	pr_debug("vb-comm: %s - writing %lu length of data", __func__, (long unsigned)count);	
-#else
-	pr_debug("vb-comm: %s - writing %d length of data", __func__, count);	
-#endif
 
-	for ( i = 0; i < count; i++ ){
-		pr_debug("%02x ", buffer[i]);
+static int vb_comm_tiocmget(struct tty_struct *tty)
+{
+	struct virtualbot_pair *pair = vb_comm_pair_of(tty);
 
-		tty_insert_flip_char( virtualbot_port, 
-			buffer[i],
-			TTY_NORMAL );
-	}
+	unsigned int msr;
+	unsigned int mcr;
 
-	tty_flip_buffer_push( virtualbot_port );
+	spin_lock( &pair->modem_lock );
+	mcr = pair->vb_comm_mcr;
+	msr = virtualbot_modem_status( (mcr & MCR_LOOP) ? mcr : pair->virtualbot_mcr );
+	spin_unlock( &pair->modem_lock );
 
-	retval = count;
+	return ((mcr & MCR_DTR)  ? TIOCM_DTR  : 0) |	/* DTR is set */
+		((mcr & MCR_RTS)  ? TIOCM_RTS  : 0) |	/* RTS is set */
+		((mcr & MCR_LOOP) ? TIOCM_LOOP : 0) |	/* LOOP is set */
+		((msr & MSR_CTS)  ? TIOCM_CTS  : 0) |	/* CTS is set */
+		((msr & MSR_CD)   ? TIOCM_CAR  : 0) |	/* Carrier detect is set*/
+		((msr & MSR_DSR)  ? TIOCM_DSR  : 0);	/* DSR is set */
+}
 
-cleanup_virtualbot:
-	mutex_unlock( &virtualbot_lock[ index ] );
+static int vb_comm_ioctl(struct tty_struct *tty,
+	unsigned int cmd,
+	unsigned long arg)
+{
+	struct virtualbot_pair *pair = vb_comm_pair_of(tty);
 
-cleanup_vb_comm:
-	mutex_unlock( &vb_comm_lock[ index ] );	
+	switch (cmd) {
+	case TIOCMIWAIT:
+		return virtualbot_modem_wait( tty, pair, &pair->vb_comm_icount, arg );
+	case TCFLSH:
+		return virtualbot_ioctl_tcflsh( tty, arg );
+	}
 
-	return retval;
+	return -ENOIOCTLCMD;
 }
 
-
 static const struct tty_operations vb_comm_serial_ops = {
+	.install = virtualbot_install,
+	.cleanup = virtualbot_cleanup,
 	.open = vb_comm_open,
 	.close = vb_comm_close,
+	.hangup = virtualbot_hangup,
 	.write = vb_comm_write,
 	.write_room = vb_comm_write_room,
-	//.set_termios = virtualbot_set_termios,
+	.set_termios = virtualbot_set_termios,
 	//.proc_show = virtualbot_proc_show,
-	//.tiocmget = virtualbot_tiocmget,
-	//.tiocmset = virtualbot_tiocmset,
-	//.ioctl = virtualbot_ioctl,
+	.tiocmget = vb_comm_tiocmget,
+	.tiocmset = virtualbot_tiocmset,
+	.ioctl = vb_comm_ioctl,
+	.get_icount = virtualbot_get_icount,
+	.get_serial = virtualbot_get_serial,
+	.set_serial = virtualbot_set_serial,
 };
 
 
-static struct tty_driver *virtualbot_tty_driver;
+/**
+ * Registers the devices of every pair requested at load time
+ *
+ * Creating thousands of device nodes is by far the slowest part of loading
+ * the module, so it runs here instead of delaying virtualbot_init()
+ */
+static void virtualbot_register_pairs(struct work_struct *work)
+{
+	unsigned int i, added = 0;
+	int retval;
 
-static struct tty_driver *vb_comm_tty_driver;
+	for (i = 0; i < virtualbot_num_pairs; i++) {
+
+		if (READ_ONCE( virtualbot_unloading ))
+			break;
+
+		retval = virtualbot_pair_add( i );
+
+		/* already created through the control device, which is live by now */
+		if (retval == -EBUSY)
+			continue;
+
+		if (retval < 0) {
+			pr_err("virtualbot: failed to create pair %u (error %d)", i, retval);
+
+			/* the next ones would fail the same way */
+			if (retval == -ENOMEM)
+				break;
+
+			continue;
+		}
+
+		added++;
+
+		cond_resched();
+	}
+
+	pr_info("virtualbot: %u pairs registered in %lld us, %lu KiB of pair state",
+		added,
+		ktime_us_delta( ktime_get(), virtualbot_load_start ),
+		(long unsigned)( added * sizeof(struct virtualbot_pair) ) / 1024 );
+}
 
 static int __init virtualbot_init(void)
 {
 	int retval;
-	unsigned i;
+
+	virtualbot_load_start = ktime_get();
+
+	/* the default flip buffer client, plus the wakeup of the peer's writer */
+	virtualbot_client_ops = tty_port_default_client_ops;
+	virtualbot_client_ops.receive_buf = virtualbot_receive_buf;
+
+	vb_comm_client_ops = tty_port_default_client_ops;
+	vb_comm_client_ops.receive_buf = vb_comm_receive_buf;
+
+	if (virtualbot_max_pairs < virtualbot_num_pairs)
+		virtualbot_max_pairs = virtualbot_num_pairs;
+
+	if (virtualbot_max_pairs == 0 || virtualbot_max_pairs > VIRTUALBOT_MAX_PAIRS) {
+		pr_err("virtualbot: max_pairs must be between 1 and %d", VIRTUALBOT_MAX_PAIRS);
+		return -EINVAL;
+	}
+
+	retval = virtualbot_store_cache_init();
+
+	if (retval)
+		return retval;
+
+	retval = virtualbot_link_wq_init();
+
+	if (retval)
+		goto exit_store;
+
+	virtualbot_latency_debugfs_init();
+
+	virtualbot_pairs = kvcalloc( virtualbot_max_pairs,
+		sizeof(*virtualbot_pairs),
+		GFP_KERNEL );
+
+	if (!virtualbot_pairs) {
+		retval = -ENOMEM;
+		goto exit_wq;
+	}
 
 	/* allocate the tty driver */
 	//virtualbot_tty_driver = alloc_tty_driver(virtualbot_TTY_MINORS);
 
 	/*
 	 * Initializing the VirtialBot driver
-	 * 
+	 *
 	 * This is the main hardware emulation device
-	 * 
+	 *
 	*/
 
-	virtualbot_tty_driver = tty_alloc_driver( VIRTUALBOT_MAX_TTY_MINORS, \
-		TTY_DRIVER_REAL_RAW );
+	virtualbot_tty_driver = tty_alloc_driver( virtualbot_max_pairs, \
+		TTY_DRIVER_RESET_TERMIOS | TTY_DRIVER_REAL_RAW | TTY_DRIVER_DYNAMIC_DEV );
 
-	if (!virtualbot_tty_driver)
-		return -ENOMEM;
+	if (IS_ERR(virtualbot_tty_driver)) {
+		retval = PTR_ERR(virtualbot_tty_driver);
+		goto free_pairs;
+	}
 
 	/* initialize the tty driver */
 	virtualbot_tty_driver->owner = THIS_MODULE;
@@ -1048,65 +2604,45 @@ static int __init virtualbot_init(void)
 	virtualbot_tty_driver->init_termios.c_cflag = B9600 | CS8 | CREAD | HUPCL | CLOCAL;
 	virtualbot_tty_driver->init_termios.c_iflag = 0;
 	virtualbot_tty_driver->init_termios.c_oflag = 0;
-	
+
 	// Must be 0 to disable ECHO flag
 	virtualbot_tty_driver->init_termios.c_lflag = 0;
-	
+
 	//virtualbot_tty_driver->init_termios = tty_std_termios;
 	//virtualbot_tty_driver->init_termios.c_cflag = B38400 | CS8 | CREAD;
 	//virtualbot_tty_driver->init_termios.c_lflag = 0;
 	//virtualbot_tty_driver->init_termios.c_ispeed = 38400;
 	//virtualbot_tty_driver->init_termios.c_ospeed = 38400;
 
-	tty_set_operations(virtualbot_tty_driver, 
+	tty_set_operations(virtualbot_tty_driver,
 		&virtualbot_serial_ops);
 
 	pr_debug("virtualbot: set operations");
 
-	for (i = 0; i < VIRTUALBOT_MAX_TTY_MINORS; i++) {
-
-		tty_port_init( &virtualbot_tty_port[ i ]);
-		
-		pr_debug("virtualbot: port %i initiliazed", i);
-
-		tty_port_register_device( &virtualbot_tty_port[ i ], 
-			virtualbot_tty_driver, 
-			i, 
-			NULL);
-
-		pr_debug("virtualbot: port %i linked", i);
-
-		virtualbot_table[ i ] = NULL;
-		
-		mutex_init( &virtualbot_lock[ i ] );
-	}
-
 	/* register the tty driver */
 	retval = tty_register_driver(virtualbot_tty_driver);
 
 	if (retval) {
 		pr_err("virtualbot: failed to register virtualbot tty driver");
-
-		tty_driver_kref_put(virtualbot_tty_driver);
-
-		return retval;
+		goto put_virtualbot_driver;
 	}
-	
+
 	//pr_info("virtualbot: driver initialized (" DRIVER_DESC " " DRIVER_VERSION  ")" );
 
 	/*
-	 * 
+	 *
 	 * Initializing the VirtualBot Commander
-	 * 
+	 *
 	 * This is the main interface between
-	 * 
+	 *
 	*/
 
-	vb_comm_tty_driver = tty_alloc_driver( VIRTUALBOT_MAX_TTY_MINORS,
-		TTY_DRIVER_REAL_RAW );
+	vb_comm_tty_driver = tty_alloc_driver( virtualbot_max_pairs,
+		TTY_DRIVER_RESET_TERMIOS | TTY_DRIVER_REAL_RAW | TTY_DRIVER_DYNAMIC_DEV );
 
-	if (!vb_comm_tty_driver){
-		retval = -ENOMEM;
+	if (IS_ERR(vb_comm_tty_driver)) {
+		retval = PTR_ERR(vb_comm_tty_driver);
+		goto unregister_virtualbot_driver;
 	}
 
 	/* initialize the driver */
@@ -1121,144 +2657,139 @@ static int __init virtualbot_init(void)
 	vb_comm_tty_driver->init_termios = tty_std_termios;
 	vb_comm_tty_driver->init_termios.c_cflag = B9600 | CS8 | CREAD | HUPCL | CLOCAL;
 	vb_comm_tty_driver->init_termios.c_iflag = 0;
-	vb_comm_tty_driver->init_termios.c_oflag = 0;	
-	
+	vb_comm_tty_driver->init_termios.c_oflag = 0;
+
 	// Must be 0 to disable ECHO flag
-	vb_comm_tty_driver->init_termios.c_lflag = 0;	
+	vb_comm_tty_driver->init_termios.c_lflag = 0;
 
-	tty_set_operations(vb_comm_tty_driver, 
+	tty_set_operations(vb_comm_tty_driver,
 		&vb_comm_serial_ops);
 
 	pr_debug("vb-comm: set operations");
 
-	for (i = 0; i < VIRTUALBOT_MAX_TTY_MINORS; i++) {
+	/* register the tty driver */
+	retval = tty_register_driver(vb_comm_tty_driver);
 
-		tty_port_init(& vb_comm_tty_port[ i ] );
-		pr_debug("vb-comm: port %i initiliazed", i);
+	if (retval) {
+		pr_err("vb-comm: failed to register vb-comm tty driver");
+		goto put_vb_comm_driver;
+	}
 
-		tty_port_register_device( & vb_comm_tty_port[ i ], 
-			vb_comm_tty_driver, 
-			i, 
-			NULL);
-		pr_debug("vb-comm: port %i linked", i);
+	retval = virtualbot_ctl_init();
 
-		// Port state is initially NULL
-		vb_comm_table[ i ] = NULL;
-		
-		mutex_init( &vb_comm_lock[ i ] );
+	if (retval) {
+		pr_err("virtualbot: failed to register " SERIALEMU_CTL_NAME);
+		goto unregister_vb_comm_driver;
 	}
 
-
-	/* register the tty driver */
-	retval = tty_register_driver(vb_comm_tty_driver);
+	retval = virtualbot_capture_init();
 
 	if (retval) {
+		pr_err("virtualbot: failed to register " SERIALEMU_CAPTURE_NAME);
+		goto exit_ctl;
+	}
 
-		pr_err("vb-comm: failed to register vb-comm tty driver");
-
-		tty_driver_kref_put(vb_comm_tty_driver);
+	retval = virtualbot_replay_init();
 
-		return retval;
+	if (retval) {
+		pr_err("virtualbot: failed to register " SERIALEMU_REPLAY_NAME);
+		goto exit_capture;
 	}
 
+	/* device nodes are created in the background, see virtualbot_register_pairs() */
+	schedule_work( &virtualbot_register_work );
+
 	pr_info("Serial Port Emulator initialized (" DRIVER_DESC " " DRIVER_VERSION  ")" );
 
-	return retval;
-}
+	pr_info("virtualbot: loaded in %lld us, majors %d/%d, %u of %u pairs (%lu KiB, %lu KiB more per direction whose latency histogram is read)",
+		ktime_us_delta( ktime_get(), virtualbot_load_start ),
+		virtualbot_tty_driver->major,
+		vb_comm_tty_driver->major,
+		virtualbot_num_pairs,
+		virtualbot_max_pairs,
+		(long unsigned)( virtualbot_num_pairs * sizeof(struct virtualbot_pair) +
+			virtualbot_max_pairs * sizeof(*virtualbot_pairs) ) / 1024,
+		(long unsigned)DIV_ROUND_UP( virtualbot_latency_size(), 1024 ) );
 
-static void __exit virtualbot_exit(void)
-{
-	struct virtualbot_serial *virtualbot;
-	struct vb_comm_serial *vb_comm;
-	int i;
+	return 0;
 
-	// struct list_head *pos, *n;
+exit_capture:
+	virtualbot_capture_exit();
 
-	for (i = 0; i < VIRTUALBOT_MAX_TTY_MINORS; ++i) {
-		
-		tty_unregister_device(virtualbot_tty_driver, i);
-		
-		pr_debug("virtualbot: device %d unregistered" , i);
+exit_ctl:
+	virtualbot_ctl_exit();
 
-		tty_port_destroy(virtualbot_tty_port + i);
+unregister_vb_comm_driver:
+	tty_unregister_driver(vb_comm_tty_driver);
 
-		pr_debug("virtualbot: port %i destroyed", i);
-	}
+put_vb_comm_driver:
+	tty_driver_kref_put(vb_comm_tty_driver);
 
+unregister_virtualbot_driver:
 	tty_unregister_driver(virtualbot_tty_driver);
 
+put_virtualbot_driver:
 	tty_driver_kref_put(virtualbot_tty_driver);
 
-	pr_debug("virtualbot: driver unregistered");
+free_pairs:
+	kvfree( virtualbot_pairs );
 
-	/* shut down all of the timers and free the memory */
-	for (i = 0; i < VIRTUALBOT_MAX_TTY_MINORS; i++) {
+exit_wq:
+	virtualbot_latency_debugfs_exit();
 
-		virtualbot = virtualbot_table[i];
+	virtualbot_link_wq_exit();
 
-		pr_debug("virtualbot: freeing VB %i", i);
+exit_store:
+	virtualbot_store_cache_exit();
 
-		if (virtualbot) {
-			/* close the port */
-			while (virtualbot->open_count)
-				do_close(virtualbot);
+	return retval;
+}
 
-			/* shut down our timer and free the memory */
-			del_timer(&virtualbot->timer);
+static void __exit virtualbot_exit(void)
+{
+	unsigned int i;
 
-			/* deallocate receive buffer */
-			kfree( virtualbot->recv_buffer.buf );
-			
-			/* destroy structure mutex */
-			mutex_destroy( &virtualbot_lock[ i ] );
-			
-			kfree(virtualbot);
-			virtualbot_table[i] = NULL;
-		}
+	/* stop the background registration, if it is still running */
+	WRITE_ONCE( virtualbot_unloading, true );
 
-	}
+	cancel_work_sync( &virtualbot_register_work );
 
-	/**
-	 * 
-	 * Unregistering The Comm part 
-	 * 
-	*/
+	virtualbot_replay_exit();
 
-	for (i = 0; i < VIRTUALBOT_MAX_TTY_MINORS; ++i) {
+	virtualbot_capture_exit();
 
-		tty_unregister_device(vb_comm_tty_driver, i);
-		
-		pr_debug("vb-comm: device %d unregistered" , i);
+	virtualbot_ctl_exit();
 
-		tty_port_destroy(vb_comm_tty_port + i);
+	/* no port can be open at this point, so every pair is released here */
+	for (i = 0; i < virtualbot_max_pairs; ++i)
+		if (virtualbot_pairs[ i ])
+			virtualbot_pair_remove( i );
 
-		pr_debug("vb-comm: port %i destroyed", i);
-	}
+	tty_unregister_driver(virtualbot_tty_driver);
+
+	tty_driver_kref_put(virtualbot_tty_driver);
+
+	pr_debug("virtualbot: driver unregistered");
+
+	/**
+	 *
+	 * Unregistering The Comm part
+	 *
+	*/
 
 	tty_unregister_driver(vb_comm_tty_driver);
 
 	tty_driver_kref_put(vb_comm_tty_driver);
 
-	// For future
-	for (i = 0; i < VIRTUALBOT_MAX_TTY_MINORS; i++) {
+	pr_debug("vb-comm: driver unregistered");
 
-		vb_comm = vb_comm_table[i];
+	kvfree( virtualbot_pairs );
 
-		pr_debug("vb-comm: freeing VB %i", i);
+	virtualbot_latency_debugfs_exit();
 
-		if (vb_comm) {
-			/* close thvirtualbote port */
-			while (vb_comm->open_count)
-				vb_comm_do_close(vb_comm);
-				
-			mutex_destroy( &vb_comm_lock[ i ] );
+	virtualbot_link_wq_exit();
 
-			/* shut down our timer and free the memory */
-			//del_timer(&virtualbot->timer);
-			kfree(vb_comm);
-			vb_comm_table[i] = NULL;
-		}
-	}
+	virtualbot_store_cache_exit();
 }
 
 module_init(virtualbot_init);
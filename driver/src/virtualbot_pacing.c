@@ -0,0 +1,308 @@
+/*
+ * VirtualBot TTY driver - baud rate emulation
+ *
+ * Copyright (C) 2023 Bruno Policarpo (bruno.freitas@cefet-rj.br)
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, version 2 of the License.
+ *
+ * When pacing is enabled, data written on one side is queued and delivered
+ * to the peer at the speed of a real serial line, as set by the writer's
+ * termios: one frame (start + data + parity + stop bits) per character.
+ *
+ * Each direction has its own hrtimer. On every tick the bytes that would
+ * have crossed the wire since the previous tick are moved to the peer in a
+ * single batch, so the CPU cost depends on the tick rate, not the baud rate.
+ */
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/kfifo.h>
+#include <linux/math64.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/tty.h>
+#include <linux/tty_flip.h>
+#include <linux/version.h>
+
+#include <virtualbot.h>
+#include <virtualbot_trace.h>
+
+/* Shortest interval between two deliveries, longer frames stretch it */
+static unsigned int virtualbot_pacing_tick_us = VIRTUALBOT_PACING_TICK_US;
+
+module_param_named(pacing_tick_us, virtualbot_pacing_tick_us, uint, 0644);
+MODULE_PARM_DESC(pacing_tick_us, "Minimum interval between paced deliveries, in microseconds");
+
+/* Serializes the allocation of the queues */
+static DEFINE_MUTEX(virtualbot_pacing_lock);
+
+/**
+ * Number of bits on the wire for each character: start + data + parity + stop
+ */
+static unsigned int virtualbot_frame_bits(tcflag_t cflag)
+{
+	unsigned int bits = 1;
+
+	switch (cflag & CSIZE) {
+	case CS5:
+		bits += 5;
+		break;
+	case CS6:
+		bits += 6;
+		break;
+	case CS7:
+		bits += 7;
+		break;
+	default:
+	case CS8:
+		bits += 8;
+		break;
+	}
+
+	if (cflag & PARENB)
+		bits++;
+
+	bits += (cflag & CSTOPB) ? 2 : 1;
+
+	return bits;
+}
+
+static u64 virtualbot_pacer_period(struct virtualbot_pacer *pacer)
+{
+	u64 tick = (u64)READ_ONCE( virtualbot_pacing_tick_us ) * NSEC_PER_USEC;
+
+	return max( tick, pacer->ns_per_char );
+}
+
+static enum hrtimer_restart virtualbot_pacer_tick(struct hrtimer *timer)
+{
+	struct virtualbot_pacer *pacer = container_of(timer, struct virtualbot_pacer, timer);
+	struct virtualbot_link *link = container_of(pacer, struct virtualbot_link, pacer);
+	unsigned char *chunk, ch;
+	unsigned int budget, space, delivered = 0;
+	size_t inserted = 0, lost = 0, byte_inserted, byte_lost;
+	enum hrtimer_restart restart;
+	ktime_t now = ktime_get();
+	u64 period;
+
+	spin_lock( &pacer->lock );
+
+	pacer->credit_ns += ktime_to_ns( ktime_sub( now, pacer->last ) );
+	pacer->last = now;
+
+	budget = kfifo_len( &pacer->fifo );
+
+	if (pacer->ns_per_char)
+		budget = min_t(u64, budget, div64_u64( pacer->credit_ns, pacer->ns_per_char ));
+
+	spin_lock( &link->lock );
+
+	/* the faults are decided one byte at a time, as it leaves the queue */
+	if (virtualbot_fault_active( link )) {
+		while (delivered < budget && kfifo_peek( &pacer->fifo, &ch ) &&
+		       virtualbot_fault_deliver( link, &ch, 1, &byte_inserted, &byte_lost )) {
+			kfifo_skip( &pacer->fifo );
+			delivered++;
+			inserted += byte_inserted;
+			lost += byte_lost;
+		}
+
+	} else {
+		while (delivered < budget) {
+
+			space = tty_prepare_flip_string( link->port, &chunk, budget - delivered );
+
+			if (!space)
+				break;
+
+			delivered += kfifo_out( &pacer->fifo, chunk, space );
+		}
+
+		inserted = delivered;
+	}
+
+	if (inserted) {
+		virtualbot_link_push( link, inserted );
+
+		trace_virtualbot_push( link, inserted );
+
+		virtualbot_stats_account( link->stats, 0, inserted, 1, 0 );
+	}
+
+	if (lost)
+		virtualbot_stats_account_lost( link->stats, lost );
+
+	spin_unlock( &link->lock );
+
+	if (kfifo_is_empty( &pacer->fifo )) {
+		/* an idle line doesn't accumulate credit */
+		pacer->running = false;
+		pacer->credit_ns = 0;
+
+		restart = HRTIMER_NORESTART;
+
+	} else {
+		period = virtualbot_pacer_period( pacer );
+
+		pacer->credit_ns -= (u64)delivered * pacer->ns_per_char;
+
+		/* a full receiver doesn't let the line burst once it drains */
+		pacer->credit_ns = min( pacer->credit_ns, period );
+
+		hrtimer_forward_now( timer, ns_to_ktime( period ) );
+
+		restart = HRTIMER_RESTART;
+	}
+
+	spin_unlock( &pacer->lock );
+
+	/* room was freed for the writer, the framer writes through the pacer's lock */
+	if (delivered)
+		virtualbot_link_wakeup( link );
+
+	return restart;
+}
+
+/**
+ * The pacer must be embedded in a virtualbot_link, it delivers to its port
+ */
+void virtualbot_pacer_init(struct virtualbot_pacer *pacer)
+{
+	spin_lock_init( &pacer->lock );
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0))
+	hrtimer_setup( &pacer->timer, virtualbot_pacer_tick,
+		CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT );
+#else
+	hrtimer_init( &pacer->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT );
+	pacer->timer.function = virtualbot_pacer_tick;
+#endif
+}
+
+void virtualbot_pacer_destroy(struct virtualbot_pacer *pacer)
+{
+	hrtimer_cancel( &pacer->timer );
+
+	if (pacer->allocated)
+		kfifo_free( &pacer->fifo );
+}
+
+/**
+ * Takes the character time from the termios of the writing side
+ *
+ * B0 (or an unknown speed) disables the pacing of that direction
+ */
+void virtualbot_pacer_set_termios(struct virtualbot_pacer *pacer,
+	const struct ktermios *termios)
+{
+	speed_t baud = tty_termios_baud_rate( termios );
+	u64 ns_per_char = 0;
+
+	if (baud)
+		ns_per_char = div_u64( (u64)NSEC_PER_SEC * virtualbot_frame_bits( termios->c_cflag ),
+			baud );
+
+	spin_lock_bh( &pacer->lock );
+	pacer->ns_per_char = ns_per_char;
+	spin_unlock_bh( &pacer->lock );
+
+	pr_debug("virtualbot: pacing at %u baud, %llu ns per character",
+		baud, ns_per_char);
+}
+
+int virtualbot_pacer_enable(struct virtualbot_pacer *pacer, bool enable)
+{
+	int retval = 0;
+
+	mutex_lock( &virtualbot_pacing_lock );
+
+	if (enable && !pacer->allocated) {
+
+		retval = kfifo_alloc( &pacer->fifo, VIRTUALBOT_PACING_FIFO_SIZE, GFP_KERNEL );
+
+		if (retval)
+			goto exit;
+
+		pacer->allocated = true;
+	}
+
+	/*
+	 * Data already queued is still delivered at the old pace, the writer
+	 * keeps using the queue until it is empty
+	 */
+	spin_lock_bh( &pacer->lock );
+	pacer->enabled = enable;
+	spin_unlock_bh( &pacer->lock );
+
+exit:
+	mutex_unlock( &virtualbot_pacing_lock );
+
+	return retval;
+}
+
+/**
+ * True when written data must go through the queue
+ */
+bool virtualbot_pacer_active(struct virtualbot_pacer *pacer)
+{
+	return READ_ONCE( pacer->enabled ) || READ_ONCE( pacer->running );
+}
+
+/**
+ * Queues data for paced delivery, returns the number of bytes accepted
+ */
+size_t virtualbot_pacer_write(struct virtualbot_pacer *pacer,
+	const unsigned char *buffer,
+	size_t count)
+{
+	struct virtualbot_link *link = container_of(pacer, struct virtualbot_link, pacer);
+	size_t queued = 0;
+
+	spin_lock_bh( &pacer->lock );
+
+	/* a write up to the atomic size is queued whole, or waits */
+	if (virtualbot_link_must_wait( link, count, kfifo_avail( &pacer->fifo ) ))
+		goto unlock;
+
+	queued = kfifo_in( &pacer->fifo, buffer, min_t(size_t, count, UINT_MAX) );
+
+	if (queued && !pacer->running) {
+
+		pacer->running = true;
+		pacer->last = ktime_get();
+
+		/* the first character takes one frame time to get there */
+		hrtimer_start_range_ns( &pacer->timer,
+			ns_to_ktime( virtualbot_pacer_period( pacer ) ),
+			virtualbot_pacer_period( pacer ) / 4,
+			HRTIMER_MODE_REL_SOFT );
+	}
+
+	if (queued < count)
+		trace_virtualbot_drop( link, count - queued );
+
+	/* delivered bytes are counted by the timer */
+	virtualbot_stats_account( link->stats, 1, 0, 0, count - queued );
+
+unlock:
+	spin_unlock_bh( &pacer->lock );
+
+	return queued;
+}
+
+unsigned int virtualbot_pacer_room(struct virtualbot_pacer *pacer)
+{
+	unsigned int room;
+
+	spin_lock_bh( &pacer->lock );
+	room = kfifo_avail( &pacer->fifo );
+	spin_unlock_bh( &pacer->lock );
+
+	return room;
+}
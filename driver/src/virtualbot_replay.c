@@ -0,0 +1,476 @@
+/*
+ * VirtualBot TTY driver - traffic replay
+ *
+ * Copyright (C) 2023 Bruno Policarpo (bruno.freitas@cefet-rj.br)
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, version 2 of the License.
+ *
+ * Every open of /dev/serialemu-replay can play recorded traffic into one
+ * pair. Records (struct serialemu_capture_record followed by the data, the
+ * same as in a capture ring) are written to the file and queued, then an
+ * hrtimer delivers each one to the receiving port at its recorded time,
+ * optionally scaled by a speed factor.
+ *
+ * Each replay has its own timer, so pairs replay in parallel without
+ * sharing anything. Records for a port that is closed, or a pair that was
+ * removed, are dropped when their time comes and counted like an overrun.
+ */
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/hrtimer.h>
+#include <linux/kfifo.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/miscdevice.h>
+#include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/rcupdate.h>
+#include <linux/sched/signal.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/uaccess.h>
+#include <linux/version.h>
+#include <linux/wait.h>
+
+#include <virtualbot.h>
+#include <virtualbot_ioctl.h>
+
+struct virtualbot_replay {
+
+	/* Serializes start, write and release */
+	struct mutex mutex;
+
+	/* Record being queued by write(), under 'mutex' */
+	unsigned char staging[SERIALEMU_REPLAY_MAX_LENGTH];
+
+	/* Protects 'running', taken from the timer's softirq */
+	spinlock_t lock;
+
+	struct hrtimer timer;
+
+	/* Records waiting for their time, one writer and one reader */
+	DECLARE_KFIFO_PTR(fifo, unsigned char);
+
+	/* Writers wait here for room, fsync() for the end of the replay */
+	wait_queue_head_t wait;
+
+	/* Pair being replayed, referenced, NULL until started */
+	struct virtualbot_pair *pair;
+
+	u32 speed;
+
+	bool running;	/* timer armed */
+
+	/* Time of the first record, and when it was delivered */
+	bool started;
+	u64 first_timestamp;
+	ktime_t first_time;
+
+	/* Record being delivered, it may take several ticks on a full port */
+	bool pending;
+	struct serialemu_capture_record record;
+	size_t done;
+	unsigned char data[SERIALEMU_REPLAY_MAX_LENGTH];
+};
+
+/**
+ * When a record must be delivered, according to its timestamp and the speed
+ */
+static ktime_t virtualbot_replay_due(struct virtualbot_replay *replay, ktime_t now)
+{
+	u64 offset;
+
+	if (!replay->started) {
+		replay->started = true;
+		replay->first_timestamp = replay->record.timestamp;
+		replay->first_time = now;
+	}
+
+	/* as fast as possible, or a recording that went back in time */
+	if (replay->speed == SERIALEMU_REPLAY_ASAP ||
+	    replay->record.timestamp < replay->first_timestamp)
+		return now;
+
+	offset = replay->record.timestamp - replay->first_timestamp;
+
+	if (replay->speed != SERIALEMU_REPLAY_REALTIME)
+		offset = mul_u64_u32_div( offset, SERIALEMU_REPLAY_REALTIME, replay->speed );
+
+	return ktime_add_ns( replay->first_time, offset );
+}
+
+/**
+ * Takes the next complete record off the queue
+ */
+static bool virtualbot_replay_next(struct virtualbot_replay *replay)
+{
+	struct serialemu_capture_record record;
+
+	if (kfifo_out_peek( &replay->fifo, (unsigned char *)&record, sizeof(record) ) < sizeof(record))
+		return false;
+
+	/* the writer queues the header before the data */
+	if (kfifo_len( &replay->fifo ) < sizeof(record) + record.length)
+		return false;
+
+	kfifo_out( &replay->fifo, (unsigned char *)&replay->record, sizeof(record) );
+	kfifo_out( &replay->fifo, replay->data, record.length );
+
+	replay->done = 0;
+	replay->pending = true;
+
+	return true;
+}
+
+static enum hrtimer_restart virtualbot_replay_tick(struct hrtimer *timer)
+{
+	struct virtualbot_replay *replay = container_of(timer, struct virtualbot_replay, timer);
+	struct virtualbot_link *link;
+	unsigned int batch = 0;
+	ktime_t now = ktime_get(), due;
+
+	spin_lock( &replay->lock );
+
+	for (;;) {
+
+		if (!replay->pending) {
+
+			if (!virtualbot_replay_next( replay )) {
+				replay->running = false;
+				break;
+			}
+
+			/* room was freed for the writer */
+			wake_up_interruptible( &replay->wait );
+		}
+
+		due = virtualbot_replay_due( replay, now );
+
+		if (ktime_after( due, now )) {
+			hrtimer_set_expires( timer, due );
+			break;
+		}
+
+		/* don't hog the softirq when running flat out */
+		if (++batch > VIRTUALBOT_REPLAY_BATCH) {
+			hrtimer_set_expires( timer, now );
+			break;
+		}
+
+		link = virtualbot_pair_link( replay->pair, replay->record.direction );
+
+		rcu_read_lock();
+
+		if (virtualbot_pair_receiving( replay->pair, replay->record.direction )) {
+			replay->done += virtualbot_link_transfer( link,
+				replay->data + replay->done,
+				replay->record.length - replay->done );
+		} else {
+			/* nobody reads it, and the next open must not get it */
+			virtualbot_stats_account( link->stats, 1, 0, 0,
+				replay->record.length - replay->done );
+
+			replay->done = replay->record.length;
+		}
+
+		rcu_read_unlock();
+
+		if (replay->done < replay->record.length) {
+			/* the receiver is full, try again later */
+			hrtimer_set_expires( timer,
+				ktime_add_us( now, VIRTUALBOT_REPLAY_RETRY_US ) );
+			break;
+		}
+
+		replay->pending = false;
+	}
+
+	if (!replay->running) {
+		spin_unlock( &replay->lock );
+
+		/* fsync() waits for this */
+		wake_up_interruptible( &replay->wait );
+
+		return HRTIMER_NORESTART;
+	}
+
+	spin_unlock( &replay->lock );
+
+	return HRTIMER_RESTART;
+}
+
+/**
+ * Starts the timer if it is idle, after new records were queued
+ */
+static void virtualbot_replay_kick(struct virtualbot_replay *replay)
+{
+	spin_lock_bh( &replay->lock );
+
+	if (!replay->running) {
+		replay->running = true;
+		hrtimer_start( &replay->timer, 0, HRTIMER_MODE_REL_SOFT );
+	}
+
+	spin_unlock_bh( &replay->lock );
+}
+
+static long virtualbot_replay_start(struct virtualbot_replay *replay,
+	struct serialemu_replay __user *argp)
+{
+	struct serialemu_replay request;
+	struct virtualbot_pair *pair;
+	long retval = 0;
+
+	if (copy_from_user(&request, argp, sizeof(request)))
+		return -EFAULT;
+
+	mutex_lock( &replay->mutex );
+
+	if (replay->pair) {
+		retval = -EBUSY;
+		goto unlock;
+	}
+
+	pair = virtualbot_pair_get( request.index );
+
+	if (!pair) {
+		retval = -ENODEV;
+		goto unlock;
+	}
+
+	retval = kfifo_alloc( &replay->fifo, VIRTUALBOT_REPLAY_FIFO_SIZE, GFP_KERNEL );
+
+	if (retval) {
+		virtualbot_pair_put( pair );
+		goto unlock;
+	}
+
+	replay->speed = request.speed;
+	replay->pair = pair;
+
+unlock:
+	mutex_unlock( &replay->mutex );
+
+	return retval;
+}
+
+static long virtualbot_replay_ioctl(struct file *file, unsigned int cmd,
+	unsigned long arg)
+{
+	struct virtualbot_replay *replay = file->private_data;
+
+	switch (cmd) {
+	case SERIALEMU_IOC_REPLAY_START:
+		return virtualbot_replay_start( replay, (void __user *)arg );
+	}
+
+	return -ENOTTY;
+}
+
+/**
+ * Queues whole records, blocks while the queue is full
+ *
+ * Returns the number of bytes queued, a record is never queued in part.
+ */
+static ssize_t virtualbot_replay_write(struct file *file,
+	const char __user *buffer,
+	size_t count,
+	loff_t *ppos)
+{
+	struct virtualbot_replay *replay = file->private_data;
+	struct serialemu_capture_record record;
+	size_t done = 0, need;
+	ssize_t retval = 0;
+
+	mutex_lock( &replay->mutex );
+
+	if (!replay->pair) {
+		retval = -EINVAL;
+		goto unlock;
+	}
+
+	while (count - done >= sizeof(record)) {
+
+		if (copy_from_user(&record, buffer + done, sizeof(record))) {
+			retval = -EFAULT;
+			break;
+		}
+
+		if (record.length > SERIALEMU_REPLAY_MAX_LENGTH ||
+		    ( record.direction != SERIALEMU_TO_EXOGENOUS &&
+		      record.direction != SERIALEMU_TO_EMULATED )) {
+			retval = -EINVAL;
+			break;
+		}
+
+		need = sizeof(record) + record.length;
+
+		if (count - done < need)
+			break;
+
+		if (record.flags & SERIALEMU_CAPTURE_PAD) {
+			done += need;
+			continue;
+		}
+
+		if (kfifo_avail( &replay->fifo ) < need) {
+
+			if (done)
+				break;
+
+			if (file->f_flags & O_NONBLOCK) {
+				retval = -EAGAIN;
+				break;
+			}
+
+			retval = wait_event_interruptible( replay->wait,
+				kfifo_avail( &replay->fifo ) >= need );
+
+			if (retval)
+				break;
+		}
+
+		/* a record is only queued once all of it was copied */
+		if (copy_from_user(replay->staging, buffer + done + sizeof(record),
+				record.length)) {
+			retval = -EFAULT;
+			break;
+		}
+
+		kfifo_in( &replay->fifo, (unsigned char *)&record, sizeof(record) );
+		kfifo_in( &replay->fifo, replay->staging, record.length );
+
+		done += need;
+
+		virtualbot_replay_kick( replay );
+	}
+
+	/* half a record at the end is left to the next write */
+	if (done)
+		retval = done;
+	else if (!retval)
+		retval = -EINVAL;
+
+unlock:
+	mutex_unlock( &replay->mutex );
+
+	return retval;
+}
+
+static bool virtualbot_replay_idle(struct virtualbot_replay *replay)
+{
+	bool idle;
+
+	spin_lock_bh( &replay->lock );
+	idle = !replay->running;
+	spin_unlock_bh( &replay->lock );
+
+	return idle;
+}
+
+/**
+ * Waits until every queued record was delivered
+ */
+static int virtualbot_replay_fsync(struct file *file, loff_t start, loff_t end,
+	int datasync)
+{
+	struct virtualbot_replay *replay = file->private_data;
+
+	return wait_event_interruptible( replay->wait, virtualbot_replay_idle( replay ) );
+}
+
+static __poll_t virtualbot_replay_poll(struct file *file, poll_table *wait)
+{
+	struct virtualbot_replay *replay = file->private_data;
+	__poll_t mask = 0;
+
+	if (!READ_ONCE( replay->pair ))
+		return 0;
+
+	poll_wait( file, &replay->wait, wait );
+
+	if (kfifo_avail( &replay->fifo ) >= sizeof(struct serialemu_capture_record) +
+			SERIALEMU_REPLAY_MAX_LENGTH)
+		mask |= EPOLLOUT | EPOLLWRNORM;
+
+	return mask;
+}
+
+static int virtualbot_replay_open(struct inode *inode, struct file *file)
+{
+	struct virtualbot_replay *replay;
+
+	replay = kzalloc(sizeof(*replay), GFP_KERNEL);
+
+	if (!replay)
+		return -ENOMEM;
+
+	mutex_init( &replay->mutex );
+	spin_lock_init( &replay->lock );
+	init_waitqueue_head( &replay->wait );
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0))
+	hrtimer_setup( &replay->timer, virtualbot_replay_tick,
+		CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT );
+#else
+	hrtimer_init( &replay->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT );
+	replay->timer.function = virtualbot_replay_tick;
+#endif
+
+	file->private_data = replay;
+
+	return 0;
+}
+
+/* What was not delivered yet is dropped */
+static int virtualbot_replay_release(struct inode *inode, struct file *file)
+{
+	struct virtualbot_replay *replay = file->private_data;
+
+	hrtimer_cancel( &replay->timer );
+
+	if (replay->pair) {
+		kfifo_free( &replay->fifo );
+		virtualbot_pair_put( replay->pair );
+	}
+
+	mutex_destroy( &replay->mutex );
+
+	kfree( replay );
+
+	return 0;
+}
+
+static const struct file_operations virtualbot_replay_fops = {
+	.owner = THIS_MODULE,
+	.open = virtualbot_replay_open,
+	.release = virtualbot_replay_release,
+	.write = virtualbot_replay_write,
+	.fsync = virtualbot_replay_fsync,
+	.poll = virtualbot_replay_poll,
+	.unlocked_ioctl = virtualbot_replay_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
+	.llseek = noop_llseek,
+};
+
+static struct miscdevice virtualbot_replay_device = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = SERIALEMU_REPLAY_NAME,
+	.fops = &virtualbot_replay_fops,
+	.mode = 0600,
+};
+
+int virtualbot_replay_init(void)
+{
+	return misc_register( &virtualbot_replay_device );
+}
+
+void virtualbot_replay_exit(void)
+{
+	misc_deregister( &virtualbot_replay_device );
+}
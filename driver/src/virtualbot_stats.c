@@ -0,0 +1,157 @@
+/*
+ * VirtualBot TTY driver - traffic counters
+ *
+ * Copyright (C) 2023 Bruno Policarpo (bruno.freitas@cefet-rj.br)
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, version 2 of the License.
+ *
+ * Each direction of a pair counts its traffic on the CPU that moves the
+ * data, without any shared cache line or lock. The copies are only added up
+ * when somebody reads them, through TIOCGICOUNT or sysfs.
+ */
+
+#include <linux/kernel.h>
+#include <linux/percpu.h>
+#include <linux/string.h>
+#include <linux/u64_stats_sync.h>
+
+#include <virtualbot.h>
+
+struct virtualbot_stats __percpu *virtualbot_stats_alloc(void)
+{
+	struct virtualbot_stats __percpu *stats;
+	int cpu;
+
+	stats = alloc_percpu( struct virtualbot_stats );
+
+	if (!stats)
+		return NULL;
+
+	for_each_possible_cpu(cpu)
+		u64_stats_init( &per_cpu_ptr( stats, cpu )->syncp );
+
+	return stats;
+}
+
+/**
+ * Counts what happened to 'writes' write calls on this CPU
+ *
+ * 'bytes' reached the receiving flip buffer with 'pushes' pushes, 'dropped'
+ * bytes were refused by the receiver. Must be called with bottom halves
+ * disabled, the pacer updates the same counters from its timer.
+ */
+void virtualbot_stats_account(struct virtualbot_stats __percpu *stats,
+	unsigned int writes,
+	size_t bytes,
+	unsigned int pushes,
+	size_t dropped)
+{
+	struct virtualbot_stats *cpu_stats = this_cpu_ptr( stats );
+
+	u64_stats_update_begin( &cpu_stats->syncp );
+
+	u64_stats_add( &cpu_stats->writes, writes );
+	u64_stats_add( &cpu_stats->bytes, bytes );
+	u64_stats_add( &cpu_stats->pushes, pushes );
+
+	if (dropped) {
+		u64_stats_inc( &cpu_stats->overruns );
+		u64_stats_add( &cpu_stats->dropped, dropped );
+	}
+
+	u64_stats_update_end( &cpu_stats->syncp );
+}
+
+/**
+ * Counts the errors injected in the data on this CPU, with bottom halves
+ * disabled as well
+ */
+void virtualbot_stats_account_errors(struct virtualbot_stats __percpu *stats,
+	unsigned int parity,
+	unsigned int frame,
+	unsigned int overrun)
+{
+	struct virtualbot_stats *cpu_stats = this_cpu_ptr( stats );
+
+	u64_stats_update_begin( &cpu_stats->syncp );
+
+	u64_stats_add( &cpu_stats->parity_errors, parity );
+	u64_stats_add( &cpu_stats->frame_errors, frame );
+	u64_stats_add( &cpu_stats->overrun_errors, overrun );
+
+	u64_stats_update_end( &cpu_stats->syncp );
+}
+
+/**
+ * Counts bytes the line lost on the way, with bottom halves disabled as
+ * well: they are dropped, but no buffer overran
+ */
+void virtualbot_stats_account_lost(struct virtualbot_stats __percpu *stats,
+	size_t lost)
+{
+	struct virtualbot_stats *cpu_stats = this_cpu_ptr( stats );
+
+	u64_stats_update_begin( &cpu_stats->syncp );
+	u64_stats_add( &cpu_stats->dropped, lost );
+	u64_stats_update_end( &cpu_stats->syncp );
+}
+
+/**
+ * Counts the malformed frames seen by the framer, with bottom halves disabled
+ */
+void virtualbot_stats_account_malformed(struct virtualbot_stats __percpu *stats,
+	unsigned int frames)
+{
+	struct virtualbot_stats *cpu_stats = this_cpu_ptr( stats );
+
+	u64_stats_update_begin( &cpu_stats->syncp );
+	u64_stats_add( &cpu_stats->malformed_frames, frames );
+	u64_stats_update_end( &cpu_stats->syncp );
+}
+
+/**
+ * Adds up the counters of every CPU
+ */
+void virtualbot_stats_read(struct virtualbot_stats __percpu *stats,
+	struct virtualbot_traffic *traffic)
+{
+	struct virtualbot_stats *cpu_stats;
+	u64 bytes, writes, pushes, overruns, dropped;
+	u64 parity_errors, frame_errors, overrun_errors, malformed_frames;
+	unsigned int start;
+	int cpu;
+
+	memset( traffic, 0, sizeof(*traffic) );
+
+	for_each_possible_cpu(cpu) {
+
+		cpu_stats = per_cpu_ptr( stats, cpu );
+
+		do {
+			start = u64_stats_fetch_begin( &cpu_stats->syncp );
+
+			bytes = u64_stats_read( &cpu_stats->bytes );
+			writes = u64_stats_read( &cpu_stats->writes );
+			pushes = u64_stats_read( &cpu_stats->pushes );
+			overruns = u64_stats_read( &cpu_stats->overruns );
+			dropped = u64_stats_read( &cpu_stats->dropped );
+			parity_errors = u64_stats_read( &cpu_stats->parity_errors );
+			frame_errors = u64_stats_read( &cpu_stats->frame_errors );
+			overrun_errors = u64_stats_read( &cpu_stats->overrun_errors );
+			malformed_frames = u64_stats_read( &cpu_stats->malformed_frames );
+
+		} while (u64_stats_fetch_retry( &cpu_stats->syncp, start ));
+
+		traffic->bytes += bytes;
+		traffic->writes += writes;
+		traffic->pushes += pushes;
+		traffic->overruns += overruns;
+		traffic->dropped += dropped;
+		traffic->parity_errors += parity_errors;
+		traffic->frame_errors += frame_errors;
+		traffic->overrun_errors += overrun_errors;
+		traffic->malformed_frames += malformed_frames;
+	}
+}
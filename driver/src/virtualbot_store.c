@@ -0,0 +1,407 @@
+/*
+ * VirtualBot TTY driver - store-and-forward while the peer is closed
+ *
+ * Copyright (C) 2023 Bruno Policarpo (bruno.freitas@cefet-rj.br)
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, version 2 of the License.
+ *
+ * When a store policy is set, data written while the receiving port is
+ * closed is kept in a queue of chunks instead of failing with -ENODEV, and
+ * delivered in order once the port is opened.
+ *
+ * The chunks come from their own slab cache. Each direction is bounded by
+ * its own limit, and all the queues together by the 'store_budget' module
+ * parameter, so a writer with nobody listening can't exhaust kernel memory.
+ */
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/atomic.h>
+#include <linux/list.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/tty.h>
+
+#include <virtualbot.h>
+#include <virtualbot_ioctl.h>
+
+struct virtualbot_store_chunk {
+	struct list_head list;
+	unsigned int start;
+	unsigned int length;
+	unsigned char data[VIRTUALBOT_STORE_CHUNK_SIZE];
+};
+
+/* Memory all the queues may use together, in bytes */
+static unsigned long virtualbot_store_budget = VIRTUALBOT_STORE_BUDGET;
+
+module_param_named(store_budget, virtualbot_store_budget, ulong, 0644);
+MODULE_PARM_DESC(store_budget, "Memory for the data held while a port is closed, in bytes, for all pairs");
+
+/* Memory used by all the queues */
+static atomic_long_t virtualbot_store_used = ATOMIC_LONG_INIT(0);
+
+static struct kmem_cache *virtualbot_store_cache;
+
+/**
+ * Takes a chunk out of the global budget, NULL when it is used up
+ */
+static struct virtualbot_store_chunk *virtualbot_store_chunk_alloc(void)
+{
+	struct virtualbot_store_chunk *chunk;
+
+	if (atomic_long_add_return( sizeof(*chunk), &virtualbot_store_used ) >
+			READ_ONCE( virtualbot_store_budget ))
+		goto unaccount;
+
+	chunk = kmem_cache_alloc( virtualbot_store_cache, GFP_ATOMIC | __GFP_NOWARN );
+
+	if (!chunk)
+		goto unaccount;
+
+	chunk->start = 0;
+	chunk->length = 0;
+
+	return chunk;
+
+unaccount:
+	atomic_long_sub( sizeof(*chunk), &virtualbot_store_used );
+
+	return NULL;
+}
+
+static void virtualbot_store_chunk_free(struct virtualbot_store_chunk *chunk)
+{
+	list_del( &chunk->list );
+
+	kmem_cache_free( virtualbot_store_cache, chunk );
+
+	atomic_long_sub( sizeof(*chunk), &virtualbot_store_used );
+}
+
+/**
+ * Drops the oldest chunk to make room, returns the number of bytes lost
+ */
+static size_t virtualbot_store_drop_oldest(struct virtualbot_store *store)
+{
+	struct virtualbot_store_chunk *chunk;
+	size_t dropped;
+
+	chunk = list_first_entry_or_null( &store->chunks, struct virtualbot_store_chunk, list );
+
+	if (!chunk)
+		return 0;
+
+	dropped = chunk->length;
+
+	store->bytes -= dropped;
+
+	virtualbot_store_chunk_free( chunk );
+
+	return dropped;
+}
+
+/**
+ * Appends to the queue, within the limit of the link and the global budget
+ *
+ * Returns the number of bytes queued, *dropped is set to the bytes of older
+ * data thrown away for them under SERIALEMU_STORE_DROP_OLDEST.
+ */
+static size_t virtualbot_store_append(struct virtualbot_store *store,
+	const unsigned char *buffer,
+	size_t count,
+	size_t *dropped)
+{
+	struct virtualbot_store_chunk *chunk;
+	size_t queued = 0, room;
+
+	*dropped = 0;
+
+	while (queued < count) {
+
+		if (store->bytes >= store->limit) {
+
+			if (store->policy != SERIALEMU_STORE_DROP_OLDEST || !store->bytes)
+				break;
+
+			*dropped += virtualbot_store_drop_oldest( store );
+			continue;
+		}
+
+		chunk = list_empty( &store->chunks ) ? NULL :
+			list_last_entry( &store->chunks, struct virtualbot_store_chunk, list );
+
+		if (!chunk || chunk->start + chunk->length == VIRTUALBOT_STORE_CHUNK_SIZE) {
+
+			chunk = virtualbot_store_chunk_alloc();
+
+			if (!chunk) {
+				/* over the budget, only our own data can be given up */
+				if (store->policy != SERIALEMU_STORE_DROP_OLDEST || !store->bytes)
+					break;
+
+				*dropped += virtualbot_store_drop_oldest( store );
+				continue;
+			}
+
+			list_add_tail( &chunk->list, &store->chunks );
+		}
+
+		room = VIRTUALBOT_STORE_CHUNK_SIZE - chunk->start - chunk->length;
+		room = min3( room, count - queued, store->limit - store->bytes );
+
+		memcpy( chunk->data + chunk->start + chunk->length, buffer + queued, room );
+
+		chunk->length += room;
+		store->bytes += room;
+		queued += room;
+	}
+
+	return queued;
+}
+
+/**
+ * Delivers the queue to the receiving port, as much as it takes
+ *
+ * Must be called with the store's lock held. Returns true once the queue
+ * is empty.
+ */
+static bool virtualbot_store_flush(struct virtualbot_link *link)
+{
+	struct virtualbot_store *store = &link->store;
+	struct virtualbot_store_chunk *chunk;
+	size_t sent;
+
+	while ((chunk = list_first_entry_or_null( &store->chunks,
+			struct virtualbot_store_chunk, list ))) {
+
+		sent = virtualbot_link_forward( link, chunk->data + chunk->start, chunk->length );
+
+		chunk->start += sent;
+		chunk->length -= sent;
+		store->bytes -= sent;
+
+		if (chunk->length)
+			return false;
+
+		virtualbot_store_chunk_free( chunk );
+	}
+
+	return true;
+}
+
+void virtualbot_store_init(struct virtualbot_store *store)
+{
+	spin_lock_init( &store->lock );
+	INIT_LIST_HEAD( &store->chunks );
+
+	store->limit = VIRTUALBOT_STORE_DEFAULT_LIMIT;
+}
+
+void virtualbot_store_destroy(struct virtualbot_store *store)
+{
+	struct virtualbot_store_chunk *chunk, *next;
+
+	list_for_each_entry_safe(chunk, next, &store->chunks, list)
+		virtualbot_store_chunk_free( chunk );
+}
+
+/**
+ * Sets what happens to the data written while the receiver is closed,
+ * a 'limit' of 0 keeps the current one
+ *
+ * SERIALEMU_STORE_OFF drops what is held for a closed receiver.
+ */
+int virtualbot_store_set(struct virtualbot_link *link, unsigned int policy, u64 limit)
+{
+	struct virtualbot_store *store = &link->store;
+
+	if (policy != SERIALEMU_STORE_OFF &&
+	    policy != SERIALEMU_STORE_DROP_OLDEST &&
+	    policy != SERIALEMU_STORE_DROP_NEWEST &&
+	    policy != SERIALEMU_STORE_BLOCK)
+		return -EINVAL;
+
+	if (limit > READ_ONCE( virtualbot_store_budget ))
+		return -EINVAL;
+
+	spin_lock_bh( &store->lock );
+
+	WRITE_ONCE( store->policy, policy );
+
+	if (limit)
+		store->limit = limit;
+
+	/* an open receiver still gets what is queued */
+	if (policy == SERIALEMU_STORE_OFF && !store->peer_open) {
+		while (store->bytes)
+			virtualbot_store_drop_oldest( store );
+	}
+
+	spin_unlock_bh( &store->lock );
+
+	pr_debug("virtualbot: pair %u store policy %u, limit %zu",
+		link->index, policy, store->limit);
+
+	/* a blocked writer may go on, or fail */
+	tty_port_tty_wakeup( link->writer );
+
+	return 0;
+}
+
+/**
+ * Called when the receiving port is opened or closed for the last time
+ *
+ * On open the queue is delivered before anything written afterwards. On
+ * close without a policy, what the receiver didn't drain is dropped, like
+ * virtualbot_store_set() does for a closed receiver.
+ */
+void virtualbot_store_peer(struct virtualbot_link *link, bool open)
+{
+	struct virtualbot_store *store = &link->store;
+	size_t dropped = 0;
+
+	spin_lock_bh( &store->lock );
+
+	WRITE_ONCE( store->peer_open, open );
+
+	if (open) {
+		virtualbot_store_flush( link );
+	} else if (store->policy == SERIALEMU_STORE_OFF) {
+		while (store->bytes)
+			dropped += virtualbot_store_drop_oldest( store );
+	}
+
+	spin_unlock_bh( &store->lock );
+
+	if (dropped)
+		virtualbot_stats_account( link->stats, 0, 0, 0, dropped );
+
+	if (open)
+		tty_port_tty_wakeup( link->writer );
+}
+
+/**
+ * True when written data must go through the store: the receiver is closed
+ * and a policy is set, or older data is still queued
+ */
+bool virtualbot_store_active(struct virtualbot_store *store)
+{
+	return ( READ_ONCE( store->policy ) != SERIALEMU_STORE_OFF &&
+		 !READ_ONCE( store->peer_open ) ) ||
+		READ_ONCE( store->bytes );
+}
+
+/**
+ * Queues written data, or delivers it behind what is queued
+ *
+ * Returns the number of bytes accepted. While the receiver is closed and
+ * the queue is full, SERIALEMU_STORE_BLOCK accepts nothing so the writer
+ * waits, the drop policies take everything and count what they lose.
+ */
+size_t virtualbot_store_write(struct virtualbot_link *link,
+	const unsigned char *buffer,
+	size_t count)
+{
+	struct virtualbot_store *store = &link->store;
+	size_t accepted, dropped = 0, room;
+
+	spin_lock_bh( &store->lock );
+
+	/* the receiver closed with the policy off since the writer looked */
+	if (!store->peer_open && store->policy == SERIALEMU_STORE_OFF) {
+		accepted = count;
+		dropped = count;
+		goto account;
+	}
+
+	/* nothing held anymore */
+	if (store->peer_open && virtualbot_store_flush( link )) {
+		accepted = virtualbot_link_forward( link, buffer, count );
+		goto unlock;
+	}
+
+	room = store->limit - min( store->bytes, store->limit );
+
+	/* a write up to the atomic size is held whole, or is dropped whole */
+	if (store->policy != SERIALEMU_STORE_DROP_OLDEST && count <= store->limit &&
+	    virtualbot_link_must_wait( link, count, room ))
+		accepted = 0;
+	else
+		accepted = virtualbot_store_append( store, buffer, count, &dropped );
+
+	/* the receiver is draining the queue, the writer waits for it */
+	if (store->peer_open || store->policy == SERIALEMU_STORE_BLOCK)
+		goto account;
+
+	if (store->policy == SERIALEMU_STORE_DROP_NEWEST)
+		dropped += count - accepted;
+
+	accepted = count;
+
+account:
+	virtualbot_stats_account( link->stats, 1, 0, 0, dropped );
+
+unlock:
+	spin_unlock_bh( &store->lock );
+
+	return accepted;
+}
+
+/**
+ * Room left for the writer while the store is in use
+ */
+unsigned int virtualbot_store_room(struct virtualbot_store *store)
+{
+	unsigned int room;
+
+	spin_lock_bh( &store->lock );
+
+	/* the drop policies never make the writer wait */
+	if (!store->peer_open && store->policy != SERIALEMU_STORE_BLOCK)
+		room = VIRTUALBOT_STORE_CHUNK_SIZE;
+	else
+		room = store->limit - min( store->bytes, store->limit );
+
+	spin_unlock_bh( &store->lock );
+
+	return room;
+}
+
+/**
+ * Called when the receiver made room, delivers more of the queue
+ */
+void virtualbot_store_wakeup(struct virtualbot_link *link)
+{
+	struct virtualbot_store *store = &link->store;
+
+	if (!READ_ONCE( store->bytes ) || !READ_ONCE( store->peer_open ))
+		return;
+
+	spin_lock_bh( &store->lock );
+
+	if (store->peer_open)
+		virtualbot_store_flush( link );
+
+	spin_unlock_bh( &store->lock );
+}
+
+int virtualbot_store_cache_init(void)
+{
+	virtualbot_store_cache = KMEM_CACHE(virtualbot_store_chunk, 0);
+
+	if (!virtualbot_store_cache)
+		return -ENOMEM;
+
+	return 0;
+}
+
+void virtualbot_store_cache_exit(void)
+{
+	kmem_cache_destroy( virtualbot_store_cache );
+}
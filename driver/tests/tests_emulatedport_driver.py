@@ -10,6 +10,15 @@ import threading
 
 import unittest
 
+import errno
+import fcntl
+import mmap
+import os
+import select
+import struct
+import termios
+import tty
+
 from collections import UserDict
 
 
@@ -72,6 +81,96 @@ class VirtualBotParameters(dict):
 
 
 
+# ioctl numbers from include/virtualbot_ioctl.h
+
+def _IOC( direction, number, size ):
+    return ( direction << 30 ) | ( size << 16 ) | ( ord('V') << 8 ) | number
+
+SERIALEMU_CTL = "/dev/serialemu-ctl"
+
+SERIALEMU_ANY_INDEX = 0xffffffff
+
+PAIR_INFO_FORMAT = "II32s32s"
+
+SERIALEMU_IOC_CREATE = _IOC( 3, 0x01, struct.calcsize( PAIR_INFO_FORMAT ) )
+
+SERIALEMU_IOC_DESTROY = _IOC( 1, 0x02, 4 )
+
+SERIALEMU_IOC_SET_PACING = _IOC( 1, 0x04, 8 )
+
+# index, direction, seed, then bitflip, drop, duplicate, parity, frame and overrun rates
+FAULTS_FORMAT = "IIQ6I"
+
+SERIALEMU_IOC_SET_FAULTS = _IOC( 1, 0x05, struct.calcsize( FAULTS_FORMAT ) )
+
+# master, member
+SERIALEMU_IOC_BUS_ATTACH = _IOC( 1, 0x06, 8 )
+
+SERIALEMU_IOC_BUS_DETACH = _IOC( 1, 0x07, 8 )
+
+# index, direction, mode, reserved
+SERIALEMU_IOC_SET_FRAMING = _IOC( 1, 0x0a, 16 )
+
+SERIALEMU_FRAMING_NONE = 0
+SERIALEMU_FRAMING_JAVINO = 1
+SERIALEMU_FRAMING_LINE = 2
+
+# index, direction, policy, reserved, limit
+STORE_FORMAT = "4IQ"
+
+SERIALEMU_IOC_SET_STORE = _IOC( 1, 0x0b, struct.calcsize( STORE_FORMAT ) )
+
+SERIALEMU_STORE_OFF = 0
+SERIALEMU_STORE_DROP_OLDEST = 1
+SERIALEMU_STORE_DROP_NEWEST = 2
+SERIALEMU_STORE_BLOCK = 3
+
+SERIALEMU_TO_EXOGENOUS = 0
+SERIALEMU_TO_EMULATED = 1
+
+# index, direction, enable, reserved
+SERIALEMU_IOC_SET_LOOPBACK = _IOC( 1, 0x0c, 16 )
+
+# index, direction, size, reserved
+SERIALEMU_IOC_SET_ATOMIC = _IOC( 1, 0x0d, 16 )
+
+# index, direction, depth, flags, occupancy, high_water
+DEPTH_FORMAT = "6I"
+
+SERIALEMU_IOC_DEPTH = _IOC( 3, 0x0e, struct.calcsize( DEPTH_FORMAT ) )
+
+# index, direction, enable, cpu
+SERIALEMU_IOC_SET_LATENCY = _IOC( 1, 0x0f, 16 )
+
+# struct serial_struct, 'flags' is the fifth field
+SERIAL_STRUCT_FORMAT = "@8iH2ciHHPHIL"
+
+ASYNC_LOW_LATENCY = 0x2000
+
+LATENCY_DEBUGFS = "/sys/kernel/debug/virtualbot"
+
+# TCP port the bridge serves pair 0 on during the tests
+BRIDGE_PORT = 7500
+
+SERIALEMU_DEPTH_RESET_HIGH_WATER = 1
+
+SERIALEMU_CAPTURE = "/dev/serialemu-capture"
+
+# index, reserved, size
+SERIALEMU_IOC_CAPTURE_START = _IOC( 1, 0x08, 16 )
+
+# version, data_offset, data_size, head, lost, reserved[4], tail
+CAPTURE_RING_FORMAT = "IIQQQ4QQ"
+
+# pos, timestamp, length, direction, flags
+CAPTURE_RECORD_FORMAT = "QQIHH"
+
+SERIALEMU_REPLAY = "/dev/serialemu-replay"
+
+# index, speed
+SERIALEMU_IOC_REPLAY_START = _IOC( 1, 0x09, 8 )
+
+
 def read_serial_port( read_var , serial_object ):
 
     read_var[ 'value' ] = serial_object.readline().decode()
@@ -217,6 +316,1003 @@ class TestSerialObject(unittest.TestCase):
             timeout = 3 )
 
         comm1.write( bytes("XYZ\n", 'utf-8') )
-            
+
+    def test_08_CreateAndDestroyPairAtRuntime(self):
+
+        ctl = os.open( SERIALEMU_CTL, os.O_RDWR )
+
+        request = bytearray( struct.pack( PAIR_INFO_FORMAT, SERIALEMU_ANY_INDEX, 0, b"", b"" ) )
+
+        fcntl.ioctl( ctl, SERIALEMU_IOC_CREATE, request )
+
+        index, _, emulated, exogenous = struct.unpack( PAIR_INFO_FORMAT, request )
+
+        emulated = "/dev/" + emulated.rstrip( b"\0" ).decode()
+        exogenous = "/dev/" + exogenous.rstrip( b"\0" ).decode()
+
+        self.assertEqual( emulated, self.__EmulatedPort + str( index ) )
+
+        # udev creates the nodes asynchronously
+        for i in range( 50 ):
+            if os.path.exists( emulated ) and os.path.exists( exogenous ):
+                break
+            time.sleep( 0.1 )
+
+        comm1 = serial.Serial( emulated, 9600, timeout = 3 )
+        comm2 = serial.Serial( exogenous, 9600, timeout = 3 )
+
+        comm1.write( b"XYZ\n" )
+
+        self.assertEqual( comm2.readline(), b"XYZ\n" )
+
+        comm1.close()
+        comm2.close()
+
+        fcntl.ioctl( ctl, SERIALEMU_IOC_DESTROY, struct.pack( "I", index ) )
+
+        with self.assertRaises( OSError ):
+            fcntl.ioctl( ctl, SERIALEMU_IOC_DESTROY, struct.pack( "I", index ) )
+
+        os.close( ctl )
+
+    def test_09_PacedDeliveryFollowsBaudRate(self):
+
+        ctl = os.open( SERIALEMU_CTL, os.O_RDWR )
+
+        fcntl.ioctl( ctl, SERIALEMU_IOC_SET_PACING, struct.pack( "II", 0, 1 ) )
+
+        comm1 = serial.Serial( str( self.__EmulatedPort + "0" ), 9600, timeout = 5 )
+        comm2 = serial.Serial( str( self.__Exogenous + "0" ), 9600, timeout = 5 )
+
+        # 960 characters of 10 bits (8N1) take one second at 9600 baud
+        data = b"U" * 960
+
+        start = time.monotonic()
+
+        comm1.write( data )
+
+        self.assertEqual( comm2.read( len( data ) ), data )
+
+        elapsed = time.monotonic() - start
+
+        comm1.close()
+        comm2.close()
+
+        fcntl.ioctl( ctl, SERIALEMU_IOC_SET_PACING, struct.pack( "II", 0, 0 ) )
+
+        os.close( ctl )
+
+        self.assertGreater( elapsed, 0.9 )
+        self.assertLess( elapsed, 1.2 )
+
+    # Run it on a kernel with CONFIG_PROVE_LOCKING to have lockdep check the write paths
+    def test_10_FullDuplexWritesDontBlockEachOther(self):
+
+        comm1 = serial.Serial( str( self.__EmulatedPort + "0" ), 9600, timeout = 10 )
+        comm2 = serial.Serial( str( self.__Exogenous + "0" ), 9600, timeout = 10 )
+
+        data = bytes( range( 256 ) ) * 256
+
+        received = {}
+
+        def transfer( writer, reader, key ):
+            threading.Thread( target = writer.write, args = ( data, ) ).start()
+            received[ key ] = reader.read( len( data ) )
+
+        threads = [ threading.Thread( target = transfer, args = ( comm1, comm2, "emulated" ) ),
+            threading.Thread( target = transfer, args = ( comm2, comm1, "exogenous" ) ) ]
+
+        for thread in threads:
+            thread.start()
+
+        for thread in threads:
+            thread.join( 20 )
+
+        comm1.close()
+        comm2.close()
+
+        self.assertEqual( received.get( "emulated" ), data )
+        self.assertEqual( received.get( "exogenous" ), data )
+
+    def test_11_WriterWaitsForTheReaderToDrain(self):
+
+        comm2 = serial.Serial( str( self.__Exogenous + "0" ), 9600, timeout = 3 )
+
+        comm1 = os.open( self.__EmulatedPort + "0", os.O_WRONLY | os.O_NONBLOCK | os.O_NOCTTY )
+
+        tty.setraw( comm1 )
+
+        # nobody reads, so the writer must be stopped once the Exogenous buffer is full
+        written = 0
+
+        try:
+            while written < ( 1 << 20 ):
+                written += os.write( comm1, b"U" * 4096 )
+        except BlockingIOError:
+            pass
+
+        self.assertLess( written, 1 << 20 )
+
+        _, writable, _ = select.select( [], [ comm1 ], [], 0 )
+
+        self.assertEqual( writable, [] )
+
+        # nothing was dropped, and draining the reader wakes the writer up
+        self.assertEqual( len( comm2.read( written ) ), written )
+
+        _, writable, _ = select.select( [], [ comm1 ], [], 1 )
+
+        self.assertEqual( writable, [ comm1 ] )
+
+        os.close( comm1 )
+        comm2.close()
+
+    def test_12_ModemLinesAreCrossWired(self):
+
+        comm1 = serial.Serial( str( self.__EmulatedPort + "0" ), 9600, timeout = 3 )
+        comm2 = serial.Serial( str( self.__Exogenous + "0" ), 9600, timeout = 3 )
+
+        # DTR shows up as DSR and DCD on the other side
+        comm1.dtr = False
+
+        self.assertFalse( comm2.dsr )
+        self.assertFalse( comm2.cd )
+
+        comm1.dtr = True
+
+        self.assertTrue( comm2.dsr )
+        self.assertTrue( comm2.cd )
+
+        # RTS shows up as CTS, and TIOCMIWAIT wakes up when it changes
+        comm2.rts = False
+
+        self.assertFalse( comm1.cts )
+
+        raise_rts = threading.Timer( 0.5, setattr, args = ( comm2, "rts", True ) )
+        raise_rts.start()
+
+        fcntl.ioctl( comm1.fileno(), termios.TIOCMIWAIT, termios.TIOCM_CTS )
+
+        self.assertTrue( comm1.cts )
+
+        raise_rts.join()
+
+        comm1.close()
+        comm2.close()
+
+    def test_13_TrafficCountersOnBothSides(self):
+
+        sysfs = "/sys/class/tty/ttyEmulatedPort0/stats/"
+
+        comm1 = serial.Serial( str( self.__EmulatedPort + "0" ), 9600, timeout = 3 )
+        comm2 = serial.Serial( str( self.__Exogenous + "0" ), 9600, timeout = 3 )
+
+        def icount( port ):
+            # struct serial_icounter_struct: cts dsr rng dcd rx tx frame overrun parity brk buf_overrun
+            buffer = fcntl.ioctl( port.fileno(), termios.TIOCGICOUNT, bytes( 80 ) )
+            return struct.unpack( "20i", buffer )
+
+        def counter( name ):
+            with open( sysfs + name ) as attribute:
+                return int( attribute.read() )
+
+        tx_before = counter( "tx_bytes" )
+        rx_before = icount( comm2 )[ 4 ]
+
+        comm1.write( b"U" * 100 )
+
+        self.assertEqual( comm2.read( 100 ), b"U" * 100 )
+
+        self.assertEqual( counter( "tx_bytes" ) - tx_before, 100 )
+        self.assertEqual( icount( comm2 )[ 4 ] - rx_before, 100 )
+        self.assertEqual( icount( comm1 )[ 5 ], counter( "tx_bytes" ) )
+
+        comm1.close()
+        comm2.close()
+
+    def test_14_WritesAreTraced(self):
+
+        events = "/sys/kernel/tracing/events/virtualbot/"
+
+        if not os.path.isdir( events ):
+            self.skipTest("tracefs not mounted")
+
+        def tracefs( name, value ):
+            with open( "/sys/kernel/tracing/" + name, "w" ) as attribute:
+                attribute.write( value )
+
+        comm1 = serial.Serial( str( self.__EmulatedPort + "0" ), 9600, timeout = 3 )
+        comm2 = serial.Serial( str( self.__Exogenous + "0" ), 9600, timeout = 3 )
+
+        tracefs( "trace", "" )
+        tracefs( "events/virtualbot/virtualbot_write/enable", "1" )
+
+        try:
+            comm1.write( b"traced" )
+            self.assertEqual( comm2.read( 6 ), b"traced" )
+        finally:
+            tracefs( "events/virtualbot/virtualbot_write/enable", "0" )
+
+        with open( "/sys/kernel/tracing/trace" ) as trace:
+            self.assertIn( "ttyEmulatedPort0 -> ttyExogenous0 count=6 accepted=6", trace.read() )
+
+        comm1.close()
+        comm2.close()
+
+    def test_15_SeededFaultsAreReproducible(self):
+
+        ctl = os.open( SERIALEMU_CTL, os.O_RDWR )
+
+        comm1 = serial.Serial( str( self.__EmulatedPort + "0" ), 9600, timeout = 3 )
+        comm2 = serial.Serial( str( self.__Exogenous + "0" ), 9600, timeout = 3 )
+
+        data = bytes( range( 256 ) )
+
+        def corrupted( seed ):
+            # one byte in two gets a bit flipped, none is lost
+            fcntl.ioctl( ctl, SERIALEMU_IOC_SET_FAULTS,
+                struct.pack( FAULTS_FORMAT, 0, 0, seed, 500000, 0, 0, 0, 0, 0 ) )
+            comm1.write( data )
+            return comm2.read( len( data ) )
+
+        try:
+            first = corrupted( 1234 )
+
+            self.assertEqual( len( first ), len( data ) )
+            self.assertNotEqual( first, data )
+            self.assertEqual( corrupted( 1234 ), first )
+            self.assertNotEqual( corrupted( 4321 ), first )
+
+            # every byte is received with a parity error, and counted
+            parity_before = struct.unpack( "20i",
+                fcntl.ioctl( comm2.fileno(), termios.TIOCGICOUNT, bytes( 80 ) ) )[ 8 ]
+
+            fcntl.ioctl( ctl, SERIALEMU_IOC_SET_FAULTS,
+                struct.pack( FAULTS_FORMAT, 0, 0, 0, 0, 0, 0, 1000000, 0, 0 ) )
+
+            comm1.write( b"P" * 10 )
+            comm2.read( 10 )
+
+            parity = struct.unpack( "20i",
+                fcntl.ioctl( comm2.fileno(), termios.TIOCGICOUNT, bytes( 80 ) ) )[ 8 ]
+
+            self.assertEqual( parity - parity_before, 10 )
+
+            # the counters see what arrived, not what was written
+            def received():
+                return struct.unpack( "20i",
+                    fcntl.ioctl( comm2.fileno(), termios.TIOCGICOUNT, bytes( 80 ) ) )[ 4 ]
+
+            def dropped():
+                with open( "/sys/class/tty/ttyExogenous0/stats/rx_dropped" ) as attribute:
+                    return int( attribute.read() )
+
+            rx_before, dropped_before = received(), dropped()
+
+            fcntl.ioctl( ctl, SERIALEMU_IOC_SET_FAULTS,
+                struct.pack( FAULTS_FORMAT, 0, 0, 0, 0, 0, 1000000, 0, 0, 0 ) )
+
+            comm1.write( b"D" * 10 )
+            self.assertEqual( comm2.read( 20 ), b"D" * 20 )
+
+            fcntl.ioctl( ctl, SERIALEMU_IOC_SET_FAULTS,
+                struct.pack( FAULTS_FORMAT, 0, 0, 0, 0, 1000000, 0, 0, 0, 0 ) )
+
+            comm1.write( b"L" * 10 )
+            comm1.flush()
+            self.assertEqual( comm2.read( 1 ), b"" )
+
+            self.assertEqual( received() - rx_before, 20 )
+            self.assertEqual( dropped() - dropped_before, 10 )
+
+        finally:
+            fcntl.ioctl( ctl, SERIALEMU_IOC_SET_FAULTS,
+                struct.pack( FAULTS_FORMAT, 0, 0, 0, 0, 0, 0, 0, 0, 0 ) )
+
+            comm1.close()
+            comm2.close()
+
+            os.close( ctl )
+
+    def test_16_BusFansOutToEveryMember(self):
+
+        ctl = os.open( SERIALEMU_CTL, os.O_RDWR )
+
+        members = []
+
+        for i in range( 3 ):
+            request = bytearray( struct.pack( PAIR_INFO_FORMAT, SERIALEMU_ANY_INDEX, 0, b"", b"" ) )
+            fcntl.ioctl( ctl, SERIALEMU_IOC_CREATE, request )
+            members.append( struct.unpack( PAIR_INFO_FORMAT, request )[ 0 ] )
+
+        for index in members:
+            fcntl.ioctl( ctl, SERIALEMU_IOC_BUS_ATTACH, struct.pack( "II", 0, index ) )
+
+        # an EmulatedPort listens to one bus at most
+        with self.assertRaises( OSError ):
+            fcntl.ioctl( ctl, SERIALEMU_IOC_BUS_ATTACH, struct.pack( "II", 0, members[ 0 ] ) )
+
+        for index in members:
+            for i in range( 50 ):
+                if os.path.exists( self.__EmulatedPort + str( index ) ):
+                    break
+                time.sleep( 0.1 )
+
+        master = serial.Serial( str( self.__Exogenous + "0" ), 9600, timeout = 3 )
+        slaves = [ serial.Serial( self.__EmulatedPort + str( index ), 9600, timeout = 3 )
+            for index in members ]
+
+        master.write( b"POLL\n" )
+
+        for slave in slaves:
+            self.assertEqual( slave.readline(), b"POLL\n" )
+
+        slaves[ 1 ].write( b"ACK\n" )
+
+        self.assertEqual( master.readline(), b"ACK\n" )
+
+        for slave in slaves:
+            slave.close()
+
+        master.close()
+
+        fcntl.ioctl( ctl, SERIALEMU_IOC_BUS_DETACH, struct.pack( "II", 0, members[ 0 ] ) )
+
+        with self.assertRaises( OSError ):
+            fcntl.ioctl( ctl, SERIALEMU_IOC_BUS_DETACH, struct.pack( "II", 0, members[ 0 ] ) )
+
+        # the others leave the bus with their pairs
+        for index in members:
+            fcntl.ioctl( ctl, SERIALEMU_IOC_DESTROY, struct.pack( "I", index ) )
+
+        os.close( ctl )
+
+    def test_17_CaptureRingRecordsBothDirections(self):
+
+        size = 64 * 1024
+
+        capture = os.open( SERIALEMU_CAPTURE, os.O_RDWR )
+
+        fcntl.ioctl( capture, SERIALEMU_IOC_CAPTURE_START, struct.pack( "IIQ", 0, 0, size ) )
+
+        # one capture per pair
+        other = os.open( SERIALEMU_CAPTURE, os.O_RDWR )
+
+        with self.assertRaises( OSError ):
+            fcntl.ioctl( other, SERIALEMU_IOC_CAPTURE_START, struct.pack( "IIQ", 0, 0, size ) )
+
+        os.close( other )
+
+        ring = mmap.mmap( capture, mmap.PAGESIZE + size )
+
+        comm1 = serial.Serial( str( self.__EmulatedPort + "0" ), 9600, timeout = 3 )
+        comm2 = serial.Serial( str( self.__Exogenous + "0" ), 9600, timeout = 3 )
+
+        comm1.write( b"request" )
+        self.assertEqual( comm2.read( 7 ), b"request" )
+
+        comm2.write( b"reply" )
+        self.assertEqual( comm1.read( 5 ), b"reply" )
+
+        comm1.close()
+        comm2.close()
+
+        header = struct.unpack_from( CAPTURE_RING_FORMAT, ring )
+
+        data_offset, tail = header[ 1 ], header[ -1 ]
+
+        records = []
+
+        while True:
+            pos, timestamp, length, direction, flags = \
+                struct.unpack_from( CAPTURE_RECORD_FORMAT, ring, data_offset + tail )
+
+            if pos != tail:
+                break
+
+            start = data_offset + tail + struct.calcsize( CAPTURE_RECORD_FORMAT )
+            records.append( ( direction, ring[ start : start + length ] ) )
+
+            tail += ( struct.calcsize( CAPTURE_RECORD_FORMAT ) + length + 7 ) & ~7
+
+        self.assertEqual( records, [ ( 0, b"request" ), ( 1, b"reply" ) ] )
+
+        ring.close()
+        os.close( capture )
+
+    def test_18_ReplayKeepsRecordedTiming(self):
+
+        comm1 = serial.Serial( str( self.__EmulatedPort + "0" ), 9600, timeout = 3 )
+        comm2 = serial.Serial( str( self.__Exogenous + "0" ), 9600, timeout = 3 )
+
+        replay = os.open( SERIALEMU_REPLAY, os.O_WRONLY )
+
+        # real time
+        fcntl.ioctl( replay, SERIALEMU_IOC_REPLAY_START, struct.pack( "II", 0, 1000 ) )
+
+        records = b""
+
+        # the second record was written 300 ms after the first one
+        for timestamp, direction, data in [ ( 5000000000, 0, b"first" ),
+                                            ( 5300000000, 1, b"second" ) ]:
+            records += struct.pack( CAPTURE_RECORD_FORMAT, 0, timestamp, len( data ), direction, 0 )
+            records += data
+
+        start = time.monotonic()
+
+        self.assertEqual( os.write( replay, records ), len( records ) )
+
+        self.assertEqual( comm2.read( 5 ), b"first" )
+        self.assertEqual( comm1.read( 6 ), b"second" )
+
+        os.fsync( replay )
+
+        self.assertGreaterEqual( time.monotonic() - start, 0.3 )
+
+        os.close( replay )
+
+        comm1.close()
+        comm2.close()
+
+    def test_19_JavinoFramesArriveWhole(self):
+
+        ctl = os.open( SERIALEMU_CTL, os.O_RDWR )
+
+        comm1 = serial.Serial( str( self.__EmulatedPort + "0" ), 9600, timeout = 3 )
+        comm2 = serial.Serial( str( self.__Exogenous + "0" ), 9600, timeout = 3 )
+
+        sysfs = "/sys/class/tty/ttyEmulatedPort0/stats/tx_malformed_frames"
+
+        with open( sysfs ) as attribute:
+            malformed = int( attribute.read() )
+
+        fcntl.ioctl( ctl, SERIALEMU_IOC_SET_FRAMING,
+            struct.pack( "4I", 0, 0, SERIALEMU_FRAMING_JAVINO, 0 ) )
+
+        try:
+            # half a frame is held back
+            comm1.write( b"fffe0bgetP" )
+            comm1.flush()
+
+            readable, _, _ = select.select( [ comm2 ], [], [], 0.2 )
+            self.assertEqual( readable, [] )
+
+            comm1.write( b"ercepts" )
+            self.assertEqual( comm2.read( 17 ), b"fffe0bgetPercepts" )
+
+            # garbage goes through as it is, and is counted
+            comm1.write( b"xyzfffe02ok" )
+            self.assertEqual( comm2.read( 11 ), b"xyzfffe02ok" )
+
+            with open( sysfs ) as attribute:
+                self.assertEqual( int( attribute.read() ), malformed + 1 )
+
+        finally:
+            fcntl.ioctl( ctl, SERIALEMU_IOC_SET_FRAMING,
+                struct.pack( "4I", 0, 0, SERIALEMU_FRAMING_NONE, 0 ) )
+
+            comm1.close()
+            comm2.close()
+
+            os.close( ctl )
+
+    def test_20_DataWaitsForTheClosedPeer(self):
+
+        ctl = os.open( SERIALEMU_CTL, os.O_RDWR )
+
+        def store( policy, limit ):
+            fcntl.ioctl( ctl, SERIALEMU_IOC_SET_STORE,
+                struct.pack( STORE_FORMAT, 0, 0, policy, 0, limit ) )
+
+        try:
+            store( SERIALEMU_STORE_DROP_NEWEST, 8 )
+
+            # nobody listens on the Exogenous port yet
+            comm1 = serial.Serial( str( self.__EmulatedPort + "0" ), 9600, timeout = 3 )
+            comm1.write( b"hello\n" )
+            comm1.write( b"lost" )
+            comm1.flush()
+
+            comm2 = serial.Serial( str( self.__Exogenous + "0" ), 9600, timeout = 1 )
+
+            # only what fits in the limit is held, in order
+            self.assertEqual( comm2.read( 16 ), b"hello\nlo" )
+
+            comm1.close()
+            comm2.close()
+
+        finally:
+            store( SERIALEMU_STORE_OFF, 65536 )
+
+            os.close( ctl )
+
+    def test_21_PeerCloseHangsUpWithoutClocal(self):
+
+        comm1 = serial.Serial( str( self.__EmulatedPort + "0" ), 9600, timeout = 1 )
+
+        # a second open keeps the Exogenous port up when the first one goes
+        exogenous = os.open( str( self.__Exogenous + "0" ), os.O_RDWR | os.O_NOCTTY | os.O_NONBLOCK )
+        other = os.open( str( self.__Exogenous + "0" ), os.O_RDWR | os.O_NOCTTY | os.O_NONBLOCK )
+
+        try:
+            attrs = termios.tcgetattr( exogenous )
+            attrs[ 2 ] &= ~termios.CLOCAL
+            termios.tcsetattr( exogenous, termios.TCSANOW, attrs )
+
+            os.close( other )
+
+            # still open, the carrier is up
+            self.assertEqual( select.select( [ exogenous ], [], [], 0.2 )[ 0 ], [] )
+
+            comm1.close()
+
+            # DCD drops with the last close of the EmulatedPort
+            poller = select.poll()
+            poller.register( exogenous, select.POLLIN )
+
+            events = poller.poll( 1000 )
+
+            self.assertTrue( events and events[ 0 ][ 1 ] & select.POLLHUP )
+            self.assertEqual( os.read( exogenous, 16 ), b"" )
+
+        finally:
+            comm1.close()
+            os.close( exogenous )
+
+    def test_22_LoopbackReturnsDataToTheWriter(self):
+
+        comm1 = serial.Serial( str( self.__EmulatedPort + "0" ), 9600, timeout = 1 )
+        comm2 = serial.Serial( str( self.__Exogenous + "0" ), 9600, timeout = 0.2 )
+
+        loop = struct.pack( "I", termios.TIOCM_LOOP )
+
+        try:
+            fcntl.ioctl( comm1.fileno(), termios.TIOCMBIS, loop )
+
+            comm1.write( b"echo" )
+
+            self.assertEqual( comm1.read( 4 ), b"echo" )
+            self.assertEqual( comm2.read( 4 ), b"" )
+
+            # the same switch from the control device, for the Exogenous side
+            ctl = os.open( SERIALEMU_CTL, os.O_RDWR )
+
+            fcntl.ioctl( ctl, SERIALEMU_IOC_SET_LOOPBACK,
+                struct.pack( "4I", 0, SERIALEMU_TO_EMULATED, 1, 0 ) )
+
+            comm2.write( b"back" )
+
+            self.assertEqual( comm2.read( 4 ), b"back" )
+
+            fcntl.ioctl( ctl, SERIALEMU_IOC_SET_LOOPBACK,
+                struct.pack( "4I", 0, SERIALEMU_TO_EMULATED, 0, 0 ) )
+
+            os.close( ctl )
+
+            fcntl.ioctl( comm1.fileno(), termios.TIOCMBIC, loop )
+
+            comm1.write( b"peer" )
+
+            self.assertEqual( comm2.read( 4 ), b"peer" )
+
+        finally:
+            comm1.close()
+            comm2.close()
+
+    def test_23_ConcurrentWritersNeverInterleave(self):
+
+        size = self.__VBParams[ "VIRTUALBOT_MAX_SIGNAL_LEN" ]
+        messages = 200
+
+        comm2 = serial.Serial( str( self.__Exogenous + "0" ), 9600, timeout = 3 )
+
+        def writer( letter ):
+            fd = os.open( str( self.__EmulatedPort + "0" ), os.O_WRONLY | os.O_NOCTTY )
+            tty.setraw( fd )
+            for i in range( messages ):
+                os.write( fd, letter * size )
+            os.close( fd )
+
+        writers = [ threading.Thread( target = writer, args = ( letter, ) )
+            for letter in ( b"a", b"b", b"c", b"d" ) ]
+
+        for thread in writers:
+            thread.start()
+
+        received = comm2.read( size * messages * len( writers ) )
+
+        for thread in writers:
+            thread.join()
+
+        self.assertEqual( len( received ), size * messages * len( writers ) )
+
+        # every message arrived in one piece
+        for i in range( 0, len( received ), size ):
+            self.assertEqual( len( set( received[ i : i + size ] ) ), 1 )
+
+        # sizes out of range are refused
+        ctl = os.open( SERIALEMU_CTL, os.O_RDWR )
+
+        with self.assertRaises( OSError ):
+            fcntl.ioctl( ctl, SERIALEMU_IOC_SET_ATOMIC,
+                struct.pack( "4I", 0, SERIALEMU_TO_EXOGENOUS, size - 1, 0 ) )
+
+        os.close( ctl )
+        comm2.close()
+
+    def test_24_ReceiveBufferDepthPushesBack(self):
+
+        ctl = os.open( SERIALEMU_CTL, os.O_RDWR )
+
+        def depth( value, flags = 0 ):
+            reply = fcntl.ioctl( ctl, SERIALEMU_IOC_DEPTH,
+                struct.pack( DEPTH_FORMAT, 0, SERIALEMU_TO_EXOGENOUS, value, flags, 0, 0 ) )
+            return struct.unpack( DEPTH_FORMAT, reply )
+
+        default = depth( 0 )[ 2 ]
+
+        comm2 = serial.Serial( str( self.__Exogenous + "0" ), 9600, timeout = 1 )
+        writer = os.open( str( self.__EmulatedPort + "0" ), os.O_WRONLY | os.O_NOCTTY | os.O_NONBLOCK )
+        tty.setraw( writer )
+
+        try:
+            depth( 4096, SERIALEMU_DEPTH_RESET_HIGH_WATER )
+
+            with open( "/sys/class/tty/ttyExogenous0/buffer/depth" ) as f:
+                self.assertEqual( int( f.read() ), 4096 )
+
+            # nobody reads: the flip buffer and the line discipline fill up
+            accepted = 0
+            while True:
+                try:
+                    accepted += os.write( writer, b"x" * 1024 )
+                except BlockingIOError:
+                    break
+
+            self.assertLess( accepted, 16384 )
+
+            _, _, value, _, occupancy, high_water = depth( 0 )
+
+            self.assertEqual( value, 4096 )
+            self.assertLessEqual( occupancy, 4096 )
+            self.assertGreater( high_water, 0 )
+            self.assertLessEqual( high_water, 4096 )
+
+            # everything accepted is delivered
+            self.assertEqual( len( comm2.read( accepted ) ), accepted )
+
+        finally:
+            depth( default )
+
+            os.close( writer )
+            comm2.close()
+            os.close( ctl )
+
+    def test_25_LowLatencyDelivery(self):
+
+        ctl = os.open( SERIALEMU_CTL, os.O_RDWR )
+
+        comm1 = serial.Serial( str( self.__EmulatedPort + "0" ), 9600, timeout = 1 )
+        comm2 = serial.Serial( str( self.__Exogenous + "0" ), 9600, timeout = 1 )
+
+        def serial_info( port ):
+            return list( struct.unpack( SERIAL_STRUCT_FORMAT, fcntl.ioctl( port.fileno(), termios.TIOCGSERIAL,
+                bytes( struct.calcsize( SERIAL_STRUCT_FORMAT ) ) ) ) )
+
+        def latency( enable, cpu ):
+            fcntl.ioctl( ctl, SERIALEMU_IOC_SET_LATENCY,
+                struct.pack( "3Ii", 0, SERIALEMU_TO_EMULATED, enable, cpu ) )
+
+        try:
+            info = serial_info( comm1 )
+            self.assertFalse( info[ 4 ] & ASYNC_LOW_LATENCY )
+
+            # TIOCSSERIAL on the EmulatedPort speeds up what it receives
+            info[ 4 ] |= ASYNC_LOW_LATENCY
+            fcntl.ioctl( comm1.fileno(), termios.TIOCSSERIAL, struct.pack( SERIAL_STRUCT_FORMAT, *info ) )
+
+            self.assertTrue( serial_info( comm1 )[ 4 ] & ASYNC_LOW_LATENCY )
+            self.assertFalse( serial_info( comm2 )[ 4 ] & ASYNC_LOW_LATENCY )
+
+            comm2.write( b"low latency\n" )
+            self.assertEqual( comm1.readline(), b"low latency\n" )
+
+            # pinned to a CPU through the control device
+            latency( 1, 0 )
+
+            comm2.write( b"pinned\n" )
+            self.assertEqual( comm1.readline(), b"pinned\n" )
+
+            with self.assertRaises( OSError ) as error:
+                latency( 1, 1 << 20 )
+
+            self.assertEqual( error.exception.errno, errno.EINVAL )
+
+        finally:
+            latency( 0, -1 )
+
+            self.assertFalse( serial_info( comm1 )[ 4 ] & ASYNC_LOW_LATENCY )
+
+            comm1.close()
+            comm2.close()
+            os.close( ctl )
+
+    def test_26_LatencyHistograms(self):
+
+        directory = os.path.join( LATENCY_DEBUGFS, "0", "to_exogenous" )
+
+        if not os.path.isdir( directory ):
+            self.skipTest( "debugfs is not mounted" )
+
+        def histogram():
+            with open( os.path.join( directory, "histogram" ) ) as f:
+                rows = [ line.split() for line in f if not line.startswith( "#" ) ]
+            return [ ( int( ns ), int( latency ), int( residency ) ) for ns, latency, residency in rows ]
+
+        def reset():
+            with open( os.path.join( directory, "reset" ), "w" ) as f:
+                f.write( "1" )
+
+        comm1 = serial.Serial( str( self.__EmulatedPort + "0" ), 9600, timeout = 1 )
+        comm2 = serial.Serial( str( self.__Exogenous + "0" ), 9600, timeout = 1 )
+
+        try:
+            reset()
+
+            self.assertEqual( sum( row[ 1 ] + row[ 2 ] for row in histogram() ), 0 )
+
+            # each chunk is read before the next one is written, so all are timed
+            for i in range( 20 ):
+                comm1.write( b"sample %d\n" % i )
+                self.assertEqual( comm2.readline(), b"sample %d\n" % i )
+
+            rows = histogram()
+
+            self.assertEqual( len( rows ), 32 )
+            self.assertEqual( sum( row[ 1 ] for row in rows ), 20 )
+            self.assertEqual( sum( row[ 2 ] for row in rows ), 20 )
+
+            # a chunk waits at least as long from its write as from its push
+            waited = lambda column: sum( row[ 0 ] * row[ column ] for row in rows )
+            self.assertGreaterEqual( waited( 1 ), waited( 2 ) )
+
+            # the other direction was left alone
+            with open( os.path.join( LATENCY_DEBUGFS, "0", "to_emulated", "histogram" ) ) as f:
+                self.assertEqual( len( f.readlines() ), 33 )
+
+            reset()
+
+            self.assertEqual( sum( row[ 1 ] + row[ 2 ] for row in histogram() ), 0 )
+
+        finally:
+            comm1.close()
+            comm2.close()
+
+    def test_27_NetworkBridge(self):
+
+        bridge = os.path.join( os.path.dirname( os.path.abspath( __file__ ) ), "vb_bridge" )
+
+        if not os.access( bridge, os.X_OK ):
+            self.skipTest( "run 'make bridge' first" )
+
+        daemon = subprocess.Popen( [ bridge, "-p", str( BRIDGE_PORT ), "-n", "1" ] )
+        comm1 = serial.Serial( str( self.__EmulatedPort + "0" ), 9600, timeout = 1 )
+        remote = None
+
+        try:
+            # give the daemon time to listen
+            for attempt in range( 50 ):
+                try:
+                    remote = serial.serial_for_url( "rfc2217://127.0.0.1:%d" % BRIDGE_PORT,
+                        baudrate = 19200, timeout = 1 )
+                    break
+                except serial.SerialException:
+                    time.sleep( 0.1 )
+
+            self.assertIsNotNone( remote )
+
+            # IAC bytes are escaped on the wire and arrive once
+            remote.write( b"to robot \xff\n" )
+            self.assertEqual( comm1.readline(), b"to robot \xff\n" )
+
+            comm1.write( b"from robot \xff\xff\n" )
+            self.assertEqual( remote.readline(), b"from robot \xff\xff\n" )
+
+            # the baud rate asked for over the network is the one of the port
+            exogenous = os.open( str( self.__Exogenous + "0" ), os.O_RDWR | os.O_NOCTTY | os.O_NONBLOCK )
+
+            try:
+                self.assertEqual( termios.tcgetattr( exogenous )[ 4 ], termios.B19200 )
+            finally:
+                os.close( exogenous )
+
+            # DTR reaches the robot, its RTS comes back as CTS
+            remote.dtr = False
+            time.sleep( 0.1 )
+            self.assertFalse( comm1.dsr )
+            self.assertFalse( comm1.cd )
+
+            remote.dtr = True
+            time.sleep( 0.1 )
+            self.assertTrue( comm1.dsr )
+            self.assertTrue( comm1.cd )
+
+            comm1.rts = False
+            time.sleep( 0.2 )
+            self.assertFalse( remote.cts )
+
+            comm1.rts = True
+            time.sleep( 0.2 )
+            self.assertTrue( remote.cts )
+
+        finally:
+            if remote is not None:
+                remote.close()
+
+            daemon.terminate()
+            daemon.wait()
+            comm1.close()
+
+    def test_28_BusMemberWithFaultsMissesNothing(self):
+
+        ctl = os.open( SERIALEMU_CTL, os.O_RDWR )
+
+        members = []
+
+        for i in range( 2 ):
+            request = bytearray( struct.pack( PAIR_INFO_FORMAT, SERIALEMU_ANY_INDEX, 0, b"", b"" ) )
+            fcntl.ioctl( ctl, SERIALEMU_IOC_CREATE, request )
+            members.append( struct.unpack( PAIR_INFO_FORMAT, request )[ 0 ] )
+
+        for index in members:
+            fcntl.ioctl( ctl, SERIALEMU_IOC_BUS_ATTACH, struct.pack( "II", 0, index ) )
+
+            for i in range( 50 ):
+                if os.path.exists( self.__EmulatedPort + str( index ) ):
+                    break
+                time.sleep( 0.1 )
+
+        # every byte reaches the second member twice
+        fcntl.ioctl( ctl, SERIALEMU_IOC_SET_FAULTS,
+            struct.pack( FAULTS_FORMAT, members[ 1 ], SERIALEMU_TO_EMULATED, 0, 0, 0, 1000000, 0, 0, 0 ) )
+
+        clean = serial.Serial( self.__EmulatedPort + str( members[ 0 ] ), 9600, timeout = 1 )
+        faulty = serial.Serial( self.__EmulatedPort + str( members[ 1 ] ), 9600, timeout = 1 )
+        master = os.open( str( self.__Exogenous + "0" ), os.O_WRONLY | os.O_NOCTTY | os.O_NONBLOCK )
+        tty.setraw( master )
+
+        # the faulty member's own Exogenous port competes for its room
+        rival = os.open( str( self.__Exogenous + str( members[ 1 ] ) ), os.O_WRONLY | os.O_NOCTTY | os.O_NONBLOCK )
+        tty.setraw( rival )
+
+        def fill( fd, data, total ):
+            while True:
+                try:
+                    total[ 0 ] += os.write( fd, data )
+                except BlockingIOError:
+                    break
+
+        try:
+            # nobody reads: the faulty member fills up first and holds the bus
+            data = bytes( range( 255 ) ) * 4
+            accepted = [ 0 ]
+            rival_accepted = [ 0 ]
+
+            rival_thread = threading.Thread( target = fill, args = ( rival, b"\xff" * 64, rival_accepted ) )
+            rival_thread.start()
+            fill( master, data, accepted )
+            rival_thread.join()
+
+            accepted = accepted[ 0 ]
+
+            self.assertGreater( accepted, 0 )
+
+            sent = ( data * ( accepted // len( data ) + 1 ) )[ :accepted ]
+
+            # what the master was told went out reached both members, once
+            self.assertEqual( clean.read( accepted ), sent )
+
+            received = faulty.read( 2 * ( accepted + rival_accepted[ 0 ] ) )
+
+            self.assertEqual( received.replace( b"\xff", b"" ), bytes( b for b in sent for i in range( 2 ) ) )
+            self.assertEqual( received.count( b"\xff" ), 2 * rival_accepted[ 0 ] )
+
+        finally:
+            os.close( rival )
+            os.close( master )
+            clean.close()
+            faulty.close()
+
+            for index in members:
+                fcntl.ioctl( ctl, SERIALEMU_IOC_DESTROY, struct.pack( "I", index ) )
+
+            os.close( ctl )
+
+    def test_29_ReplayIntoAClosedPortIsDropped(self):
+
+        def dropped():
+            with open( "/sys/class/tty/ttyEmulatedPort0/stats/tx_dropped" ) as attribute:
+                return int( attribute.read() )
+
+        replay = os.open( SERIALEMU_REPLAY, os.O_WRONLY )
+
+        fcntl.ioctl( replay, SERIALEMU_IOC_REPLAY_START, struct.pack( "II", 0, 0 ) )
+
+        before = dropped()
+
+        # far more than the flip buffer of the closed Exogenous port holds
+        data = b"stale" * 200
+        records = ( struct.pack( CAPTURE_RECORD_FORMAT, 0, 0, len( data ), 0, 0 ) + data ) * 100
+
+        try:
+            # a write stops at the first record that doesn't fit the queue
+            written = 0
+            while written < len( records ):
+                written += os.write( replay, records[ written: ] )
+
+            # ends instead of waiting for a reader
+            os.fsync( replay )
+
+            self.assertEqual( dropped() - before, len( data ) * 100 )
+
+            # none of it reaches the next open
+            comm2 = serial.Serial( str( self.__Exogenous + "0" ), 9600, timeout = 0.5 )
+            self.assertEqual( comm2.read( 1 ), b"" )
+            comm2.close()
+
+        finally:
+            os.close( replay )
+
+    def test_30_StoreTurnedOffForgetsDataOnClose(self):
+
+        ctl = os.open( SERIALEMU_CTL, os.O_RDWR )
+
+        def store( policy, limit ):
+            fcntl.ioctl( ctl, SERIALEMU_IOC_SET_STORE,
+                struct.pack( STORE_FORMAT, 0, SERIALEMU_TO_EXOGENOUS, policy, 0, limit ) )
+
+        def depth( value ):
+            reply = fcntl.ioctl( ctl, SERIALEMU_IOC_DEPTH,
+                struct.pack( DEPTH_FORMAT, 0, SERIALEMU_TO_EXOGENOUS, value, 0, 0, 0 ) )
+            return struct.unpack( DEPTH_FORMAT, reply )[ 2 ]
+
+        default = depth( 0 )
+
+        writer = os.open( str( self.__EmulatedPort + "0" ), os.O_WRONLY | os.O_NOCTTY | os.O_NONBLOCK )
+        tty.setraw( writer )
+
+        try:
+            depth( 4096 )
+            store( SERIALEMU_STORE_BLOCK, 65536 )
+
+            # held while the Exogenous port is closed
+            self.assertEqual( os.write( writer, b"old" * 10000 ), 30000 )
+
+            # the flip buffer and the line discipline take part of it, the rest stays held
+            comm2 = serial.Serial( str( self.__Exogenous + "0" ), 9600, timeout = 0.5 )
+            time.sleep( 0.2 )
+
+            store( SERIALEMU_STORE_OFF, 0 )
+
+            comm2.close()
+
+            # nothing is held anymore, writing fails like without a store
+            with self.assertRaises( OSError ) as error:
+                os.write( writer, b"new" )
+
+            self.assertEqual( error.exception.errno, errno.ENODEV )
+
+            # and the next reader gets none of the old data
+            comm2 = serial.Serial( str( self.__Exogenous + "0" ), 9600, timeout = 0.5 )
+            self.assertEqual( comm2.read( 1 ), b"" )
+            comm2.close()
+
+        finally:
+            store( SERIALEMU_STORE_OFF, 65536 )
+            depth( default )
+
+            os.close( writer )
+            os.close( ctl )
+
 if __name__ == '__main__':
     unittest.main()
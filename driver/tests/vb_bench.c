@@ -0,0 +1,861 @@
+/*
+ * Serial Port Emulator benchmark
+ *
+ * Copyright (C) 2023 Bruno Policarpo (bruno.freitas@cefet-rj.br)
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, version 2 of the License.
+ *
+ * Measures the driver from user space:
+ *
+ *   throughput  one-way MB/s from /dev/ttyEmulatedPortN to /dev/ttyExogenousN
+ *               for a range of write sizes
+ *   latency     ping-pong round trips, p50/p99/p99.9 in microseconds
+ *   openclose   how fast a port can be opened and closed
+ *   pairs       aggregate throughput of 1 to N pairs written at once
+ *   threads     aggregate throughput of 1 to N threads writing one pair
+ *
+ * The results are printed as a table, CSV or JSON. A CSV written with -w can
+ * be given back with -b: every result that got worse by more than the
+ * tolerance is reported and the exit status is 2.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define EMULATED_PORT	"/dev/ttyEmulatedPort"
+#define EXOGENOUS_PORT	"/dev/ttyExogenous"
+
+#define READ_CHUNK	65536
+
+/* Time to wait for the reader to drain after the writer stops */
+#define DRAIN_TIMEOUT_NS	(5 * 1000000000LL)
+
+/* Write size of the latency and scaling runs, unless -l is given */
+#define LATENCY_SIZE	16
+#define SCALING_SIZE	4096
+
+#define MAX_SIZES	32
+#define MAX_PAIRS	256
+#define MAX_THREADS	256
+#define MAX_RESULTS	256
+
+#define TEST_THROUGHPUT	0x01
+#define TEST_LATENCY	0x02
+#define TEST_OPENCLOSE	0x04
+#define TEST_PAIRS	0x08
+#define TEST_THREADS	0x10
+#define TEST_ALL	0x1f
+
+static const size_t default_sizes[] = { 1, 64, 4096, 65536 };
+
+static const struct {
+	const char *name;
+	int mask;
+} test_names[] = {
+	{ "throughput", TEST_THROUGHPUT },
+	{ "latency", TEST_LATENCY },
+	{ "openclose", TEST_OPENCLOSE },
+	{ "pairs", TEST_PAIRS },
+	{ "threads", TEST_THREADS },
+	{ "all", TEST_ALL },
+};
+
+enum format { FORMAT_TEXT, FORMAT_CSV, FORMAT_JSON };
+
+/* One number measured, the key of a baseline entry is all but 'value' */
+struct result {
+	char test[16];
+	size_t size;
+	int pairs;
+	int threads;
+	char metric[16];
+	double value;
+	int higher_better;
+
+	int has_baseline;
+	double baseline;
+	int regression;
+};
+
+static struct result results[MAX_RESULTS];
+static int nresults;
+
+struct reader_ctx {
+	int fd;
+	atomic_llong received;
+	atomic_int stop;
+	pthread_t thread;
+};
+
+struct writer_ctx {
+	int fd;
+	size_t size;
+	long long deadline;
+	long long written;
+	pthread_t thread;
+};
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int open_raw(const char *path, int flags)
+{
+	struct termios tio;
+	int fd;
+
+	fd = open(path, flags | O_NOCTTY);
+	if (fd < 0) {
+		fprintf(stderr, "vb_bench: cannot open %s: %s\n",
+			path, strerror(errno));
+		return -1;
+	}
+
+	if (tcgetattr(fd, &tio) == 0) {
+		cfmakeraw(&tio);
+		tio.c_cc[VMIN] = 1;
+		tio.c_cc[VTIME] = 0;
+		tcsetattr(fd, TCSANOW, &tio);
+	}
+
+	return fd;
+}
+
+static int open_port(const char *prefix, int port, int flags)
+{
+	char path[64];
+
+	snprintf(path, sizeof(path), "%s%d", prefix, port);
+
+	return open_raw(path, flags);
+}
+
+static void add_result(const char *test, size_t size, int pairs, int threads,
+	const char *metric, double value, int higher_better)
+{
+	struct result *r;
+
+	if (nresults == MAX_RESULTS) {
+		fprintf(stderr, "vb_bench: too many results, %s dropped\n", test);
+		return;
+	}
+
+	r = &results[nresults++];
+	memset(r, 0, sizeof(*r));
+
+	snprintf(r->test, sizeof(r->test), "%s", test);
+	snprintf(r->metric, sizeof(r->metric), "%s", metric);
+	r->size = size;
+	r->pairs = pairs;
+	r->threads = threads;
+	r->value = value;
+	r->higher_better = higher_better;
+}
+
+static void *reader_thread(void *arg)
+{
+	struct reader_ctx *ctx = arg;
+	char *buffer;
+	ssize_t n;
+
+	buffer = malloc(READ_CHUNK);
+	if (!buffer)
+		return NULL;
+
+	while (!atomic_load(&ctx->stop)) {
+		n = read(ctx->fd, buffer, READ_CHUNK);
+		if (n > 0)
+			atomic_fetch_add(&ctx->received, n);
+		else if (n < 0 && errno != EINTR && errno != EAGAIN)
+			break;
+	}
+
+	free(buffer);
+
+	return NULL;
+}
+
+static void *writer_thread(void *arg)
+{
+	struct writer_ctx *ctx = arg;
+	char *buffer;
+	ssize_t n;
+
+	buffer = malloc(ctx->size);
+	if (!buffer)
+		return NULL;
+
+	memset(buffer, 'x', ctx->size);
+
+	while (now_ns() < ctx->deadline) {
+		n = write(ctx->fd, buffer, ctx->size);
+		if (n < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			fprintf(stderr, "vb_bench: write: %s\n", strerror(errno));
+			break;
+		}
+		ctx->written += n;
+	}
+
+	free(buffer);
+
+	return NULL;
+}
+
+/*
+ * Writes blocks of 'size' bytes for 'seconds' on 'npairs' pairs from
+ * 'nthreads' threads, thread i writing pair i % npairs, and returns the
+ * aggregate throughput in MB/s, measured until the last byte has been read
+ * on the peers.
+ */
+static int bench_stream(int base, int npairs, int nthreads, size_t size,
+	double seconds, double *mbps)
+{
+	struct reader_ctx *readers;
+	struct writer_ctx *writers;
+	int *wfds;
+	long long start, deadline, end, received, written, *expected;
+	int p, t, opened = 0, started = 0, ret = -1;
+
+	readers = calloc(npairs, sizeof(*readers));
+	writers = calloc(nthreads, sizeof(*writers));
+	wfds = calloc(npairs, sizeof(*wfds));
+	expected = calloc(npairs, sizeof(*expected));
+	if (!readers || !writers || !wfds || !expected)
+		goto free_all;
+
+	for (p = 0; p < npairs; p++, opened++) {
+		readers[p].fd = open_port(EXOGENOUS_PORT, base + p, O_RDONLY | O_NONBLOCK);
+		if (readers[p].fd < 0)
+			goto close_ports;
+
+		/* blocking reads from here on, the port is already open */
+		fcntl(readers[p].fd, F_SETFL, 0);
+
+		wfds[p] = open_port(EMULATED_PORT, base + p, O_WRONLY);
+		if (wfds[p] < 0) {
+			close(readers[p].fd);
+			goto close_ports;
+		}
+
+		atomic_init(&readers[p].received, 0);
+		atomic_init(&readers[p].stop, 0);
+	}
+
+	for (p = 0; p < npairs; p++, started++) {
+		if (pthread_create(&readers[p].thread, NULL, reader_thread, &readers[p]))
+			goto stop_readers;
+	}
+
+	start = now_ns();
+
+	for (t = 0; t < nthreads; t++) {
+		writers[t].fd = wfds[t % npairs];
+		writers[t].size = size;
+		writers[t].deadline = start + (long long)(seconds * 1e9);
+
+		if (pthread_create(&writers[t].thread, NULL, writer_thread, &writers[t])) {
+			nthreads = t;
+			break;
+		}
+	}
+
+	for (t = 0; t < nthreads; t++) {
+		pthread_join(writers[t].thread, NULL);
+		expected[t % npairs] += writers[t].written;
+	}
+
+	for (p = 0, written = 0; p < npairs; p++)
+		written += expected[p];
+
+	deadline = now_ns() + DRAIN_TIMEOUT_NS;
+
+	do {
+		for (p = 0, received = 0; p < npairs; p++)
+			received += atomic_load(&readers[p].received);
+
+		if (received >= written)
+			break;
+
+		usleep(100);
+	} while (now_ns() < deadline);
+
+	end = now_ns();
+
+	if (received < written)
+		fprintf(stderr, "vb_bench: %lld of %lld bytes lost\n",
+			written - received, written);
+
+	*mbps = (double)received / ((end - start) / 1e9) / 1e6;
+	ret = 0;
+
+stop_readers:
+	for (p = 0; p < started; p++) {
+		/* unblock the reader with a last byte */
+		atomic_store(&readers[p].stop, 1);
+		if (write(wfds[p], "", 1) < 0)
+			pthread_cancel(readers[p].thread);
+		pthread_join(readers[p].thread, NULL);
+	}
+close_ports:
+	for (p = 0; p < opened; p++) {
+		close(wfds[p]);
+		close(readers[p].fd);
+	}
+free_all:
+	free(expected);
+	free(wfds);
+	free(writers);
+	free(readers);
+
+	return ret;
+}
+
+static int read_full(int fd, char *buffer, size_t count)
+{
+	ssize_t n;
+
+	while (count) {
+		n = read(fd, buffer, count);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (n == 0)
+			return -1;
+		buffer += n;
+		count -= n;
+	}
+
+	return 0;
+}
+
+struct echo_ctx {
+	int fd;
+	size_t size;
+	atomic_int stop;
+};
+
+/* Sends every message back on the Exogenous port */
+static void *echo_thread(void *arg)
+{
+	struct echo_ctx *ctx = arg;
+	char *buffer;
+
+	buffer = malloc(ctx->size);
+	if (!buffer)
+		return NULL;
+
+	while (!read_full(ctx->fd, buffer, ctx->size) && !atomic_load(&ctx->stop)) {
+		if (write(ctx->fd, buffer, ctx->size) != (ssize_t)ctx->size)
+			break;
+	}
+
+	free(buffer);
+
+	return NULL;
+}
+
+static int compare_ll(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double percentile_us(const long long *samples, long n, double p)
+{
+	long i = (long)(p / 100.0 * (n - 1) + 0.5);
+
+	return samples[i] / 1e3;
+}
+
+/*
+ * Sends 'size' bytes from the EmulatedPort, waits for them to come back
+ * from an echo on the Exogenous port, and repeats for 'seconds'
+ */
+static int bench_latency(int port, size_t size, double seconds,
+	double *p50, double *p99, double *p999)
+{
+	struct echo_ctx echo;
+	pthread_t thread;
+	long long *samples = NULL, *grown, deadline, before;
+	long nsamples = 0, capacity = 0;
+	char *buffer;
+	int fd, ret = -1;
+
+	echo.size = size;
+	atomic_init(&echo.stop, 0);
+
+	echo.fd = open_port(EXOGENOUS_PORT, port, O_RDWR | O_NONBLOCK);
+	if (echo.fd < 0)
+		return -1;
+
+	fcntl(echo.fd, F_SETFL, 0);
+
+	fd = open_port(EMULATED_PORT, port, O_RDWR);
+	if (fd < 0)
+		goto close_echo;
+
+	buffer = malloc(size);
+	if (!buffer)
+		goto close_port;
+
+	memset(buffer, 'x', size);
+
+	if (pthread_create(&thread, NULL, echo_thread, &echo))
+		goto free_buffer;
+
+	deadline = now_ns() + (long long)(seconds * 1e9);
+
+	while (now_ns() < deadline) {
+		if (nsamples == capacity) {
+			capacity = capacity ? capacity * 2 : 65536;
+			grown = realloc(samples, capacity * sizeof(*samples));
+			if (!grown)
+				break;
+			samples = grown;
+		}
+
+		before = now_ns();
+
+		if (write(fd, buffer, size) != (ssize_t)size ||
+		    read_full(fd, buffer, size)) {
+			fprintf(stderr, "vb_bench: ping-pong: %s\n", strerror(errno));
+			break;
+		}
+
+		samples[nsamples++] = now_ns() - before;
+	}
+
+	/* the last message is swallowed by the echo */
+	atomic_store(&echo.stop, 1);
+	if (write(fd, buffer, size) != (ssize_t)size)
+		pthread_cancel(thread);
+	pthread_join(thread, NULL);
+
+	if (nsamples) {
+		qsort(samples, nsamples, sizeof(*samples), compare_ll);
+
+		*p50 = percentile_us(samples, nsamples, 50.0);
+		*p99 = percentile_us(samples, nsamples, 99.0);
+		*p999 = percentile_us(samples, nsamples, 99.9);
+		ret = 0;
+	}
+
+	free(samples);
+free_buffer:
+	free(buffer);
+close_port:
+	close(fd);
+close_echo:
+	close(echo.fd);
+
+	return ret;
+}
+
+/*
+ * Opens and closes the EmulatedPort as fast as possible while the Exogenous
+ * port stays open, every cycle is a first open and a last close.
+ */
+static int bench_open_close(int port, double seconds, double *rate,
+	double *mean_us, double *max_us)
+{
+	char path[64];
+	long long start, deadline, before, elapsed, worst = 0, cycles = 0;
+	int peer, fd;
+
+	peer = open_port(EXOGENOUS_PORT, port, O_RDONLY | O_NONBLOCK);
+	if (peer < 0)
+		return -1;
+
+	snprintf(path, sizeof(path), "%s%d", EMULATED_PORT, port);
+
+	start = now_ns();
+	deadline = start + (long long)(seconds * 1e9);
+
+	do {
+		before = now_ns();
+
+		fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+		if (fd < 0) {
+			fprintf(stderr, "vb_bench: cannot open %s: %s\n",
+				path, strerror(errno));
+			close(peer);
+			return -1;
+		}
+		close(fd);
+
+		elapsed = now_ns() - before;
+		if (elapsed > worst)
+			worst = elapsed;
+
+		cycles++;
+	} while (before < deadline);
+
+	elapsed = now_ns() - start;
+
+	*rate = cycles / (elapsed / 1e9);
+	*mean_us = elapsed / 1e3 / cycles;
+	*max_us = worst / 1e3;
+
+	close(peer);
+
+	return 0;
+}
+
+/* 1, 2, 4... up to and including 'max' */
+static int next_step(int n, int max)
+{
+	return n < max && n * 2 > max ? max : n * 2;
+}
+
+static int run_scaling(const char *test, int base, int max, double seconds)
+{
+	double mbps;
+	int n;
+
+	for (n = 1; n <= max; n = next_step(n, max)) {
+		if (!strcmp(test, "pairs")) {
+			if (bench_stream(base, n, n, SCALING_SIZE, seconds, &mbps))
+				return -1;
+			add_result(test, SCALING_SIZE, n, n, "MB/s", mbps, 1);
+		} else {
+			if (bench_stream(base, 1, n, SCALING_SIZE, seconds, &mbps))
+				return -1;
+			add_result(test, SCALING_SIZE, 1, n, "MB/s", mbps, 1);
+		}
+
+		if (n == max)
+			break;
+	}
+
+	return 0;
+}
+
+static int same_key(const struct result *a, const struct result *b)
+{
+	return !strcmp(a->test, b->test) && !strcmp(a->metric, b->metric) &&
+		a->size == b->size && a->pairs == b->pairs &&
+		a->threads == b->threads;
+}
+
+/*
+ * Matches the results with a CSV written by -w, returns the number of
+ * regressions
+ */
+static int compare_baseline(const char *path, double tolerance)
+{
+	struct result base;
+	char line[256];
+	double change;
+	FILE *in;
+	int i, regressions = 0;
+
+	in = fopen(path, "r");
+	if (!in) {
+		fprintf(stderr, "vb_bench: cannot open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), in)) {
+		if (sscanf(line, "%15[^,],%zu,%d,%d,%15[^,],%lf", base.test,
+			   &base.size, &base.pairs, &base.threads, base.metric,
+			   &base.value) != 6)
+			continue;	/* the header */
+
+		for (i = 0; i < nresults; i++) {
+			if (!same_key(&results[i], &base) || base.value <= 0)
+				continue;
+
+			results[i].has_baseline = 1;
+			results[i].baseline = base.value;
+
+			change = (results[i].value - base.value) / base.value * 100.0;
+			if (!results[i].higher_better)
+				change = -change;
+
+			if (change < -tolerance) {
+				results[i].regression = 1;
+				regressions++;
+
+				fprintf(stderr, "vb_bench: regression: %s size %zu pairs %d "
+					"threads %d %s %.2f, baseline %.2f\n",
+					results[i].test, results[i].size,
+					results[i].pairs, results[i].threads,
+					results[i].metric, results[i].value, base.value);
+			}
+		}
+	}
+
+	fclose(in);
+
+	return regressions;
+}
+
+static void print_csv(FILE *out)
+{
+	int i;
+
+	fprintf(out, "test,size,pairs,threads,metric,value\n");
+
+	for (i = 0; i < nresults; i++)
+		fprintf(out, "%s,%zu,%d,%d,%s,%.3f\n", results[i].test,
+			results[i].size, results[i].pairs, results[i].threads,
+			results[i].metric, results[i].value);
+}
+
+static void print_json(FILE *out)
+{
+	int i;
+
+	fprintf(out, "[\n");
+
+	for (i = 0; i < nresults; i++) {
+		fprintf(out, "  { \"test\": \"%s\", \"size\": %zu, \"pairs\": %d, "
+			"\"threads\": %d, \"metric\": \"%s\", \"value\": %.3f",
+			results[i].test, results[i].size, results[i].pairs,
+			results[i].threads, results[i].metric, results[i].value);
+
+		if (results[i].has_baseline)
+			fprintf(out, ", \"baseline\": %.3f, \"regression\": %s",
+				results[i].baseline,
+				results[i].regression ? "true" : "false");
+
+		fprintf(out, " }%s\n", i + 1 < nresults ? "," : "");
+	}
+
+	fprintf(out, "]\n");
+}
+
+static void print_text(FILE *out)
+{
+	int i;
+
+	fprintf(out, "%-10s %8s %6s %8s %-10s %12s %12s\n", "test", "size",
+		"pairs", "threads", "metric", "value", "baseline");
+
+	for (i = 0; i < nresults; i++) {
+		fprintf(out, "%-10s %8zu %6d %8d %-10s %12.2f", results[i].test,
+			results[i].size, results[i].pairs, results[i].threads,
+			results[i].metric, results[i].value);
+
+		if (results[i].has_baseline)
+			fprintf(out, " %12.2f%s", results[i].baseline,
+				results[i].regression ? "  REGRESSION" : "");
+
+		fprintf(out, "\n");
+	}
+}
+
+static int parse_tests(char *list)
+{
+	char *tok;
+	size_t i;
+	int mask = 0;
+
+	for (tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+		for (i = 0; i < sizeof(test_names) / sizeof(*test_names); i++) {
+			if (!strcmp(tok, test_names[i].name))
+				break;
+		}
+
+		if (i == sizeof(test_names) / sizeof(*test_names)) {
+			fprintf(stderr, "vb_bench: unknown test %s\n", tok);
+			return -1;
+		}
+
+		mask |= test_names[i].mask;
+	}
+
+	return mask;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [-m tests] [-p port] [-d seconds] [-s size[,size...]]\n"
+		"          [-l size] [-P pairs] [-t threads] [-f format]\n"
+		"          [-w file] [-b file] [-T percent] [-o]\n"
+		"  -m tests    comma separated throughput, latency, openclose, pairs,\n"
+		"              threads or all (default throughput)\n"
+		"  -p port     pair index to use, the first one when scaling (default 0)\n"
+		"  -d seconds  duration of each run (default 2)\n"
+		"  -s sizes    comma separated write sizes in bytes "
+		"(default 1,64,4096,65536)\n"
+		"  -l size     message size of the latency test (default %d)\n"
+		"  -P pairs    most pairs used by the pairs test (default 4)\n"
+		"  -t threads  most writers used by the threads test (default 4)\n"
+		"  -f format   text, csv or json (default text)\n"
+		"  -w file     also write the results to file as CSV, to use as a baseline\n"
+		"  -b file     compare with a baseline, exit with 2 on a regression\n"
+		"  -T percent  worsening tolerated by -b (default 10)\n"
+		"  -o          same as -m openclose\n", name, LATENCY_SIZE);
+}
+
+int main(int argc, char *argv[])
+{
+	size_t sizes[MAX_SIZES];
+	size_t nsizes = 0, latency_size = LATENCY_SIZE, i;
+	double seconds = 2.0, tolerance = 10.0;
+	double mbps, rate, mean_us, max_us, p50, p99, p999;
+	const char *baseline = NULL, *save = NULL;
+	enum format format = FORMAT_TEXT;
+	int port = 0, max_pairs = 4, max_threads = 4, tests = TEST_THROUGHPUT;
+	int opt, regressions = 0;
+	FILE *out;
+	char *tok;
+
+	while ((opt = getopt(argc, argv, "m:p:d:s:l:P:t:f:w:b:T:oh")) != -1) {
+		switch (opt) {
+		case 'm':
+			tests = parse_tests(optarg);
+			if (tests < 0)
+				return 1;
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'd':
+			seconds = atof(optarg);
+			break;
+		case 's':
+			for (tok = strtok(optarg, ","); tok && nsizes < MAX_SIZES;
+			     tok = strtok(NULL, ","))
+				sizes[nsizes++] = strtoul(tok, NULL, 0);
+			break;
+		case 'l':
+			latency_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'P':
+			max_pairs = atoi(optarg);
+			break;
+		case 't':
+			max_threads = atoi(optarg);
+			break;
+		case 'f':
+			if (!strcmp(optarg, "csv"))
+				format = FORMAT_CSV;
+			else if (!strcmp(optarg, "json"))
+				format = FORMAT_JSON;
+			else if (!strcmp(optarg, "text"))
+				format = FORMAT_TEXT;
+			else {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'w':
+			save = optarg;
+			break;
+		case 'b':
+			baseline = optarg;
+			break;
+		case 'T':
+			tolerance = atof(optarg);
+			break;
+		case 'o':
+			tests = TEST_OPENCLOSE;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (max_pairs < 1 || max_pairs > MAX_PAIRS ||
+	    max_threads < 1 || max_threads > MAX_THREADS || !latency_size) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (!nsizes) {
+		for (i = 0; i < sizeof(default_sizes) / sizeof(*default_sizes); i++)
+			sizes[nsizes++] = default_sizes[i];
+	}
+
+	for (i = 0; (tests & TEST_THROUGHPUT) && i < nsizes; i++) {
+		if (!sizes[i])
+			continue;
+
+		if (bench_stream(port, 1, 1, sizes[i], seconds, &mbps))
+			return 1;
+
+		add_result("throughput", sizes[i], 1, 1, "MB/s", mbps, 1);
+	}
+
+	if (tests & TEST_LATENCY) {
+		if (bench_latency(port, latency_size, seconds, &p50, &p99, &p999))
+			return 1;
+
+		add_result("latency", latency_size, 1, 1, "p50_us", p50, 0);
+		add_result("latency", latency_size, 1, 1, "p99_us", p99, 0);
+		add_result("latency", latency_size, 1, 1, "p99.9_us", p999, 0);
+	}
+
+	if (tests & TEST_OPENCLOSE) {
+		if (bench_open_close(port, seconds, &rate, &mean_us, &max_us))
+			return 1;
+
+		add_result("openclose", 0, 1, 1, "cycles/s", rate, 1);
+		add_result("openclose", 0, 1, 1, "mean_us", mean_us, 0);
+		add_result("openclose", 0, 1, 1, "max_us", max_us, 0);
+	}
+
+	if ((tests & TEST_PAIRS) && run_scaling("pairs", port, max_pairs, seconds))
+		return 1;
+
+	if ((tests & TEST_THREADS) && run_scaling("threads", port, max_threads, seconds))
+		return 1;
+
+	if (baseline) {
+		regressions = compare_baseline(baseline, tolerance);
+		if (regressions < 0)
+			return 1;
+	}
+
+	switch (format) {
+	case FORMAT_CSV:
+		print_csv(stdout);
+		break;
+	case FORMAT_JSON:
+		print_json(stdout);
+		break;
+	default:
+		print_text(stdout);
+		break;
+	}
+
+	if (save) {
+		out = fopen(save, "w");
+		if (!out) {
+			fprintf(stderr, "vb_bench: cannot write %s: %s\n",
+				save, strerror(errno));
+			return 1;
+		}
+
+		print_csv(out);
+		fclose(out);
+	}
+
+	return regressions ? 2 : 0;
+}
@@ -0,0 +1,1146 @@
+/*
+ * Serial Port Emulator network bridge
+ *
+ * Copyright (C) 2023 Bruno Policarpo (bruno.freitas@cefet-rj.br)
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, version 2 of the License.
+ *
+ * Serves Exogenous ports over TCP, port n on the base TCP port plus n, so
+ * remote rigs reach the emulated robots without a relay per port. A single
+ * epoll loop serves every port. Each port takes one client at a time. The
+ * tty is opened when the client connects and closed when it leaves, which
+ * drops DTR towards the EmulatedPort like pulling a cable.
+ *
+ * By default the clients speak Telnet with the COM-PORT-OPTION of RFC 2217:
+ * baud rate, data size, parity and stop bits go to the termios of the port,
+ * DTR, RTS and flow control to its modem lines, and the lines driven by the
+ * EmulatedPort come back as modem state notifications. With -r the data is
+ * passed as is, like 'socat TCP-LISTEN:port /dev/ttyExogenous0,raw'.
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <termios.h>
+#include <unistd.h>
+
+#define DEFAULT_DEVICE	"/dev/ttyExogenous"
+#define DEFAULT_PORT	7000
+
+/* data read at once from either side */
+#define CHUNK		4096
+
+/* what is read from the tty may double when escaped, replies go on top */
+#define REPLY_ROOM	1024
+#define SOCK_BUFFER	(2 * CHUNK + REPLY_ROOM)
+
+/*
+ * Interval between two looks at the modem lines of the connected ports.
+ * The driver wakes TIOCMIWAIT on every change, but that ioctl blocks, and
+ * the single epoll loop serving all the ports can't wait in it.
+ */
+#define MODEM_POLL_MS	20
+
+#define MAX_EVENTS	64
+
+/* Telnet, RFC 854 */
+#define IAC		255
+#define DONT		254
+#define DO		253
+#define WONT		252
+#define WILL		251
+#define SB		250
+#define SE		240
+
+#define OPT_BINARY	0
+#define OPT_ECHO	1
+#define OPT_SGA		3
+#define OPT_COM_PORT	44
+
+/* RFC 2217 commands of the client, the server answers with the same plus 100 */
+#define CPO_SIGNATURE		0
+#define CPO_SET_BAUDRATE	1
+#define CPO_SET_DATASIZE	2
+#define CPO_SET_PARITY		3
+#define CPO_SET_STOPSIZE	4
+#define CPO_SET_CONTROL		5
+#define CPO_NOTIFY_LINESTATE	6
+#define CPO_NOTIFY_MODEMSTATE	7
+#define CPO_FLOWCONTROL_SUSPEND	8
+#define CPO_FLOWCONTROL_RESUME	9
+#define CPO_SET_LINESTATE_MASK	10
+#define CPO_SET_MODEMSTATE_MASK	11
+#define CPO_PURGE_DATA		12
+
+#define CPO_SERVER		100
+
+/* modem state bits, the deltas in the low nibble */
+#define MODEM_CD		0x80
+#define MODEM_RI		0x40
+#define MODEM_DSR		0x20
+#define MODEM_CTS		0x10
+#define MODEM_DELTA_CD		0x08
+#define MODEM_TRAILING_RI	0x04
+#define MODEM_DELTA_DSR		0x02
+#define MODEM_DELTA_CTS		0x01
+
+/* the transmit registers of a tty are always empty */
+#define LINESTATE_IDLE		0x60
+
+#define SIGNATURE	"vb_bridge"
+
+enum kind { KIND_LISTEN, KIND_SOCKET, KIND_TTY, KIND_TIMER };
+
+enum telnet_state { T_DATA, T_IAC, T_OPTION, T_SB, T_SB_IAC };
+
+struct port {
+	unsigned int slot;	/* in the table of ports */
+	unsigned int index;	/* of the pair */
+
+	int listen_fd;
+	int sock_fd;	/* -1 while nobody is connected */
+	int tty_fd;
+
+	/* events registered for each descriptor */
+	uint32_t sock_events;
+	uint32_t tty_events;
+
+	/* Telnet parser */
+	enum telnet_state state;
+	unsigned char command;
+	unsigned char sb[64];
+	size_t sb_len;
+	bool sb_overflow;
+
+	/* options enabled on our side and on the client's */
+	bool we[256];
+	bool they[256];
+
+	/* decoded from the socket, not yet written to the tty */
+	unsigned char to_tty[CHUNK];
+	size_t to_tty_len;
+
+	/* read from the tty or answered, not yet sent */
+	unsigned char to_sock[SOCK_BUFFER];
+	size_t to_sock_len;
+
+	unsigned char modem;
+	unsigned char modem_mask;
+	unsigned char line_mask;
+
+	/* the client asked us to hold the data of the tty */
+	bool suspended;
+
+	/* the client was told the state of the modem lines once */
+	bool notified;
+};
+
+static const struct {
+	speed_t code;
+	unsigned int baud;
+} speeds[] = {
+	{ B50, 50 }, { B75, 75 }, { B110, 110 }, { B134, 134 }, { B150, 150 },
+	{ B200, 200 }, { B300, 300 }, { B600, 600 }, { B1200, 1200 },
+	{ B1800, 1800 }, { B2400, 2400 }, { B4800, 4800 }, { B9600, 9600 },
+	{ B19200, 19200 }, { B38400, 38400 }, { B57600, 57600 },
+	{ B115200, 115200 }, { B230400, 230400 }, { B460800, 460800 },
+	{ B500000, 500000 }, { B576000, 576000 }, { B921600, 921600 },
+	{ B1000000, 1000000 }, { B1152000, 1152000 }, { B1500000, 1500000 },
+	{ B2000000, 2000000 }, { B2500000, 2500000 }, { B3000000, 3000000 },
+	{ B3500000, 3500000 }, { B4000000, 4000000 },
+};
+
+static int epoll_fd;
+static const char *device = DEFAULT_DEVICE;
+static bool raw;
+static bool verbose;
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+static uint64_t event_key(enum kind kind, unsigned int index)
+{
+	return (uint64_t)index << 2 | kind;
+}
+
+static int watch(int fd, enum kind kind, unsigned int index, uint32_t events)
+{
+	struct epoll_event ev = { .events = events, .data.u64 = event_key(kind, index) };
+
+	return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static void rewatch(int fd, enum kind kind, unsigned int index,
+	uint32_t *current, uint32_t events)
+{
+	struct epoll_event ev = { .events = events, .data.u64 = event_key(kind, index) };
+
+	if (*current == events)
+		return;
+
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) == 0)
+		*current = events;
+}
+
+/*
+ * Reads from a side only while there is room for what it sends to the
+ * other one, so a slow side pushes back on the fast one.
+ */
+static void update_events(struct port *p)
+{
+	uint32_t sock = 0, tty = 0;
+
+	if (p->to_tty_len < CHUNK)
+		sock |= EPOLLIN;
+	if (p->to_sock_len)
+		sock |= EPOLLOUT;
+
+	if (!p->suspended && SOCK_BUFFER - p->to_sock_len >= SOCK_BUFFER / 2)
+		tty |= EPOLLIN;
+	if (p->to_tty_len)
+		tty |= EPOLLOUT;
+
+	rewatch(p->sock_fd, KIND_SOCKET, p->slot, &p->sock_events, sock);
+	rewatch(p->tty_fd, KIND_TTY, p->slot, &p->tty_events, tty);
+}
+
+/* Queues bytes for the client, fails when it doesn't read its answers */
+static int sock_queue(struct port *p, const void *data, size_t len)
+{
+	if (SOCK_BUFFER - p->to_sock_len < len)
+		return -1;
+
+	memcpy(p->to_sock + p->to_sock_len, data, len);
+	p->to_sock_len += len;
+
+	return 0;
+}
+
+static int send_option(struct port *p, unsigned char command, unsigned char option)
+{
+	unsigned char msg[3] = { IAC, command, option };
+
+	if (verbose)
+		fprintf(stderr, "vb_bridge: port %u sends %u %u\n", p->index, command, option);
+
+	return sock_queue(p, msg, sizeof(msg));
+}
+
+/* Sends IAC SB COM-PORT-OPTION <code + 100> <value> IAC SE */
+static int send_com_port(struct port *p, unsigned char code,
+	const unsigned char *value, size_t len)
+{
+	unsigned char msg[4 + 2 * 64 + 2];
+	size_t n = 0, i;
+
+	if (len > 64)
+		len = 64;
+
+	msg[n++] = IAC;
+	msg[n++] = SB;
+	msg[n++] = OPT_COM_PORT;
+	msg[n++] = code + CPO_SERVER;
+
+	for (i = 0; i < len; i++) {
+		msg[n++] = value[i];
+		if (value[i] == IAC)
+			msg[n++] = IAC;
+	}
+
+	msg[n++] = IAC;
+	msg[n++] = SE;
+
+	return sock_queue(p, msg, n);
+}
+
+static int send_byte(struct port *p, unsigned char code, unsigned char value)
+{
+	return send_com_port(p, code, &value, 1);
+}
+
+static unsigned int termios_baud(const struct termios *tio)
+{
+	speed_t code = cfgetospeed(tio);
+	size_t i;
+
+	for (i = 0; i < sizeof(speeds) / sizeof(speeds[0]); i++)
+		if (speeds[i].code == code)
+			return speeds[i].baud;
+
+	return 0;
+}
+
+static int set_baud(struct termios *tio, unsigned int baud)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(speeds) / sizeof(speeds[0]); i++)
+		if (speeds[i].baud == baud)
+			return cfsetspeed(tio, speeds[i].code);
+
+	return -1;
+}
+
+static unsigned char termios_datasize(const struct termios *tio)
+{
+	switch (tio->c_cflag & CSIZE) {
+	case CS5:
+		return 5;
+	case CS6:
+		return 6;
+	case CS7:
+		return 7;
+	default:
+		return 8;
+	}
+}
+
+/* RFC 2217 parity: 1 none, 2 odd, 3 even, 4 mark, 5 space */
+static unsigned char termios_parity(const struct termios *tio)
+{
+	if (!(tio->c_cflag & PARENB))
+		return 1;
+
+	if (tio->c_cflag & CMSPAR)
+		return tio->c_cflag & PARODD ? 4 : 5;
+
+	return tio->c_cflag & PARODD ? 2 : 3;
+}
+
+/*
+ * Applies one termios setting of the client and answers with the value in
+ * effect, which stays the old one when the value is not supported. A value
+ * of 0 only asks for the current one.
+ */
+static int set_termios(struct port *p, unsigned char code, const unsigned char *value, size_t len)
+{
+	static const tcflag_t sizes[] = { CS5, CS6, CS7, CS8 };
+	struct termios tio;
+	unsigned char reply[4];
+	uint32_t baud;
+
+	if (tcgetattr(p->tty_fd, &tio))
+		return -1;
+
+	switch (code) {
+	case CPO_SET_BAUDRATE:
+		if (len < 4)
+			return 0;
+
+		memcpy(&baud, value, 4);
+		baud = ntohl(baud);
+
+		if (baud && set_baud(&tio, baud) == 0)
+			tcsetattr(p->tty_fd, TCSANOW, &tio);
+
+		tcgetattr(p->tty_fd, &tio);
+		baud = htonl(termios_baud(&tio));
+		memcpy(reply, &baud, 4);
+
+		return send_com_port(p, code, reply, 4);
+
+	case CPO_SET_DATASIZE:
+		if (len >= 1 && value[0] >= 5 && value[0] <= 8) {
+			tio.c_cflag = (tio.c_cflag & ~CSIZE) | sizes[value[0] - 5];
+			tcsetattr(p->tty_fd, TCSANOW, &tio);
+		}
+
+		tcgetattr(p->tty_fd, &tio);
+
+		return send_byte(p, code, termios_datasize(&tio));
+
+	case CPO_SET_PARITY:
+		if (len >= 1 && value[0] >= 1 && value[0] <= 5) {
+			tio.c_cflag &= ~(PARENB | PARODD | CMSPAR);
+
+			if (value[0] != 1)
+				tio.c_cflag |= PARENB;
+			if (value[0] == 2 || value[0] == 4)
+				tio.c_cflag |= PARODD;
+			if (value[0] >= 4)
+				tio.c_cflag |= CMSPAR;
+
+			tcsetattr(p->tty_fd, TCSANOW, &tio);
+		}
+
+		tcgetattr(p->tty_fd, &tio);
+
+		return send_byte(p, code, termios_parity(&tio));
+
+	case CPO_SET_STOPSIZE:
+		/* 1, 2, or 3 for 1.5 which a tty can't do */
+		if (len >= 1 && (value[0] == 1 || value[0] == 2)) {
+			if (value[0] == 2)
+				tio.c_cflag |= CSTOPB;
+			else
+				tio.c_cflag &= ~CSTOPB;
+
+			tcsetattr(p->tty_fd, TCSANOW, &tio);
+		}
+
+		tcgetattr(p->tty_fd, &tio);
+
+		return send_byte(p, code, tio.c_cflag & CSTOPB ? 2 : 1);
+	}
+
+	return 0;
+}
+
+static int set_modem_line(struct port *p, int line, bool on)
+{
+	return ioctl(p->tty_fd, on ? TIOCMBIS : TIOCMBIC, &line);
+}
+
+/*
+ * SET-CONTROL: flow control, break, DTR and RTS. The answer carries the
+ * state in effect, the requests for the current state are answered the same.
+ */
+static int set_control(struct port *p, unsigned char value)
+{
+	struct termios tio;
+	int lines = 0;
+
+	if (tcgetattr(p->tty_fd, &tio))
+		return -1;
+
+	switch (value) {
+	case 1:
+	case 2:
+	case 3:
+		tio.c_cflag &= ~CRTSCTS;
+		tio.c_iflag &= ~(IXON | IXOFF);
+
+		if (value == 2)
+			tio.c_iflag |= IXON | IXOFF;
+		else if (value == 3)
+			tio.c_cflag |= CRTSCTS;
+
+		tcsetattr(p->tty_fd, TCSANOW, &tio);
+		/* fall through */
+	case 0:
+		tcgetattr(p->tty_fd, &tio);
+
+		if (tio.c_cflag & CRTSCTS)
+			value = 3;
+		else if (tio.c_iflag & IXON)
+			value = 2;
+		else
+			value = 1;
+		break;
+
+	case 4:
+	case 5:
+	case 6:
+		/* the emulated line has no break, it is never on */
+		if (value == 5)
+			ioctl(p->tty_fd, TIOCSBRK);
+		else if (value == 6)
+			ioctl(p->tty_fd, TIOCCBRK);
+		value = 6;
+		break;
+
+	case 7:
+	case 8:
+	case 9:
+		if (value != 7)
+			set_modem_line(p, TIOCM_DTR, value == 8);
+
+		ioctl(p->tty_fd, TIOCMGET, &lines);
+		value = lines & TIOCM_DTR ? 8 : 9;
+		break;
+
+	case 10:
+	case 11:
+	case 12:
+		if (value != 10)
+			set_modem_line(p, TIOCM_RTS, value == 11);
+
+		ioctl(p->tty_fd, TIOCMGET, &lines);
+		value = lines & TIOCM_RTS ? 11 : 12;
+		break;
+
+	default:
+		/* inbound flow control is the same as outbound here */
+		break;
+	}
+
+	return send_byte(p, CPO_SET_CONTROL, value);
+}
+
+/* State of the lines the EmulatedPort drives, in RFC 2217 bits */
+static unsigned char modem_state(struct port *p)
+{
+	unsigned char state = 0;
+	int lines;
+
+	if (ioctl(p->tty_fd, TIOCMGET, &lines))
+		return 0;
+
+	if (lines & TIOCM_CAR)
+		state |= MODEM_CD;
+	if (lines & TIOCM_RNG)
+		state |= MODEM_RI;
+	if (lines & TIOCM_DSR)
+		state |= MODEM_DSR;
+	if (lines & TIOCM_CTS)
+		state |= MODEM_CTS;
+
+	return state;
+}
+
+/*
+ * Notifies the client of the lines that changed since the last look. A
+ * client that doesn't read gets the change once it does.
+ */
+static int poll_modem(struct port *p)
+{
+	unsigned char state = modem_state(p), changed = state ^ p->modem, deltas = 0;
+
+	if (!changed || SOCK_BUFFER - p->to_sock_len < REPLY_ROOM)
+		return 0;
+
+	if (changed & MODEM_CD)
+		deltas |= MODEM_DELTA_CD;
+	if (changed & p->modem & MODEM_RI)
+		deltas |= MODEM_TRAILING_RI;
+	if (changed & MODEM_DSR)
+		deltas |= MODEM_DELTA_DSR;
+	if (changed & MODEM_CTS)
+		deltas |= MODEM_DELTA_CTS;
+
+	p->modem = state;
+
+	if (!((state | deltas) & p->modem_mask))
+		return 0;
+
+	return send_byte(p, CPO_NOTIFY_MODEMSTATE, (state | deltas) & p->modem_mask);
+}
+
+static int com_port_command(struct port *p, const unsigned char *sb, size_t len)
+{
+	unsigned char code, value;
+
+	if (len < 1)
+		return 0;
+
+	code = sb[0];
+	value = len > 1 ? sb[1] : 0;
+
+	if (verbose)
+		fprintf(stderr, "vb_bridge: port %u COM-PORT-OPTION %u\n", p->index, code);
+
+	switch (code) {
+	case CPO_SIGNATURE:
+		return send_com_port(p, code, (const unsigned char *)SIGNATURE,
+			strlen(SIGNATURE));
+
+	case CPO_SET_BAUDRATE:
+	case CPO_SET_DATASIZE:
+	case CPO_SET_PARITY:
+	case CPO_SET_STOPSIZE:
+		return set_termios(p, code, sb + 1, len - 1);
+
+	case CPO_SET_CONTROL:
+		return set_control(p, value);
+
+	case CPO_NOTIFY_LINESTATE:
+		return send_byte(p, code, LINESTATE_IDLE & p->line_mask);
+
+	case CPO_NOTIFY_MODEMSTATE:
+		p->modem = modem_state(p);
+		return send_byte(p, code, p->modem & p->modem_mask);
+
+	case CPO_FLOWCONTROL_SUSPEND:
+		p->suspended = true;
+		return 0;
+
+	case CPO_FLOWCONTROL_RESUME:
+		p->suspended = false;
+		return 0;
+
+	case CPO_SET_LINESTATE_MASK:
+		p->line_mask = value;
+		return send_byte(p, code, value);
+
+	case CPO_SET_MODEMSTATE_MASK:
+		p->modem_mask = value;
+		return send_byte(p, code, value);
+
+	case CPO_PURGE_DATA:
+		if (value == 1)
+			tcflush(p->tty_fd, TCIFLUSH);
+		else if (value == 2)
+			tcflush(p->tty_fd, TCOFLUSH);
+		else if (value == 3)
+			tcflush(p->tty_fd, TCIOFLUSH);
+		return send_byte(p, code, value);
+	}
+
+	return 0;
+}
+
+static bool option_supported(unsigned char option)
+{
+	return option == OPT_BINARY || option == OPT_SGA || option == OPT_COM_PORT;
+}
+
+/*
+ * Answers DO, DONT, WILL and WONT. An option is only answered when its
+ * state changes, which keeps both ends from looping (RFC 854).
+ */
+static int negotiate(struct port *p, unsigned char command, unsigned char option)
+{
+	/* clients don't ask for the lines before the first change */
+	if (option == OPT_COM_PORT && (command == DO || command == WILL) && !p->notified) {
+		p->notified = true;
+
+		if (send_byte(p, CPO_NOTIFY_MODEMSTATE, p->modem & p->modem_mask))
+			return -1;
+	}
+
+	switch (command) {
+	case DO:
+		if (!option_supported(option))
+			return send_option(p, WONT, option);
+		if (p->we[option])
+			return 0;
+		p->we[option] = true;
+		return send_option(p, WILL, option);
+
+	case DONT:
+		if (!p->we[option])
+			return 0;
+		p->we[option] = false;
+		return send_option(p, WONT, option);
+
+	case WILL:
+		if (!option_supported(option))
+			return send_option(p, DONT, option);
+		if (p->they[option])
+			return 0;
+		p->they[option] = true;
+		return send_option(p, DO, option);
+
+	case WONT:
+		if (!p->they[option])
+			return 0;
+		p->they[option] = false;
+		return send_option(p, DONT, option);
+	}
+
+	return 0;
+}
+
+/*
+ * Strips the Telnet commands from what the client sent, the data left is
+ * appended to the tty queue. Never produces more bytes than it is given.
+ */
+static int telnet_input(struct port *p, const unsigned char *in, size_t len)
+{
+	unsigned char c;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		c = in[i];
+
+		switch (p->state) {
+		case T_DATA:
+			if (c == IAC)
+				p->state = T_IAC;
+			else
+				p->to_tty[p->to_tty_len++] = c;
+			break;
+
+		case T_IAC:
+			p->state = T_DATA;
+
+			if (c == IAC) {
+				p->to_tty[p->to_tty_len++] = c;
+			} else if (c == SB) {
+				p->sb_len = 0;
+				p->sb_overflow = false;
+				p->state = T_SB;
+			} else if (c == DO || c == DONT || c == WILL || c == WONT) {
+				p->command = c;
+				p->state = T_OPTION;
+			}
+			/* NOP, AYT and the like carry nothing for a serial line */
+			break;
+
+		case T_OPTION:
+			p->state = T_DATA;
+
+			if (negotiate(p, p->command, c))
+				return -1;
+			break;
+
+		case T_SB:
+			if (c == IAC) {
+				p->state = T_SB_IAC;
+				break;
+			}
+
+			if (p->sb_len < sizeof(p->sb))
+				p->sb[p->sb_len++] = c;
+			else
+				p->sb_overflow = true;
+			break;
+
+		case T_SB_IAC:
+			if (c == IAC) {
+				if (p->sb_len < sizeof(p->sb))
+					p->sb[p->sb_len++] = c;
+				p->state = T_SB;
+				break;
+			}
+
+			p->state = T_DATA;
+
+			if (c != SE || p->sb_overflow || !p->sb_len || p->sb[0] != OPT_COM_PORT)
+				break;
+
+			if (com_port_command(p, p->sb + 1, p->sb_len - 1))
+				return -1;
+			break;
+		}
+	}
+
+	return 0;
+}
+
+static void disconnect(struct port *p)
+{
+	if (p->sock_fd < 0)
+		return;
+
+	if (verbose)
+		fprintf(stderr, "vb_bridge: port %u disconnected\n", p->index);
+
+	close(p->sock_fd);
+	close(p->tty_fd);
+
+	p->sock_fd = -1;
+	p->tty_fd = -1;
+}
+
+static int open_tty(struct port *p)
+{
+	char path[256];
+	struct termios tio;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s%u", device, p->index);
+
+	fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "vb_bridge: cannot open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	/* the modem lines are reported, they don't gate the data */
+	if (tcgetattr(fd, &tio) == 0) {
+		cfmakeraw(&tio);
+		tio.c_cflag |= CLOCAL | CREAD;
+		tcsetattr(fd, TCSANOW, &tio);
+	}
+
+	return fd;
+}
+
+static void accept_client(struct port *p)
+{
+	static const unsigned char hello[] = {
+		IAC, WILL, OPT_COM_PORT,
+		IAC, WILL, OPT_BINARY,
+		IAC, DO, OPT_BINARY,
+		IAC, WILL, OPT_SGA,
+	};
+	int fd, one = 1;
+
+	fd = accept4(p->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	/* one client per port, like a cable */
+	if (p->sock_fd >= 0) {
+		close(fd);
+		return;
+	}
+
+	p->tty_fd = open_tty(p);
+	if (p->tty_fd < 0) {
+		close(fd);
+		return;
+	}
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	p->sock_fd = fd;
+	p->state = T_DATA;
+	p->to_tty_len = 0;
+	p->to_sock_len = 0;
+	p->suspended = false;
+	p->notified = false;
+	p->modem_mask = 0xff;
+	p->line_mask = 0;
+	memset(p->we, 0, sizeof(p->we));
+	memset(p->they, 0, sizeof(p->they));
+
+	if (!raw) {
+		sock_queue(p, hello, sizeof(hello));
+
+		p->we[OPT_COM_PORT] = true;
+		p->we[OPT_BINARY] = true;
+		p->they[OPT_BINARY] = true;
+		p->we[OPT_SGA] = true;
+
+		p->modem = modem_state(p);
+	}
+
+	p->sock_events = EPOLLIN | EPOLLOUT;
+	p->tty_events = EPOLLIN;
+
+	if (watch(p->sock_fd, KIND_SOCKET, p->slot, p->sock_events) ||
+	    watch(p->tty_fd, KIND_TTY, p->slot, p->tty_events)) {
+		disconnect(p);
+		return;
+	}
+
+	if (verbose)
+		fprintf(stderr, "vb_bridge: port %u connected\n", p->index);
+}
+
+static int socket_readable(struct port *p)
+{
+	unsigned char in[CHUNK];
+	ssize_t n;
+
+	/* what is decoded never outgrows what was read */
+	n = recv(p->sock_fd, in, CHUNK - p->to_tty_len, 0);
+
+	if (n == 0)
+		return -1;
+	if (n < 0)
+		return errno == EAGAIN || errno == EINTR ? 0 : -1;
+
+	if (raw) {
+		memcpy(p->to_tty + p->to_tty_len, in, n);
+		p->to_tty_len += n;
+		return 0;
+	}
+
+	return telnet_input(p, in, n);
+}
+
+static int socket_writable(struct port *p)
+{
+	ssize_t n;
+
+	n = send(p->sock_fd, p->to_sock, p->to_sock_len, MSG_NOSIGNAL);
+
+	if (n < 0)
+		return errno == EAGAIN || errno == EINTR ? 0 : -1;
+
+	p->to_sock_len -= n;
+	memmove(p->to_sock, p->to_sock + n, p->to_sock_len);
+
+	return 0;
+}
+
+static int tty_readable(struct port *p)
+{
+	unsigned char in[CHUNK];
+	size_t room = SOCK_BUFFER - p->to_sock_len, i;
+	ssize_t n;
+
+	/* every byte may be an IAC that doubles, and answers need room too */
+	if (!raw)
+		room = room > REPLY_ROOM ? (room - REPLY_ROOM) / 2 : 0;
+
+	if (!room)
+		return 0;
+
+	n = read(p->tty_fd, in, room < CHUNK ? room : CHUNK);
+
+	/* a hangup, the pair went away */
+	if (n == 0)
+		return -1;
+	if (n < 0)
+		return errno == EAGAIN || errno == EINTR ? 0 : -1;
+
+	for (i = 0; i < (size_t)n; i++) {
+		p->to_sock[p->to_sock_len++] = in[i];
+
+		if (in[i] == IAC && !raw)
+			p->to_sock[p->to_sock_len++] = IAC;
+	}
+
+	return 0;
+}
+
+static int tty_writable(struct port *p)
+{
+	ssize_t n;
+
+	n = write(p->tty_fd, p->to_tty, p->to_tty_len);
+
+	if (n < 0)
+		return errno == EAGAIN || errno == EINTR ? 0 : -1;
+
+	p->to_tty_len -= n;
+	memmove(p->to_tty, p->to_tty + n, p->to_tty_len);
+
+	return 0;
+}
+
+static int handle(struct port *p, enum kind kind, uint32_t events)
+{
+	int err = 0;
+
+	if (kind == KIND_SOCKET) {
+		if (events & (EPOLLHUP | EPOLLERR))
+			return -1;
+		if (events & EPOLLIN)
+			err = socket_readable(p);
+		if (!err && (events & EPOLLOUT))
+			err = socket_writable(p);
+	} else {
+		if (events & EPOLLIN)
+			err = tty_readable(p);
+		else if (events & (EPOLLHUP | EPOLLERR))
+			return -1;
+		if (!err && (events & EPOLLOUT))
+			err = tty_writable(p);
+	}
+
+	if (err)
+		return err;
+
+	/* move what came in right away, without waiting for another round */
+	if (p->to_tty_len && tty_writable(p))
+		return -1;
+	if (p->to_sock_len && socket_writable(p))
+		return -1;
+
+	update_events(p);
+
+	return 0;
+}
+
+static int listen_on(const char *address, unsigned int port)
+{
+	struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+	int fd, one = 1;
+
+	if (inet_pton(AF_INET, address, &addr.sin_addr) != 1) {
+		fprintf(stderr, "vb_bridge: bad address %s\n", address);
+		return -1;
+	}
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 4)) {
+		fprintf(stderr, "vb_bridge: cannot listen on %s:%u: %s\n",
+			address, port, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [-a address] [-p port] [-f first] [-n count] [-d device] [-r] [-v]\n"
+		"  -a address  address to listen on (default 127.0.0.1)\n"
+		"  -p port     TCP port of the first pair, the next ones follow (default %d)\n"
+		"  -f first    index of the first pair (default 0)\n"
+		"  -n count    number of pairs to serve (default 1)\n"
+		"  -d device   prefix of the ports, the index is appended (default %s)\n"
+		"  -r          raw TCP, without Telnet and RFC 2217\n"
+		"  -v          log connections and commands\n",
+		name, DEFAULT_PORT, DEFAULT_DEVICE);
+}
+
+int main(int argc, char *argv[])
+{
+	struct itimerspec tick = {
+		.it_interval.tv_nsec = MODEM_POLL_MS * 1000000L,
+		.it_value.tv_nsec = MODEM_POLL_MS * 1000000L,
+	};
+	struct epoll_event events[MAX_EVENTS];
+	struct sigaction sa = { .sa_handler = on_signal };
+	const char *address = "127.0.0.1";
+	unsigned int base = DEFAULT_PORT, first = 0, count = 1, i;
+	struct port *ports, *p;
+	uint64_t expirations;
+	int timer_fd, opt, n, e, ret = 1;
+
+	while ((opt = getopt(argc, argv, "a:p:f:n:d:rvh")) != -1) {
+		switch (opt) {
+		case 'a':
+			address = optarg;
+			break;
+		case 'p':
+			base = atoi(optarg);
+			break;
+		case 'f':
+			first = atoi(optarg);
+			break;
+		case 'n':
+			count = atoi(optarg);
+			break;
+		case 'd':
+			device = optarg;
+			break;
+		case 'r':
+			raw = true;
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (!count || base + count > 65536) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	ports = calloc(count, sizeof(*ports));
+	if (!ports) {
+		fprintf(stderr, "vb_bridge: out of memory\n");
+		return 1;
+	}
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		fprintf(stderr, "vb_bridge: epoll: %s\n", strerror(errno));
+		goto free_ports;
+	}
+
+	for (i = 0; i < count; i++) {
+		p = &ports[i];
+
+		p->slot = i;
+		p->index = first + i;
+		p->listen_fd = -1;
+		p->sock_fd = -1;
+		p->tty_fd = -1;
+	}
+
+	for (i = 0; i < count; i++) {
+		p = &ports[i];
+
+		p->listen_fd = listen_on(address, base + i);
+
+		if (p->listen_fd < 0 || watch(p->listen_fd, KIND_LISTEN, i, EPOLLIN))
+			goto close_ports;
+	}
+
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timer_fd < 0 || timerfd_settime(timer_fd, 0, &tick, NULL) ||
+	    watch(timer_fd, KIND_TIMER, 0, EPOLLIN)) {
+		fprintf(stderr, "vb_bridge: timer: %s\n", strerror(errno));
+		goto close_timer;
+	}
+
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	fprintf(stderr, "vb_bridge: %s%u-%u on %s:%u-%u%s\n", device, first,
+		first + count - 1, address, base, base + count - 1, raw ? " (raw)" : "");
+
+	while (!stop) {
+		n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "vb_bridge: epoll_wait: %s\n", strerror(errno));
+			goto close_timer;
+		}
+
+		for (e = 0; e < n; e++) {
+			enum kind kind = events[e].data.u64 & 3;
+
+			if (kind == KIND_TIMER) {
+				if (read(timer_fd, &expirations, sizeof(expirations)) < 0)
+					continue;
+
+				for (i = 0; i < count && !raw; i++) {
+					p = &ports[i];
+
+					if (p->sock_fd < 0)
+						continue;
+
+					if (poll_modem(p))
+						disconnect(p);
+					else
+						update_events(p);
+				}
+				continue;
+			}
+
+			p = &ports[events[e].data.u64 >> 2];
+
+			if (kind == KIND_LISTEN) {
+				accept_client(p);
+				continue;
+			}
+
+			/* the other descriptor of a port closed in this round */
+			if (p->sock_fd < 0)
+				continue;
+
+			if (handle(p, kind, events[e].events))
+				disconnect(p);
+		}
+	}
+
+	ret = 0;
+
+close_timer:
+	if (timer_fd >= 0)
+		close(timer_fd);
+close_ports:
+	for (i = 0; i < count; i++) {
+		disconnect(&ports[i]);
+		if (ports[i].listen_fd >= 0)
+			close(ports[i].listen_fd);
+	}
+	close(epoll_fd);
+free_ports:
+	free(ports);
+
+	return ret;
+}
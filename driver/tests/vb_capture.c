@@ -0,0 +1,267 @@
+/*
+ * Serial Port Emulator traffic capture
+ *
+ * Copyright (C) 2023 Bruno Policarpo (bruno.freitas@cefet-rj.br)
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, version 2 of the License.
+ *
+ * Records the traffic of one pair through /dev/serialemu-capture and writes
+ * it as a pcap file. Each packet is one write, prefixed by two bytes: the
+ * direction (0 towards the Exogenous port, 1 towards the EmulatedPort) and
+ * the low byte of the record flags. The link type is LINKTYPE_USER0.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../include/virtualbot_ioctl.h"
+
+#define CAPTURE_DEVICE	"/dev/" SERIALEMU_CAPTURE_NAME
+
+#define PCAP_MAGIC_NS	0xa1b23c4d
+#define LINKTYPE_USER0	147
+#define SNAPLEN		65535
+
+struct pcap_header {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+};
+
+struct pcap_packet {
+	uint32_t ts_sec;
+	uint32_t ts_nsec;
+	uint32_t caplen;
+	uint32_t len;
+};
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+static long long clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int write_packet(FILE *out, const struct serialemu_capture_record *record,
+	long long realtime_offset)
+{
+	struct pcap_packet packet;
+	unsigned char prefix[2];
+	long long ts = (long long)record->timestamp + realtime_offset;
+
+	packet.ts_sec = ts / 1000000000LL;
+	packet.ts_nsec = ts % 1000000000LL;
+	packet.len = record->length + sizeof(prefix);
+	packet.caplen = packet.len;
+
+	prefix[0] = record->direction;
+	prefix[1] = record->flags & 0xff;
+
+	if (fwrite(&packet, sizeof(packet), 1, out) != 1 ||
+	    fwrite(prefix, sizeof(prefix), 1, out) != 1 ||
+	    fwrite(record + 1, 1, record->length, out) != record->length)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Consumes the complete records of the ring, returns how many were written
+ * or -1 on error.
+ */
+static long drain(struct serialemu_capture_ring *ring, unsigned char *data,
+	FILE *out, long long realtime_offset)
+{
+	const struct serialemu_capture_record *record;
+	uint64_t tail = ring->tail, offset, size = ring->data_size;
+	long count = 0;
+
+	for (;;) {
+		offset = tail & (size - 1);
+
+		if (size - offset < sizeof(*record)) {
+			tail += size - offset;
+			continue;
+		}
+
+		record = (const void *)(data + offset);
+
+		if (__atomic_load_n(&record->pos, __ATOMIC_ACQUIRE) != tail)
+			break;
+
+		if (!(record->flags & SERIALEMU_CAPTURE_PAD)) {
+			if (write_packet(out, record, realtime_offset))
+				return -1;
+			count++;
+		}
+
+		tail += (sizeof(*record) + record->length + SERIALEMU_CAPTURE_ALIGN - 1) &
+			~(uint64_t)(SERIALEMU_CAPTURE_ALIGN - 1);
+	}
+
+	/* the space is handed back once the records were copied out */
+	__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+	return count;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [-p port] [-s size] [-d seconds] -w file\n"
+		"  -p port     pair index to capture (default 0)\n"
+		"  -s size     ring size in bytes, a power of 2 (default 1048576)\n"
+		"  -d seconds  stop after this long (default: until interrupted)\n"
+		"  -w file     pcap file to write, - for stdout\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+	struct serialemu_capture request = { .size = 1 << 20 };
+	struct serialemu_capture_ring *ring;
+	struct pcap_header header = {
+		.magic = PCAP_MAGIC_NS,
+		.version_major = 2,
+		.version_minor = 4,
+		.snaplen = SNAPLEN,
+		.linktype = LINKTYPE_USER0,
+	};
+	struct pollfd pfd;
+	const char *path = NULL;
+	double seconds = 0;
+	long long deadline = 0, realtime_offset;
+	long n, total = 0;
+	size_t length;
+	FILE *out;
+	int fd, opt, ret = 1;
+
+	while ((opt = getopt(argc, argv, "p:s:d:w:h")) != -1) {
+		switch (opt) {
+		case 'p':
+			request.index = atoi(optarg);
+			break;
+		case 's':
+			request.size = strtoull(optarg, NULL, 0);
+			break;
+		case 'd':
+			seconds = atof(optarg);
+			break;
+		case 'w':
+			path = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (!path) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	fd = open(CAPTURE_DEVICE, O_RDWR);
+	if (fd < 0) {
+		fprintf(stderr, "vb_capture: cannot open %s: %s\n",
+			CAPTURE_DEVICE, strerror(errno));
+		return 1;
+	}
+
+	if (ioctl(fd, SERIALEMU_IOC_CAPTURE_START, &request)) {
+		fprintf(stderr, "vb_capture: cannot capture pair %u: %s\n",
+			request.index, strerror(errno));
+		goto close_fd;
+	}
+
+	length = sysconf(_SC_PAGESIZE) + request.size;
+
+	ring = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (ring == MAP_FAILED) {
+		fprintf(stderr, "vb_capture: mmap: %s\n", strerror(errno));
+		goto close_fd;
+	}
+
+	out = strcmp(path, "-") ? fopen(path, "wb") : stdout;
+	if (!out) {
+		fprintf(stderr, "vb_capture: cannot open %s: %s\n",
+			path, strerror(errno));
+		goto unmap;
+	}
+
+	if (fwrite(&header, sizeof(header), 1, out) != 1)
+		goto close_out;
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	/* records are stamped with CLOCK_MONOTONIC, pcap wants the wall clock */
+	realtime_offset = clock_ns(CLOCK_REALTIME) - clock_ns(CLOCK_MONOTONIC);
+
+	if (seconds > 0)
+		deadline = clock_ns(CLOCK_MONOTONIC) + (long long)(seconds * 1e9);
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+
+	while (!stop && (!deadline || clock_ns(CLOCK_MONOTONIC) < deadline)) {
+		if (poll(&pfd, 1, 100) < 0 && errno != EINTR)
+			break;
+
+		n = drain(ring, (unsigned char *)ring + ring->data_offset, out,
+			realtime_offset);
+		if (n < 0)
+			goto close_out;
+
+		total += n;
+		fflush(out);
+	}
+
+	n = drain(ring, (unsigned char *)ring + ring->data_offset, out,
+		realtime_offset);
+	if (n >= 0) {
+		total += n;
+		ret = 0;
+	}
+
+	fprintf(stderr, "vb_capture: %ld records, %llu lost\n",
+		total, (unsigned long long)ring->lost);
+
+close_out:
+	if (out != stdout)
+		fclose(out);
+unmap:
+	munmap(ring, length);
+close_fd:
+	close(fd);
+
+	return ret;
+}
@@ -0,0 +1,192 @@
+/*
+ * Serial Port Emulator traffic replay
+ *
+ * Copyright (C) 2023 Bruno Policarpo (bruno.freitas@cefet-rj.br)
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, version 2 of the License.
+ *
+ * Plays a pcap file written by vb_capture into one pair through
+ * /dev/serialemu-replay. The kernel delivers every packet at its recorded
+ * time, this program only feeds it the records and waits for the end.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "../include/virtualbot_ioctl.h"
+
+#define REPLAY_DEVICE	"/dev/" SERIALEMU_REPLAY_NAME
+
+#define PCAP_MAGIC_US	0xa1b2c3d4
+#define PCAP_MAGIC_NS	0xa1b23c4d
+#define LINKTYPE_USER0	147
+
+struct pcap_header {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+};
+
+struct pcap_packet {
+	uint32_t ts_sec;
+	uint32_t ts_frac;
+	uint32_t caplen;
+	uint32_t len;
+};
+
+struct replay_record {
+	struct serialemu_capture_record header;
+	unsigned char data[SERIALEMU_REPLAY_MAX_LENGTH];
+};
+
+static int write_all(int fd, const void *buffer, size_t count)
+{
+	const unsigned char *p = buffer;
+	ssize_t n;
+
+	while (count) {
+		n = write(fd, p, count);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		count -= n;
+	}
+
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [-p port] [-x speed] -r file\n"
+		"  -p port     pair index to replay into (default 0)\n"
+		"  -x speed    1 for the recorded pace, 2 twice as fast, 0 as fast as possible\n"
+		"  -r file     pcap file written by vb_capture, - for stdin\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+	struct serialemu_replay request = { .speed = SERIALEMU_REPLAY_REALTIME };
+	struct pcap_header header;
+	struct pcap_packet packet;
+	struct replay_record record;
+	unsigned char prefix[2];
+	const char *path = NULL;
+	uint64_t ns_per_frac;
+	long total = 0;
+	FILE *in;
+	int fd, opt, ret = 1;
+
+	while ((opt = getopt(argc, argv, "p:x:r:h")) != -1) {
+		switch (opt) {
+		case 'p':
+			request.index = atoi(optarg);
+			break;
+		case 'x':
+			request.speed = atof(optarg) * SERIALEMU_REPLAY_REALTIME;
+			break;
+		case 'r':
+			path = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (!path) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	in = strcmp(path, "-") ? fopen(path, "rb") : stdin;
+	if (!in) {
+		fprintf(stderr, "vb_replay: cannot open %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	if (fread(&header, sizeof(header), 1, in) != 1 ||
+	    (header.magic != PCAP_MAGIC_US && header.magic != PCAP_MAGIC_NS) ||
+	    header.linktype != LINKTYPE_USER0) {
+		fprintf(stderr, "vb_replay: %s is not a vb_capture file\n", path);
+		goto close_in;
+	}
+
+	ns_per_frac = header.magic == PCAP_MAGIC_NS ? 1 : 1000;
+
+	fd = open(REPLAY_DEVICE, O_WRONLY);
+	if (fd < 0) {
+		fprintf(stderr, "vb_replay: cannot open %s: %s\n",
+			REPLAY_DEVICE, strerror(errno));
+		goto close_in;
+	}
+
+	if (ioctl(fd, SERIALEMU_IOC_REPLAY_START, &request)) {
+		fprintf(stderr, "vb_replay: cannot replay into pair %u: %s\n",
+			request.index, strerror(errno));
+		goto close_fd;
+	}
+
+	while (fread(&packet, sizeof(packet), 1, in) == 1) {
+
+		if (packet.caplen < sizeof(prefix) ||
+		    packet.caplen - sizeof(prefix) > SERIALEMU_REPLAY_MAX_LENGTH ||
+		    fread(prefix, sizeof(prefix), 1, in) != 1) {
+			fprintf(stderr, "vb_replay: bad packet after %ld records\n", total);
+			goto close_fd;
+		}
+
+		memset(&record.header, 0, sizeof(record.header));
+		record.header.timestamp = packet.ts_sec * 1000000000ULL +
+			packet.ts_frac * ns_per_frac;
+		record.header.length = packet.caplen - sizeof(prefix);
+		record.header.direction = prefix[0];
+
+		if (fread(record.data, 1, record.header.length, in) != record.header.length) {
+			fprintf(stderr, "vb_replay: truncated packet after %ld records\n", total);
+			goto close_fd;
+		}
+
+		/* the write blocks while the kernel queue is full */
+		if (write_all(fd, &record, sizeof(record.header) + record.header.length)) {
+			fprintf(stderr, "vb_replay: write: %s\n", strerror(errno));
+			goto close_fd;
+		}
+
+		total++;
+	}
+
+	/* returns once the last record was delivered */
+	if (fsync(fd)) {
+		fprintf(stderr, "vb_replay: fsync: %s\n", strerror(errno));
+		goto close_fd;
+	}
+
+	fprintf(stderr, "vb_replay: %ld records replayed\n", total);
+	ret = 0;
+
+close_fd:
+	close(fd);
+close_in:
+	if (in != stdin)
+		fclose(in);
+
+	return ret;
+}
@@ -0,0 +1,562 @@
+/*
+ * Serial Port Emulator stress test
+ *
+ * Copyright (C) 2023 Bruno Policarpo (bruno.freitas@cefet-rj.br)
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, version 2 of the License.
+ *
+ * Drives many pairs at once with full-duplex traffic and checks that every
+ * byte arrives once, in order, on the right port.
+ *
+ * Each pair runs sessions: both ports are opened, both sides write numbered
+ * and checksummed records while the termios of the ports are changed, then
+ * the writers stop, the readers wait for the last record and both ports are
+ * closed. Meanwhile a churn thread keeps opening and closing extra
+ * descriptors on random ports. Records name their pair, direction and
+ * session, so data lost, reordered, corrupted or delivered to another pair
+ * is counted. The exit status is 1 when any of that happened.
+ *
+ * It only uses the ports, so it can run as is on a kernel built with
+ * lockdep, KASAN or KCSAN.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define EMULATED_PORT	"/dev/ttyEmulatedPort"
+#define EXOGENOUS_PORT	"/dev/ttyExogenous"
+
+#define RECORD_MAGIC	0x56425354	/* "VBST" */
+#define MAX_PAYLOAD	512
+#define READ_CHUNK	65536
+
+/* Time the readers wait for the last record of a session */
+#define DRAIN_TIMEOUT_MS	5000
+
+/* Length of a session, chosen at random between these */
+#define SESSION_MIN_MS	50
+#define SESSION_MAX_MS	500
+
+struct record_header {
+	uint32_t magic;
+	uint16_t pair;
+	uint8_t direction;	/* 0 written on the EmulatedPort, 1 on the Exogenous port */
+	uint8_t reserved;
+	uint32_t session;
+	uint32_t seq;
+	uint32_t length;	/* of the payload that follows */
+	uint32_t crc;		/* of the payload */
+};
+
+struct counters {
+	atomic_llong bytes;
+	atomic_llong records;
+	atomic_llong lost;
+	atomic_llong reordered;
+	atomic_llong corrupt;
+	atomic_llong leaked;
+	atomic_llong write_errors;
+	atomic_llong sessions;
+	atomic_llong reopens;
+	atomic_llong termios_changes;
+};
+
+static struct counters counters;
+
+static atomic_int stopping;
+
+struct direction_ctx {
+	int pair;
+	int direction;
+	uint32_t session;
+
+	int wfd;
+	int rfd;
+
+	/* set by the writer once it stops, read by the reader */
+	atomic_uint sent;
+	atomic_int writer_done;
+
+	long long deadline;
+	unsigned int seed;
+
+	pthread_t writer;
+	pthread_t reader;
+};
+
+struct pair_ctx {
+	int pair;
+	unsigned int seed;
+	pthread_t thread;
+};
+
+static int base_port, npairs;
+static long long end_ns;
+
+static uint32_t crc_table[256];
+
+static void crc_init(void)
+{
+	uint32_t c;
+	int i, k;
+
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (k = 0; k < 8; k++)
+			c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+		crc_table[i] = c;
+	}
+}
+
+static uint32_t crc32(const unsigned char *data, size_t length)
+{
+	uint32_t c = 0xffffffff;
+
+	while (length--)
+		c = crc_table[(c ^ *data++) & 0xff] ^ (c >> 8);
+
+	return c ^ 0xffffffff;
+}
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int open_raw(const char *prefix, int port, int flags)
+{
+	struct termios tio;
+	char path[64];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s%d", prefix, port);
+
+	fd = open(path, flags | O_NOCTTY);
+	if (fd < 0) {
+		fprintf(stderr, "vb_stress: cannot open %s: %s\n",
+			path, strerror(errno));
+		return -1;
+	}
+
+	if (tcgetattr(fd, &tio) == 0) {
+		cfmakeraw(&tio);
+		tio.c_cflag |= CLOCAL;
+		tio.c_cc[VMIN] = 1;
+		tio.c_cc[VTIME] = 0;
+		tcsetattr(fd, TCSANOW, &tio);
+	}
+
+	return fd;
+}
+
+static int write_all(int fd, const void *buffer, size_t count)
+{
+	const unsigned char *p = buffer;
+	ssize_t n;
+
+	while (count) {
+		n = write(fd, p, count);
+		if (n < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			return -1;
+		}
+		p += n;
+		count -= n;
+	}
+
+	return 0;
+}
+
+static void *writer_thread(void *arg)
+{
+	struct direction_ctx *ctx = arg;
+	unsigned char record[sizeof(struct record_header) + MAX_PAYLOAD];
+	struct record_header *header = (struct record_header *)record;
+	unsigned char *payload = record + sizeof(*header);
+	uint32_t seq = 0, i;
+
+	while (now_ns() < ctx->deadline && !atomic_load(&stopping)) {
+
+		header->magic = RECORD_MAGIC;
+		header->pair = ctx->pair;
+		header->direction = ctx->direction;
+		header->reserved = 0;
+		header->session = ctx->session;
+		header->seq = seq;
+		header->length = rand_r(&ctx->seed) % (MAX_PAYLOAD + 1);
+
+		for (i = 0; i < header->length; i++)
+			payload[i] = rand_r(&ctx->seed);
+
+		header->crc = crc32(payload, header->length);
+
+		if (write_all(ctx->wfd, record, sizeof(*header) + header->length)) {
+			fprintf(stderr, "vb_stress: pair %d direction %d write: %s\n",
+				ctx->pair, ctx->direction, strerror(errno));
+			atomic_fetch_add(&counters.write_errors, 1);
+			break;
+		}
+
+		seq++;
+	}
+
+	atomic_store(&ctx->sent, seq);
+	atomic_store(&ctx->writer_done, 1);
+
+	return NULL;
+}
+
+/*
+ * Checks one record, returns the sequence number expected next
+ */
+static uint32_t check_record(struct direction_ctx *ctx,
+	const struct record_header *header,
+	const unsigned char *payload,
+	uint32_t expected)
+{
+	if (header->pair != ctx->pair || header->direction != ctx->direction ||
+	    header->session != ctx->session) {
+		atomic_fetch_add(&counters.leaked, 1);
+		return expected;
+	}
+
+	if (crc32(payload, header->length) != header->crc)
+		atomic_fetch_add(&counters.corrupt, 1);
+
+	if (header->seq > expected)
+		atomic_fetch_add(&counters.lost, header->seq - expected);
+	else if (header->seq < expected)
+		atomic_fetch_add(&counters.reordered, 1);
+
+	atomic_fetch_add(&counters.records, 1);
+	atomic_fetch_add(&counters.bytes, sizeof(*header) + header->length);
+
+	return header->seq + 1;
+}
+
+static void *reader_thread(void *arg)
+{
+	struct direction_ctx *ctx = arg;
+	struct record_header header;
+	struct pollfd pfd = { .fd = ctx->rfd, .events = POLLIN };
+	unsigned char *buffer;
+	size_t have = 0, used, record;
+	uint32_t expected = 0;
+	long long idle_since = 0;
+	ssize_t n;
+
+	buffer = malloc(READ_CHUNK * 2);
+	if (!buffer)
+		return NULL;
+
+	for (;;) {
+		/* the writer stopped and everything it sent is here */
+		if (atomic_load(&ctx->writer_done) &&
+		    expected >= atomic_load(&ctx->sent) && !have)
+			break;
+
+		if (poll(&pfd, 1, 100) <= 0) {
+			if (!atomic_load(&ctx->writer_done))
+				continue;
+
+			if (!idle_since)
+				idle_since = now_ns();
+			else if (now_ns() - idle_since > DRAIN_TIMEOUT_MS * 1000000LL)
+				break;
+
+			continue;
+		}
+
+		idle_since = 0;
+
+		n = read(ctx->rfd, buffer + have, READ_CHUNK * 2 - have);
+		if (n < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			fprintf(stderr, "vb_stress: pair %d direction %d read: %s\n",
+				ctx->pair, ctx->direction, strerror(errno));
+			break;
+		}
+		if (n == 0)
+			break;
+
+		have += n;
+		used = 0;
+
+		while (have - used >= sizeof(header)) {
+
+			memcpy(&header, buffer + used, sizeof(header));
+
+			if (header.magic != RECORD_MAGIC || header.length > MAX_PAYLOAD) {
+				/* lost the record boundary, look for the next one */
+				atomic_fetch_add(&counters.corrupt, 1);
+				used++;
+				continue;
+			}
+
+			record = sizeof(header) + header.length;
+			if (have - used < record)
+				break;
+
+			expected = check_record(ctx, &header, buffer + used + sizeof(header),
+				expected);
+
+			used += record;
+		}
+
+		memmove(buffer, buffer + used, have - used);
+		have -= used;
+	}
+
+	if (expected < atomic_load(&ctx->sent)) {
+		fprintf(stderr, "vb_stress: pair %d direction %d session %u: "
+			"%u of %u records missing\n", ctx->pair, ctx->direction,
+			ctx->session, atomic_load(&ctx->sent) - expected,
+			atomic_load(&ctx->sent));
+		atomic_fetch_add(&counters.lost, atomic_load(&ctx->sent) - expected);
+	}
+
+	free(buffer);
+
+	return NULL;
+}
+
+/* Changes the speed of a port while the data flows, the data must not care */
+static void change_termios(int fd, unsigned int *seed)
+{
+	static const speed_t speeds[] = { B9600, B57600, B115200, B230400 };
+	struct termios tio;
+
+	if (tcgetattr(fd, &tio))
+		return;
+
+	cfsetspeed(&tio, speeds[rand_r(seed) % (sizeof(speeds) / sizeof(*speeds))]);
+
+	if (!tcsetattr(fd, TCSANOW, &tio))
+		atomic_fetch_add(&counters.termios_changes, 1);
+}
+
+static int run_session(int pair, uint32_t session, unsigned int *seed)
+{
+	struct direction_ctx dir[2];
+	long long deadline;
+	int emulated, exogenous, i;
+
+	/* the Exogenous port first, so the EmulatedPort never writes into the void */
+	exogenous = open_raw(EXOGENOUS_PORT, base_port + pair, O_RDWR | O_NONBLOCK);
+	if (exogenous < 0)
+		return -1;
+
+	emulated = open_raw(EMULATED_PORT, base_port + pair, O_RDWR | O_NONBLOCK);
+	if (emulated < 0) {
+		close(exogenous);
+		return -1;
+	}
+
+	/* blocking writes, the readers poll */
+	fcntl(emulated, F_SETFL, 0);
+	fcntl(exogenous, F_SETFL, 0);
+
+	deadline = now_ns() + (SESSION_MIN_MS +
+		rand_r(seed) % (SESSION_MAX_MS - SESSION_MIN_MS)) * 1000000LL;
+
+	for (i = 0; i < 2; i++) {
+		memset(&dir[i], 0, sizeof(dir[i]));
+		dir[i].pair = pair;
+		dir[i].direction = i;
+		dir[i].session = session;
+		dir[i].wfd = i ? exogenous : emulated;
+		dir[i].rfd = i ? emulated : exogenous;
+		dir[i].deadline = deadline;
+		dir[i].seed = rand_r(seed);
+		atomic_init(&dir[i].sent, 0);
+		atomic_init(&dir[i].writer_done, 0);
+
+		pthread_create(&dir[i].reader, NULL, reader_thread, &dir[i]);
+		pthread_create(&dir[i].writer, NULL, writer_thread, &dir[i]);
+	}
+
+	while (now_ns() < deadline && !atomic_load(&stopping)) {
+		usleep(10000 + rand_r(seed) % 40000);
+		change_termios(rand_r(seed) & 1 ? emulated : exogenous, seed);
+	}
+
+	for (i = 0; i < 2; i++) {
+		pthread_join(dir[i].writer, NULL);
+		pthread_join(dir[i].reader, NULL);
+	}
+
+	close(emulated);
+	close(exogenous);
+
+	atomic_fetch_add(&counters.sessions, 1);
+
+	return 0;
+}
+
+static void *pair_thread(void *arg)
+{
+	struct pair_ctx *ctx = arg;
+	uint32_t session = 0;
+
+	while (now_ns() < end_ns && !atomic_load(&stopping)) {
+		if (run_session(ctx->pair, session++, &ctx->seed)) {
+			atomic_store(&stopping, 1);
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Opens and closes extra descriptors on random ports: they are never the
+ * last ones, so the traffic must not notice
+ */
+static void *churn_thread(void *arg)
+{
+	unsigned int seed = *(unsigned int *)arg;
+	int fd, pair;
+
+	while (now_ns() < end_ns && !atomic_load(&stopping)) {
+		pair = rand_r(&seed) % npairs;
+
+		fd = open_raw(rand_r(&seed) & 1 ? EMULATED_PORT : EXOGENOUS_PORT,
+			base_port + pair, O_RDWR | O_NONBLOCK);
+
+		if (fd >= 0) {
+			usleep(rand_r(&seed) % 5000);
+			close(fd);
+			atomic_fetch_add(&counters.reopens, 1);
+		}
+
+		usleep(rand_r(&seed) % 2000);
+	}
+
+	return NULL;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [-p port] [-n pairs] [-d seconds] [-c threads] [-s seed]\n"
+		"  -p port     first pair index to use (default 0)\n"
+		"  -n pairs    number of pairs driven at once (default 4)\n"
+		"  -d seconds  duration of the test (default 30)\n"
+		"  -c threads  threads reopening ports (default 1)\n"
+		"  -s seed     seed of the random traffic (default the time)\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+	struct pair_ctx *pairs;
+	pthread_t *churners;
+	unsigned int seed = time(NULL), *churn_seeds;
+	double seconds = 30.0, elapsed;
+	long long start, failures;
+	int nchurners = 1, opt, i;
+
+	npairs = 4;
+
+	while ((opt = getopt(argc, argv, "p:n:d:c:s:h")) != -1) {
+		switch (opt) {
+		case 'p':
+			base_port = atoi(optarg);
+			break;
+		case 'n':
+			npairs = atoi(optarg);
+			break;
+		case 'd':
+			seconds = atof(optarg);
+			break;
+		case 'c':
+			nchurners = atoi(optarg);
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (npairs < 1 || nchurners < 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	crc_init();
+
+	pairs = calloc(npairs, sizeof(*pairs));
+	churners = calloc(nchurners + 1, sizeof(*churners));
+	churn_seeds = calloc(nchurners + 1, sizeof(*churn_seeds));
+	if (!pairs || !churners || !churn_seeds)
+		return 1;
+
+	fprintf(stderr, "vb_stress: %d pairs from %d for %.0f s, seed %u\n",
+		npairs, base_port, seconds, seed);
+
+	start = now_ns();
+	end_ns = start + (long long)(seconds * 1e9);
+
+	for (i = 0; i < npairs; i++) {
+		pairs[i].pair = i;
+		pairs[i].seed = seed + i;
+		pthread_create(&pairs[i].thread, NULL, pair_thread, &pairs[i]);
+	}
+
+	for (i = 0; i < nchurners; i++) {
+		churn_seeds[i] = seed ^ (0x9e3779b9 * (i + 1));
+		pthread_create(&churners[i], NULL, churn_thread, &churn_seeds[i]);
+	}
+
+	for (i = 0; i < npairs; i++)
+		pthread_join(pairs[i].thread, NULL);
+
+	for (i = 0; i < nchurners; i++)
+		pthread_join(churners[i], NULL);
+
+	elapsed = (now_ns() - start) / 1e9;
+
+	failures = atomic_load(&counters.lost) + atomic_load(&counters.reordered) +
+		atomic_load(&counters.corrupt) + atomic_load(&counters.leaked) +
+		atomic_load(&counters.write_errors);
+
+	printf("sessions         %lld\n", atomic_load(&counters.sessions));
+	printf("reopens          %lld\n", atomic_load(&counters.reopens));
+	printf("termios changes  %lld\n", atomic_load(&counters.termios_changes));
+	printf("records          %lld\n", atomic_load(&counters.records));
+	printf("throughput       %.2f MB/s\n", atomic_load(&counters.bytes) / elapsed / 1e6);
+	printf("lost             %lld\n", atomic_load(&counters.lost));
+	printf("reordered        %lld\n", atomic_load(&counters.reordered));
+	printf("corrupt          %lld\n", atomic_load(&counters.corrupt));
+	printf("leaked           %lld\n", atomic_load(&counters.leaked));
+	printf("write errors     %lld\n", atomic_load(&counters.write_errors));
+	printf("%s\n", failures || atomic_load(&stopping) ? "FAILED" : "PASSED");
+
+	free(churn_seeds);
+	free(churners);
+	free(pairs);
+
+	return failures || atomic_load(&stopping) ? 1 : 0;
+}